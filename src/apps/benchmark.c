@@ -0,0 +1,343 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <ulang.h>
+#define SOKOL_IMPL
+#include <apps/sokol_time.h>
+
+#define MAX_SOURCES 16384
+#define ALLOCATION_HEADER 16
+
+// Generated sources are written to disk so the benchmark includes ulang_file_read.
+typedef struct source {
+	char name[64];
+	char *text;
+	size_t length;
+	size_t capacity;
+} source;
+
+static source sources[MAX_SOURCES];
+static int numSources;
+static size_t numLines;
+
+static source *source_new(const char *prefix, int index) {
+	source *src = &sources[numSources++];
+	snprintf(src->name, sizeof(src->name), "benchmark_%s_%i.ul", prefix, index);
+	src->capacity = 1024;
+	src->length = 0;
+	src->text = malloc(src->capacity);
+	return src;
+}
+
+static void source_append(source *src, const char *format, ...) {
+	va_list args;
+	va_start(args, format);
+	int length = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (src->length + length + 1 > src->capacity) {
+		while (src->length + length + 1 > src->capacity) src->capacity *= 2;
+		src->text = realloc(src->text, src->capacity);
+	}
+	va_start(args, format);
+	vsnprintf(src->text + src->length, length + 1, format, args);
+	va_end(args);
+	for (int i = 0; i < length; i++) numLines += src->text[src->length + i] == '\n';
+	src->length += length;
+}
+
+// Dominated by what the tokenizer spends its time on: indentation, comments,
+// identifiers and numeric literals.
+static void append_token_block(source *src, int block) {
+	source_append(src,
+				  "# ------------------------------------------------------------------------\n"
+				  "# Block %i, generated to exercise white space, comments, and literals.\n"
+				  "block_with_a_long_label_name_%i:\n"
+				  "\tmov 0x%08x, r1                        # hexadecimal literal\n"
+				  "\tadd r1, %i, r2                          # integer literal\n"
+				  "\tmov %i.%03i, r3                          # float literal\n"
+				  "\tjmp block_end_%i\n"
+				  "block_data_%i: byte %i, %i, %i, %i, %i, %i, %i, %i\n"
+				  "block_end_%i:\n\n",
+				  block, block, block * 2654435761u, block % 100000, block % 1000, block % 997, block,
+				  block, block & 0xff, (block >> 1) & 0xff, (block >> 2) & 0xff, (block >> 3) & 0xff,
+				  (block >> 4) & 0xff, (block >> 5) & 0xff, (block >> 6) & 0xff, (block >> 7) & 0xff,
+				  block);
+}
+
+static void generate_tokens(int numLinesTarget) {
+	source *src = source_new("tokens", 0);
+	for (int block = 0; numLines < (size_t) numLinesTarget; block++) append_token_block(src, block);
+	source_append(src, "halt\n");
+}
+
+// The same blocks as tokens, sized in MB instead of lines.
+static void generate_corpus(int numMegaBytes) {
+	source *src = source_new("corpus", 0);
+	for (int block = 0; src->length < (size_t) numMegaBytes * 1024 * 1024; block++) append_token_block(src, block);
+	source_append(src, "halt\n");
+}
+
+// Every line defines a label and jumps to another one, each jump is patched.
+static void generate_labels(int numLinesTarget) {
+	source *src = source_new("labels", 0);
+	for (int i = 0; i < numLinesTarget; i++)
+		source_append(src, "label_%i: jmp label_%i\n", i, (int) ((i * 7919u) % (unsigned) numLinesTarget));
+	source_append(src, "halt\n");
+}
+
+// Half of the lines define constants, the other half use them in expressions.
+static void generate_constants(int numLinesTarget) {
+	source *src = source_new("constants", 0);
+	for (int i = 0; i < numLinesTarget / 2; i++) {
+		source_append(src, "const CONSTANT_%i %i\n", i, i);
+		source_append(src, "mov CONSTANT_%i + CONSTANT_%i * 2, r1\n", i, i / 2);
+	}
+	source_append(src, "halt\n");
+}
+
+// Long data lists with repeats.
+static void generate_data(int numLinesTarget) {
+	source *src = source_new("data", 0);
+	source_append(src, "const bytes_size 32\nhalt\n");
+	for (int i = 0; i < numLinesTarget / 2; i++) {
+		source_append(src, "bytes_%i: byte %i, 1, 2, 3, 4 x 16, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15\n", i, i & 0xff);
+		source_append(src, "ints_%i: int %i, 0x%x x 8, -1, 2, -3, 4, -5, 6, -7, 8, bytes_size\n", i, i, i * 31);
+	}
+}
+
+// A binary tree of includes, each file assembles a few blocks of its own.
+static void generate_includes(int numLinesTarget) {
+	int numFiles = numLinesTarget / 64;
+	if (numFiles > MAX_SOURCES) numFiles = MAX_SOURCES;
+	if (numFiles < 1) numFiles = 1;
+	int numBlocks = numLinesTarget / numFiles / 6;
+	for (int i = 0; i < numFiles; i++) {
+		source *src = source_new("includes", i);
+		if (i == 0) source_append(src, "jmp main\n");
+		for (int block = 0; block < numBlocks; block++)
+			source_append(src, "const FILE_%i_%i %i\nfile_%i_%i: mov FILE_%i_%i, r1\nadd r1, r2, r2\nret\n", i, block, block, i, block, i, block);
+		for (int child = 2 * i + 1; child <= 2 * i + 2 && child < numFiles; child++)
+			source_append(src, "include \"benchmark_includes_%i.ul\"\n", child);
+		if (i == 0) source_append(src, "main: call file_%i_0\nhalt\n", numFiles - 1);
+	}
+}
+
+// Long expressions mixing literals, constants, and labels.
+static void generate_expressions(int numLinesTarget) {
+	source *src = source_new("expressions", 0);
+	source_append(src, "const SHIFT 3\nconst MASK 0xff\n");
+	for (int i = 0; i < numLinesTarget; i++) {
+		source_append(src, "expression_%i: mov ((((expression_%i + %i) * 3 - (SHIFT * 4)) | MASK) ^ (%i %% 7 + ~%i)) & (expression_%i / SHIFT) + "
+						   "(-(%i / 3) * (MASK & %i) | (SHIFT * SHIFT - 1)), r1\n",
+					   i, (i * 31) % numLinesTarget, i, i, i, i / 2, i, i);
+	}
+	source_append(src, "halt\n");
+}
+
+static size_t liveBytes, peakBytes;
+
+static void *tracking_alloc(size_t numBytes, void *userData) {
+	uint8_t *block = malloc(numBytes + ALLOCATION_HEADER);
+	memcpy(block, &numBytes, sizeof(size_t));
+	liveBytes += numBytes;
+	if (liveBytes > peakBytes) peakBytes = liveBytes;
+	(void) userData;
+	return block + ALLOCATION_HEADER;
+}
+
+static void tracking_free(void *ptr, void *userData) {
+	if (!ptr) return;
+	uint8_t *block = (uint8_t *) ptr - ALLOCATION_HEADER;
+	size_t numBytes;
+	memcpy(&numBytes, block, sizeof(size_t));
+	liveBytes -= numBytes;
+	free(block);
+	(void) userData;
+}
+
+static void *tracking_realloc(void *old, size_t numBytes, void *userData) {
+	if (!old) return tracking_alloc(numBytes, userData);
+	uint8_t *block = (uint8_t *) old - ALLOCATION_HEADER;
+	size_t oldNumBytes;
+	memcpy(&oldNumBytes, block, sizeof(size_t));
+	block = realloc(block, numBytes + ALLOCATION_HEADER);
+	memcpy(block, &numBytes, sizeof(size_t));
+	liveBytes = liveBytes - oldNumBytes + numBytes;
+	if (liveBytes > peakBytes) peakBytes = liveBytes;
+	return block + ALLOCATION_HEADER;
+}
+
+static uint64_t now(void) {
+	return stm_now();
+}
+
+#define BIT_ITERATIONS 1000000
+
+// Each loop computes r2 from r1 and mixes it back into r1, once with an instruction
+// and once with the sequence guest code had to use before. r1 stays positive, so the
+// sequences don't overflow.
+static struct {
+	const char *name;
+	const char *instruction;
+	const char *emulated;
+} bitBenchmarks[] = {
+		{"popcnt", "popcnt r1, r2\n",
+				"shru r1, 1, r3\nand r3, 0x55555555, r3\nsub r1, r3, r3\nand r3, 0x33333333, r4\nshru r3, 2, r3\nand r3, 0x33333333, r3\n"
+				"add r3, r4, r3\nshru r3, 4, r4\nadd r3, r4, r3\nand r3, 0x0f0f0f0f, r3\nshru r3, 8, r4\nadd r3, r4, r3\nshru r3, 16, r4\n"
+				"add r3, r4, r3\nand r3, 0x3f, r2\n"},
+		{"clz",    "clz r1, r2\n",
+				"mov 32, r2\ncmp r1, 0, r5\nje r5, clz_done\nmov 0, r2\nmov r1, r3\n"
+				"shru r3, 16, r4\ncmp r4, 0, r5\njne r5, clz_8\nadd r2, 16, r2\nshl r3, 16, r3\n"
+				"clz_8: shru r3, 24, r4\ncmp r4, 0, r5\njne r5, clz_4\nadd r2, 8, r2\nshl r3, 8, r3\n"
+				"clz_4: shru r3, 28, r4\ncmp r4, 0, r5\njne r5, clz_2\nadd r2, 4, r2\nshl r3, 4, r3\n"
+				"clz_2: shru r3, 30, r4\ncmp r4, 0, r5\njne r5, clz_1\nadd r2, 2, r2\nshl r3, 2, r3\n"
+				"clz_1: shru r3, 31, r4\ncmp r4, 0, r5\njne r5, clz_done\nadd r2, 1, r2\nclz_done:\n"},
+		{"bswap",  "bswap r1, r2\n",
+				"shl r1, 24, r2\nshru r1, 24, r3\nor r2, r3, r2\nand r1, 0xff00, r3\nshl r3, 8, r3\nor r2, r3, r2\n"
+				"shru r1, 8, r3\nand r3, 0xff00, r3\nor r2, r3, r2\n"},
+		{"rol",    "rol r1, 7, r2\n",
+				"shl r1, 7, r3\nshru r1, 25, r4\nor r3, r4, r2\n"},
+};
+
+static const char *guestCode;
+
+static ulang_bool read_guest(const char *filename, ulang_file *file) {
+	return ulang_file_from_memory(filename, guestCode, file);
+}
+
+// Runs a loop around body numRuns times and returns the best time in ns per iteration,
+// or a negative value if the loop didn't compile. result is set to the final r1.
+static double run_bit_loop(const char *body, int numRuns, int32_t *result) {
+	char code[2048];
+	snprintf(code, sizeof(code), "mov %i, r10\nmov 0x12345678, r1\nloop:\n%sxor r1, r2, r1\nxor r1, r10, r1\nand r1, 0x7fffffff, r1\nsub r10, 1, r10\ncmp r10, 0, r11\njg r11, loop\nhalt\n",
+			 BIT_ITERATIONS, body);
+	guestCode = code;
+	ulang_error error = {0};
+	ulang_program program = {0};
+	if (!ulang_compile("bits.ul", read_guest, &program, &error, NULL)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return -1;
+	}
+	uint64_t best = 0;
+	for (int run = 0; run < numRuns; run++) {
+		ulang_vm vm = {0};
+		ulang_vm_init(&vm, &program, NULL);
+		uint64_t start = stm_now();
+		while (ulang_vm_step(&vm));
+		uint64_t time = stm_since(start);
+		if (run == 0 || time < best) best = time;
+		*result = vm.registers[0].i;
+		ulang_vm_free(&vm);
+	}
+	ulang_program_free(&program);
+	return stm_ns(best) / BIT_ITERATIONS;
+}
+
+static ulang_bool run_bit_benchmarks(int numRuns) {
+	printf("\nBit manipulation, best of %i runs, ns per loop iteration\n", numRuns);
+	printf("%-12s %12s %12s %9s\n", "operation", "instruction", "emulated", "speedup");
+	for (size_t i = 0; i < sizeof(bitBenchmarks) / sizeof(bitBenchmarks[0]); i++) {
+		int32_t instructionResult, emulatedResult;
+		double instruction = run_bit_loop(bitBenchmarks[i].instruction, numRuns, &instructionResult);
+		double emulated = run_bit_loop(bitBenchmarks[i].emulated, numRuns, &emulatedResult);
+		if (instruction < 0 || emulated < 0) return UL_FALSE;
+		if (instructionResult != emulatedResult) {
+			printf("%s: emulated result %i doesn't match %i\n", bitBenchmarks[i].name, emulatedResult, instructionResult);
+			return UL_FALSE;
+		}
+		printf("%-12s %12.2f %12.2f %8.2fx\n", bitBenchmarks[i].name, instruction, emulated, emulated / instruction);
+	}
+	return UL_TRUE;
+}
+
+static ulang_bool run_scenario(const char *name, void (*generate)(int), int numLinesTarget, int numRuns) {
+	numSources = 0;
+	numLines = 0;
+	generate(numLinesTarget);
+	size_t numBytes = 0;
+	for (int i = 0; i < numSources; i++) {
+		FILE *file = fopen(sources[i].name, "wb");
+		if (!file || fwrite(sources[i].text, 1, sources[i].length, file) != sources[i].length) {
+			printf("Couldn't write %s\n", sources[i].name);
+			if (file) fclose(file);
+			return UL_FALSE;
+		}
+		fclose(file);
+		numBytes += sources[i].length;
+	}
+
+	ulang_compile_profile best = {0};
+	uint64_t bestTotal = 0;
+	ulang_bool result = UL_TRUE;
+	for (int run = 0; run < numRuns && result; run++) {
+		ulang_error error = {0};
+		ulang_program program = {0};
+		ulang_compile_profile profile = {now};
+		peakBytes = liveBytes;
+		uint64_t start = stm_now();
+		result = ulang_compile_profiled(sources[0].name, ulang_file_read, &program, &error, NULL, &profile);
+		uint64_t total = stm_since(start);
+		if (!result) {
+			ulang_error_print(&error);
+			ulang_error_free(&error);
+			break;
+		}
+		ulang_program_free(&program);
+		if (run == 0 || total < bestTotal) {
+			best = profile;
+			bestTotal = total;
+		}
+	}
+	for (int i = 0; i < numSources; i++) {
+		remove(sources[i].name);
+		free(sources[i].text);
+	}
+	if (!result) return UL_FALSE;
+
+	printf("%-12s %9zu %8.2f %9.2f %9.2f %9.2f %9.2f %9.2f %12.0f %9.2f\n", name, numLines, numBytes / (1024.0 * 1024.0),
+		   stm_ms(best.fileRead), stm_ms(best.tokenize), stm_ms(best.assemble), stm_ms(best.link), stm_ms(bestTotal),
+		   numLines / stm_sec(bestTotal), peakBytes / (1024.0 * 1024.0));
+	return UL_TRUE;
+}
+
+int main(int argc, char **argv) {
+	int scale = argc > 1 ? atoi(argv[1]) : 1;
+	int numRuns = argc > 2 ? atoi(argv[2]) : 3;
+	if (scale <= 0 || numRuns <= 0) {
+		printf("Usage: benchmark <scale>? <num-runs>?");
+		return -1;
+	}
+
+	ulang_allocator *allocator = ulang_default_allocator();
+	allocator->allocFunction = tracking_alloc;
+	allocator->reallocFunction = tracking_realloc;
+	allocator->freeFunction = tracking_free;
+	stm_setup();
+
+	struct {
+		const char *name;
+		void (*generate)(int);
+	} scenarios[] = {
+			{"tokens",      generate_tokens},
+			{"labels",      generate_labels},
+			{"constants",   generate_constants},
+			{"data",        generate_data},
+			{"includes",    generate_includes},
+			{"expressions", generate_expressions},
+	};
+	int sizes[] = {10000, 100000, 1000000};
+
+	printf("Best of %i runs, times in ms, peak allocation in MB\n", numRuns);
+	printf("%-12s %9s %8s %9s %9s %9s %9s %9s %12s %9s\n", "scenario", "lines", "MB", "read", "tokenize", "assemble", "link", "total", "lines/s",
+		   "peak");
+	for (size_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); i++) {
+		for (size_t j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+			if (!run_scenario(scenarios[i].name, scenarios[i].generate, sizes[j] * scale, numRuns)) return -1;
+		}
+	}
+	if (!run_scenario("corpus", generate_corpus, 100 * scale, numRuns)) return -1;
+	if (!run_bit_benchmarks(numRuns)) return -1;
+	return 0;
+}
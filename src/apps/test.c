@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
@@ -45,7 +46,10 @@ ulang_bool read_test(const char *filename, ulang_file *file) {
 	return ulang_file_from_memory(filename, testCode, file);
 }
 
-ulang_bool test(size_t testNum, test_case *test) {
+// Optimized programs get the same checks. If the optimizer changed the code, data moved
+// down by the removed bytes, so data checks are moved along and checks of the pc or of
+// code are skipped.
+ulang_bool test(size_t testNum, test_case *test, ulang_bool optimize) {
 	ulang_program program = {0};
 	ulang_error error = {0};
 	ulang_vm vm = {0};
@@ -62,7 +66,8 @@ ulang_bool test(size_t testNum, test_case *test) {
 		file_read_function = read_test;
 	}
 
-	ulang_compile(filename, file_read_function, &program, &error);
+	ulang_compile_options options = {optimize};
+	ulang_compile_with_options(filename, file_read_function, &program, &error, NULL, &options);
 	if (error.is_set) {
 		printf("Test #%zu: compilation error\n", testNum);
 		ulang_error_print(&error);
@@ -70,59 +75,78 @@ ulang_bool test(size_t testNum, test_case *test) {
 		ulang_program_free(&program);
 		return UL_FALSE;
 	}
+	ulang_bool optimized = UL_FALSE;
+	size_t codeLength = 0, dataEnd = 0;
+	if (optimize) {
+		ulang_program plain = {0};
+		ulang_compile(filename, file_read_function, &plain, &error, NULL);
+		optimized = plain.codeLength != program.codeLength || memcmp(plain.code, program.code, plain.codeLength);
+		codeLength = plain.codeLength;
+		dataEnd = plain.codeLength + plain.dataLength + plain.reservedBytes;
+		ulang_program_free(&plain);
+	}
 
-	ulang_vm_init(&vm, &program);
+	ulang_vm_init(&vm, &program, NULL);
 	while (ulang_vm_step(&vm));
 	char checkErrorMessage[256] = {0};
+	if (optimized && vm.error.is_set) goto error;
 
 	for (int i = 0; i < MAX_CHECKS; i++) {
 		check *check = &test->checks[i];
+		uint32_t address = check->address;
+		if (optimized) {
+			if (check->type >= REG_INT && check->reg == PC) continue;
+			if (check->type != NONE && check->type < REG_INT) {
+				if (address < codeLength) continue;
+				if (address < dataEnd) address -= (uint32_t) (codeLength - program.codeLength);
+			}
+		}
 		switch (check->type) {
 			case NONE:
 				goto done;
 			case MEM_BYTE: {
-				int32_t memValue = vm.memory[check->address];
+				int32_t memValue = vm.memory[address];
 				int32_t expValue = check->val_int;
 				if (memValue != expValue) {
 					snprintf(checkErrorMessage, sizeof checkErrorMessage,
 							 "Byte value at address [%u]: %i (0x%x) != %i (0x%x)\n",
-							 check->address, memValue, memValue, expValue, expValue);
+							 address, memValue, memValue, expValue, expValue);
 					goto error;
 				}
 				break;
 			}
 			case MEM_SHORT: {
 				int32_t memValue;
-				memcpy(&memValue, &vm.memory[check->address], 2);
+				memcpy(&memValue, &vm.memory[address], 2);
 				int32_t expValue = check->val_int;
 				if (memValue != expValue) {
 					snprintf(checkErrorMessage, sizeof checkErrorMessage,
 							 "Short value at address [%u]: %i (0x%x) != %i (0x%x)\n",
-							 check->address, memValue, memValue, expValue, expValue);
+							 address, memValue, memValue, expValue, expValue);
 					goto error;
 				}
 				break;
 			}
 			case MEM_INT: {
 				int32_t memValue;
-				memcpy(&memValue, &vm.memory[check->address], 4);
+				memcpy(&memValue, &vm.memory[address], 4);
 				int32_t expValue = check->val_int;
 				if (memValue != expValue) {
 					snprintf(checkErrorMessage, sizeof checkErrorMessage,
 							 "Int value at address [%u]: %i (0x%x) != %i (0x%x)\n",
-							 check->address, memValue, memValue, expValue, expValue);
+							 address, memValue, memValue, expValue, expValue);
 					goto error;
 				}
 				break;
 			}
 			case MEM_FLOAT: {
 				float memValue;
-				memcpy(&memValue, &vm.memory[check->address], 4);
+				memcpy(&memValue, &vm.memory[address], 4);
 				float expValue = check->val_float;
 				if (memValue != expValue) {
 					snprintf(checkErrorMessage, sizeof checkErrorMessage,
 							 "Float value at address [%u]: %f != %f\n",
-							 check->address, memValue, expValue);
+							 address, memValue, expValue);
 					goto error;
 				}
 				break;
@@ -165,6 +189,588 @@ ulang_bool test(size_t testNum, test_case *test) {
 	return UL_FALSE;
 }
 
+ulang_bool test_optimizer() {
+	ulang_program program = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "mov 3, r1\n"
+			   "mov r1, r1\n"
+			   "add r1, 0, r1\n"
+			   "add r1, 0, r2\n"
+			   "mul r2, 8, r3\n"
+			   "divu r3, 4, r4\n"
+			   "push r4\n"
+			   "pop r4\n"
+			   "push r4\n"
+			   "pop r5\n"
+			   "nop\n"
+			   "jmp skip\n"
+			   "mov 99, r1\n"
+			   "skip: mov value, r6\n"
+			   "ld r6, 0, r6\n"
+			   "halt\n"
+			   "value: int 123";
+	ulang_compile_options options = {UL_TRUE};
+	if (!ulang_compile_with_options("test.ul", read_test, &program, &error, NULL, &options)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return UL_FALSE;
+	}
+
+	ulang_file *file;
+	ulang_label *skip = ulang_program_get_label(&program, "skip", 4);
+	if (options.numRemovedInstructions != 6 || ulang_program_get_line(&program, (uint32_t) skip->address >> 2, &file) != 14 || file != program.files[0] ||
+		ulang_program_get_line(&program, 1, &file) != 4) {
+		printf("Optimizer: removed %zu instructions, or lines are off\n", options.numRemovedInstructions);
+		goto done;
+	}
+	ulang_vm_init(&vm, &program, NULL);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	int32_t expected[] = {3, 3, 24, 6, 6, 123};
+	for (int i = 0; i < 6; i++) {
+		if (vm.registers[i].i != expected[i]) {
+			printf("Optimizer: expected r%i = %i, got %i\n", i + 1, expected[i], vm.registers[i].i);
+			goto done;
+		}
+	}
+	result = UL_TRUE;
+
+	done:
+	ulang_program_free(&program);
+	return result;
+}
+
+// Small integers and jumps close by take one word, others keep their value word
+ulang_bool test_short_encodings() {
+	ulang_program program = {0}, longJumps = {0}, far = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "mov -5, r1\n"
+			   "sub r1, 3, r2\n"
+			   "add r1, 5000, r3\n"
+			   "cmp r2, -8, r4\n"
+			   "push -4096\n"
+			   "pop r5\n"
+			   "loop: add r6, 1, r6\n"
+			   "cmp r6, 3, r7\n"
+			   "jl r7, loop\n"
+			   "halt";
+	ulang_compile_options options = {0};
+	options.longJumps = UL_TRUE;
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL) || !ulang_compile_with_options("test.ul", read_test, &longJumps, &error, NULL, &options)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		goto done;
+	}
+	if (program.codeLength != 11 * 4 || longJumps.codeLength != 12 * 4) {
+		printf("Short encodings: code lengths %zu and %zu\n", program.codeLength, longJumps.codeLength);
+		goto done;
+	}
+	ulang_vm_init(&vm, &program, NULL);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	int32_t expected[] = {-5, -8, 4995, 0, -4096, 3};
+	for (int i = 0; i < 6; i++) {
+		if (vm.registers[i].i != expected[i]) {
+			printf("Short encodings: expected r%i = %i, got %i\n", i + 1, expected[i], vm.registers[i].i);
+			goto done;
+		}
+	}
+
+	// A target further than 4095 words keeps the jump in two words
+	size_t numNops = 5000;
+	char *farCode = malloc(numNops * 4 + 64), *end = farCode;
+	end += sprintf(end, "jmp far\n");
+	for (size_t i = 0; i < numNops; i++) end += sprintf(end, "nop\n");
+	sprintf(end, "far: mov 1, r1\nhalt");
+	testCode = farCode;
+	ulang_bool compiled = ulang_compile("test.ul", read_test, &far, &error, NULL);
+	free(farCode);
+	if (!compiled) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		goto done;
+	}
+	ulang_vm_init(&vm, &far, NULL);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	if (far.codeLength != (numNops + 4) * 4 || vm.registers[R1].i != 1 || vm.registers[PC].ui != far.codeLength) {
+		printf("Short encodings: far jump took %zu bytes of code, r1 = %i\n", far.codeLength, vm.registers[R1].i);
+		goto done;
+	}
+	result = UL_TRUE;
+
+	done:
+	ulang_program_free(&far);
+	ulang_program_free(&longJumps);
+	ulang_program_free(&program);
+	return result;
+}
+
+// Branches close by comparing to small immediates or registers take one word
+ulang_bool test_compare_and_branch() {
+	ulang_program program = {0}, longJumps = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "mov 0, r1\n"
+			   "mov 1000, r2\n"
+			   "loop: add r1, 1, r1\n"
+			   "bl r1, -5, loop\n"
+			   "bl r1, 10, loop\n"
+			   "bl r1, r2, loop\n"
+			   "bgu r1, 1000, loop\n"
+			   "halt";
+	ulang_compile_options options = {0};
+	options.longJumps = UL_TRUE;
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL) || !ulang_compile_with_options("test.ul", read_test, &longJumps, &error, NULL, &options)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		goto done;
+	}
+	if (program.codeLength != 9 * 4 || longJumps.codeLength != 12 * 4) {
+		printf("Compare and branch: code lengths %zu and %zu\n", program.codeLength, longJumps.codeLength);
+		goto done;
+	}
+	ulang_program *programs[] = {&program, &longJumps};
+	for (int i = 0; i < 2; i++) {
+		ulang_vm_init(&vm, programs[i], NULL);
+		while (ulang_vm_step(&vm));
+		ulang_vm_free(&vm);
+		if (vm.registers[R1].i != 1000 || vm.error.is_set) {
+			printf("Compare and branch: expected r1 = 1000, got %i\n", vm.registers[R1].i);
+			goto done;
+		}
+	}
+
+	// Immediates have to fit the offset field, floats have to be whole numbers
+	const char *invalid[] = {"x: bl r1, 5000, x", "x: bl r1, 1.0, x", "x: blf r1, 0.5, x"};
+	for (int i = 0; i < 3; i++) {
+		ulang_program failed = {0};
+		testCode = invalid[i];
+		if (ulang_compile("test.ul", read_test, &failed, &error, NULL)) {
+			printf("Compare and branch: compiled %s\n", invalid[i]);
+			ulang_program_free(&failed);
+			goto done;
+		}
+		ulang_error_free(&error);
+		ulang_program_free(&failed);
+	}
+	result = UL_TRUE;
+
+	done:
+	ulang_program_free(&longJumps);
+	ulang_program_free(&program);
+	return result;
+}
+
+static size_t run_counted(ulang_program *program, ulang_profile *profile, ulang_vm *vm) {
+	size_t numSteps = 0;
+	ulang_vm_init(vm, program, NULL);
+	vm->profile = profile;
+	while (ulang_vm_step(vm)) numSteps++;
+	ulang_vm_free(vm);
+	return numSteps;
+}
+
+// The rarely taken path of the loop moves behind it, the hot path no longer jumps over it
+ulang_bool test_profile_layout() {
+	ulang_program program = {0}, laidOut = {0};
+	ulang_profile profile = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0}, laidOutVm = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "mov 0, r1\n"
+			   "mov 0, r4\n"
+			   "loop: cmp r1, 999, r3\n"
+			   "je r3, rare\n"
+			   "add r4, 1, r4\n"
+			   "jmp next\n"
+			   "rare: add r4, 100, r4\n"
+			   "next: add r1, 1, r1\n"
+			   "cmp r1, 1000, r3\n"
+			   "jl r3, loop\n"
+			   "halt";
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return UL_FALSE;
+	}
+	ulang_profile_init(&profile, &program);
+	size_t numSteps = run_counted(&program, &profile, &vm);
+	ulang_bool saved = ulang_profile_save(&profile, "test.ulp");
+	ulang_profile_free(&profile);
+
+	ulang_compile_options options = {0};
+	options.layoutProfile = "test.ulp";
+	if (!saved || !ulang_compile_with_options("test.ul", read_test, &laidOut, &error, NULL, &options)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		goto done;
+	}
+	size_t numLaidOutSteps = run_counted(&laidOut, NULL, &laidOutVm);
+	ulang_file *file;
+	ulang_label *rare = ulang_program_get_label(&laidOut, "rare", 4);
+	if (!options.numMovedBlocks || numLaidOutSteps >= numSteps || rare->address + 8 != laidOut.codeLength ||
+		ulang_program_get_line(&laidOut, (uint32_t) rare->address >> 2, &file) != 7) {
+		printf("Profile layout: moved %zu blocks, %zu steps instead of %zu\n", options.numMovedBlocks, numLaidOutSteps, numSteps);
+		goto done;
+	}
+	if (laidOutVm.registers[R1].i != 1000 || laidOutVm.registers[R4].i != 1099 || laidOutVm.error.is_set) {
+		printf("Profile layout: expected r1 = 1000, r4 = 1099, got %i, %i\n", laidOutVm.registers[R1].i, laidOutVm.registers[R4].i);
+		goto done;
+	}
+
+	// A profile of other code leaves the layout alone
+	testCode = "mov 1, r1\nhalt";
+	ulang_program_free(&laidOut);
+	if (!ulang_compile_with_options("test.ul", read_test, &laidOut, &error, NULL, &options) || options.numMovedBlocks) {
+		printf("Profile layout: used a profile of other code\n");
+		goto done;
+	}
+	result = UL_TRUE;
+
+	done:
+	remove("test.ulp");
+	ulang_program_free(&laidOut);
+	ulang_program_free(&program);
+	return result;
+}
+
+ulang_bool test_coverage() {
+	ulang_program program = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	ulang_coverage coverage = {0}, other = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "mov 1, r1\ncmp r1, 1, r2\nje r2, end\nmov 2, r1\nend: halt";
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return UL_FALSE;
+	}
+
+	// the first run takes the branch and skips the second mov
+	ulang_coverage_init(&coverage, &program);
+	ulang_vm_init(&vm, &program, NULL);
+	vm.coverage = &coverage;
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	if (coverage.bits[0] != 0x17) {
+		printf("Coverage: expected bits 0x17, got 0x%x\n", coverage.bits[0]);
+		goto done;
+	}
+
+	// the second run starts at the second mov, merging both covers all instructions
+	ulang_coverage_init(&other, &program);
+	ulang_vm_init(&vm, &program, NULL);
+	vm.coverage = &other;
+	vm.registers[PC].ui = 3 * 4;
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	ulang_coverage_merge(&coverage, &other);
+	if (coverage.bits[0] != 0x1f) {
+		printf("Coverage: expected merged bits 0x1f, got 0x%x\n", coverage.bits[0]);
+		goto done;
+	}
+	if (!ulang_coverage_write_lcov(&coverage, &program, "test_coverage.info")) {
+		printf("Coverage: couldn't write lcov file\n");
+		goto done;
+	}
+	remove("test_coverage.info");
+	result = UL_TRUE;
+
+	done:
+	ulang_coverage_free(&coverage);
+	ulang_coverage_free(&other);
+	ulang_program_free(&program);
+	return result;
+}
+
+static void *counting_alloc(size_t numBytes, void *userData) {
+	(*(size_t *) userData)++;
+	return malloc(numBytes);
+}
+
+static void *counting_realloc(void *old, size_t numBytes, void *userData) {
+	if (!old) (*(size_t *) userData)++;
+	return realloc(old, numBytes);
+}
+
+static void counting_free(void *ptr, void *userData) {
+	(*(size_t *) userData)--;
+	free(ptr);
+}
+
+ulang_bool test_allocator() {
+	size_t live = 0;
+	ulang_allocator allocator = {counting_alloc, counting_realloc, counting_free, &live};
+	ulang_program program = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+
+	testCode = "const N 10\nmov N, r1\nloop: sub r1, 1, r1\ncmp r1, 0, r2\njg r2, loop\nhalt";
+	if (!ulang_compile("test.ul", read_test, &program, &error, &allocator)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return UL_FALSE;
+	}
+	ulang_vm_init(&vm, &program, &allocator);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+
+	// Loaded images copy their files out through the allocator as well
+	ulang_bool saved = ulang_program_save(&program, "test.ulb", UL_TRUE, &error);
+	ulang_program_free(&program);
+	size_t defaultAllocs = ulang_default_allocator()->allocs;
+	if (!saved || !ulang_program_load("test.ulb", &program, &error, &allocator)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		remove("test.ulb");
+		return UL_FALSE;
+	}
+	remove("test.ulb");
+	if (ulang_default_allocator()->allocs != defaultAllocs) {
+		printf("Allocator: loading used the default allocator\n");
+		ulang_program_free(&program);
+		return UL_FALSE;
+	}
+	ulang_program_free(&program);
+
+	if (allocator.allocs == 0 || allocator.allocs != allocator.frees || live != 0) {
+		printf("Allocator: %zu allocations, %zu frees, %zu live\n", allocator.allocs, allocator.frees, live);
+		return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+ulang_bool test_binary_image() {
+	ulang_program program = {0}, loaded = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "const N 10\nmov N, r1\nloop: sub r1, 1, r1\ncmp r1, 0, r2\njg r2, loop\nhalt\nvalue: int 123";
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL) || !ulang_program_save(&program, "test.ulb", UL_TRUE, &error) ||
+		!ulang_program_load("test.ulb", &loaded, &error, NULL)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		ulang_program_free(&program);
+		remove("test.ulb");
+		return UL_FALSE;
+	}
+	remove("test.ulb");
+
+	ulang_label *label = ulang_program_get_label(&loaded, "value", 5);
+	ulang_label *original = ulang_program_get_label(&program, "value", 5);
+	if (loaded.codeLength != program.codeLength || memcmp(loaded.code, program.code, program.codeLength) ||
+		loaded.dataLength != program.dataLength || memcmp(loaded.data, program.data, program.dataLength)) {
+		printf("Binary image: code or data differs\n");
+		goto done;
+	}
+	if (!label || label->target != original->target || label->address != original->address || loaded.constantsLength != 1 || loaded.constants[0].i != 10) {
+		printf("Binary image: labels or constants differ\n");
+		goto done;
+	}
+	if (loaded.filesLength != 1 || loaded.lineRangesLength != program.lineRangesLength ||
+		memcmp(loaded.lineRanges, program.lineRanges, sizeof(ulang_line_range) * program.lineRangesLength)) {
+		printf("Binary image: debug info differs\n");
+		goto done;
+	}
+
+	ulang_vm_init(&vm, &loaded, NULL);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	if (vm.registers[R1].i != 0) {
+		printf("Binary image: expected r1 = 0, got %i\n", vm.registers[R1].i);
+		goto done;
+	}
+
+	// Lookups of missing names would never end on a label table without an empty slot
+	size_t tableOffset = (uint8_t *) loaded.labelTable - (uint8_t *) loaded.image;
+	size_t numSlots = loaded.labelTableLength;
+	ulang_program_free(&loaded);
+	memset(&loaded, 0, sizeof(ulang_program));
+	if (!ulang_program_save(&program, "test.ulb", UL_TRUE, &error)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		goto done;
+	}
+	FILE *file = fopen("test.ulb", "r+b");
+	for (size_t i = 0; file && i < numSlots; i++) {
+		uint32_t slot = 1;
+		fseek(file, (long) (tableOffset + i * sizeof(uint32_t)), SEEK_SET);
+		fwrite(&slot, sizeof(uint32_t), 1, file);
+	}
+	if (file) fclose(file);
+	if (!file || ulang_program_load("test.ulb", &loaded, &error, NULL)) {
+		printf("Binary image: loaded a label table without empty slots\n");
+		remove("test.ulb");
+		goto done;
+	}
+	ulang_error_free(&error);
+	remove("test.ulb");
+
+	// Images whose code and data don't fit the VM's memory are rejected
+	ulang_program_free(&loaded);
+	ulang_program_free(&program);
+	testCode = "halt\nd: byte 1 x 34000000";
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL) || !ulang_program_save(&program, "test.ulb", UL_FALSE, &error)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		goto done;
+	}
+	if (ulang_program_load("test.ulb", &loaded, &error, NULL)) {
+		printf("Binary image: loaded an image larger than the VM's memory\n");
+		remove("test.ulb");
+		goto done;
+	}
+	ulang_error_free(&error);
+	remove("test.ulb");
+	result = UL_TRUE;
+
+	done:
+	ulang_program_free(&loaded);
+	ulang_program_free(&program);
+	return result;
+}
+
+// Instructions of a line share a range, stripping drops lines and files but keeps symbols
+ulang_bool test_line_table() {
+	ulang_program program = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	ulang_bool result = UL_FALSE;
+
+	testCode = "const N 10\nmov N, r1\nloop: sub r1, 1, r1\ncmp r1, 0, r2\njg r2, loop\nhalt";
+	if (!ulang_compile("test.ul", read_test, &program, &error, NULL)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return UL_FALSE;
+	}
+
+	ulang_file *file;
+	ulang_label *loop = ulang_program_get_label(&program, "loop", 4);
+	if (program.lineRangesLength != 5 || ulang_program_get_line(&program, 0, &file) != 2 ||
+		ulang_program_get_line(&program, (uint32_t) loop->address >> 2, &file) != 3 || file != program.files[0] ||
+		ulang_program_get_line(&program, (uint32_t) program.codeLength >> 2, &file) != 0 || file) {
+		printf("Line table: unexpected lines\n");
+		goto done;
+	}
+
+	ulang_program_strip(&program);
+	loop = ulang_program_get_label(&program, "loop", 4);
+	if (program.files || program.lineRanges || ulang_program_get_line(&program, 0, &file) != 0 || !loop || program.constants[0].name.data.data[0] != 'N') {
+		printf("Line table: strip kept debug info or lost symbols\n");
+		goto done;
+	}
+	ulang_vm_init(&vm, &program, NULL);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	result = vm.registers[R1].i == 0;
+
+	done:
+	ulang_program_free(&program);
+	return result;
+}
+
+// Streamed images lack debug info, they must match a stripped image of a regular compile
+ulang_bool test_streaming_compile() {
+	const char *files[] = {"tests/fib.ul", "tests/a.ul", "tests/starfield/program.ul", "tests/raw.ul"};
+	for (size_t i = 0; i < sizeof(files) / sizeof(files[0]); i++) {
+		ulang_program program = {0};
+		ulang_error error = {0};
+		ulang_file image = {0}, streamed = {0};
+		ulang_compile_options options = {0};
+		options.longJumps = UL_TRUE;
+		if (!ulang_compile_with_options(files[i], ulang_file_read, &program, &error, NULL, &options) || !ulang_program_save(&program, "test.ulb", UL_FALSE, &error) ||
+			!ulang_compile_to_image(files[i], "test-stream.ulb", &error, NULL)) {
+			ulang_error_print(&error);
+			ulang_error_free(&error);
+			ulang_program_free(&program);
+			remove("test.ulb");
+			remove("test-stream.ulb");
+			return UL_FALSE;
+		}
+		ulang_program_free(&program);
+		ulang_bool result = ulang_file_read("test.ulb", &image) && ulang_file_read("test-stream.ulb", &streamed) &&
+							image.length == streamed.length && !memcmp(image.data, streamed.data, image.length);
+		ulang_file_free(&image);
+		ulang_file_free(&streamed);
+		remove("test.ulb");
+		remove("test-stream.ulb");
+		if (!result) {
+			printf("Streaming compile: image of %s differs\n", files[i]);
+			return UL_FALSE;
+		}
+	}
+	return UL_TRUE;
+}
+
+static const char *cacheMain;
+static const char *cacheLib = "lib: mov SEVEN, r2\nret";
+
+static ulang_bool read_cache_test(const char *filename, ulang_file *file) {
+	if (!strcmp(filename, "main.ul")) return ulang_file_from_memory(filename, cacheMain, file);
+	if (!strcmp(filename, "lib.ul")) return ulang_file_from_memory(filename, cacheLib, file);
+	return UL_FALSE;
+}
+
+static ulang_bool run_cached(ulang_compile_cache *cache, int32_t expectedR1, int32_t expectedR2) {
+	ulang_program program = {0};
+	ulang_error error = {0};
+	ulang_vm vm = {0};
+	if (!ulang_compile_cached(cache, "main.ul", read_cache_test, &program, &error)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return UL_FALSE;
+	}
+	ulang_vm_init(&vm, &program, NULL);
+	while (ulang_vm_step(&vm));
+	ulang_vm_free(&vm);
+	ulang_bool result = vm.registers[R1].i == expectedR1 && vm.registers[R2].i == expectedR2 && program.filesLength == 2 &&
+						ulang_program_get_label(&program, "lib", 3) != NULL;
+	if (!result) printf("Compile cache: expected r1 = %i, r2 = %i, got %i, %i\n", expectedR1, expectedR2, vm.registers[R1].i, vm.registers[R2].i);
+	ulang_program_free(&program);
+	return result;
+}
+
+ulang_bool test_compile_cache() {
+	ulang_compile_cache *cache = ulang_compile_cache_new(NULL);
+	ulang_compile_cache_stats stats;
+	ulang_bool result = UL_FALSE;
+
+	// a fresh compile, an unchanged recompile, an edit of the main file only that
+	// reuses the lib unit, and a change of the constant the lib unit imports
+	cacheMain = "const SEVEN 7\njmp start\ninclude \"lib.ul\"\nstart: call lib\nmov 1, r1\nhalt";
+	if (!run_cached(cache, 1, 7) || !run_cached(cache, 1, 7)) goto done;
+	cacheMain = "const SEVEN 7\njmp start\ninclude \"lib.ul\"\nstart: call lib\nmov 2, r1\nhalt";
+	if (!run_cached(cache, 2, 7)) goto done;
+	cacheMain = "const SEVEN 8\njmp start\ninclude \"lib.ul\"\nstart: call lib\nmov 2, r1\nhalt";
+	if (!run_cached(cache, 2, 8)) goto done;
+
+	ulang_compile_cache_get_stats(cache, &stats);
+	if (stats.programHits != 1 || stats.programMisses != 3 || stats.tokenHits != 1 || stats.tokenMisses != 4 || stats.unitHits != 1 ||
+		stats.unitMisses != 5) {
+		printf("Compile cache: unexpected stats, program %zu/%zu, tokens %zu/%zu, units %zu/%zu\n", stats.programHits, stats.programMisses,
+			   stats.tokenHits, stats.tokenMisses, stats.unitHits, stats.unitMisses);
+		goto done;
+	}
+	result = UL_TRUE;
+
+	done:
+	ulang_compile_cache_free(cache);
+	return result;
+}
+
 int main(int argc, char **argv) {
 	// @formatter:off
 	test_case tests[] = {
@@ -295,26 +901,27 @@ int main(int argc, char **argv) {
 			{"mov 1.432, r1\nmov 1.432, r2\ncmpf r1, r2, r3",                                            {{REG_INT, .reg = R3, .val_int = 0}}},
 
 			// jmp, je, jne, jl, jg, jle, jge
-			{"jmp l\nhalt\nl: mov 123, r1\n",                                                            {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 1, r1\nje r1, l\nhalt\nl: mov 123, r1\n",                               {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 2, r2\nje r2, l\nmov 123, r1\nl: halt\n",                               {{REG_INT, .reg = PC, .val_uint = 36}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 2, r1\njne r1, l\nhalt\nl: mov 123, r1\n",                              {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 1, r2\njne r2, l\nmov 123, r1\nl: halt\n",                              {{REG_INT, .reg = PC, .val_uint = 36}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 2, r1\njl r1, l\nhalt\nl: mov 123, r1\n",                               {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, -1, r2\njl r2, l\nmov 123, r1\nl: halt\n",                              {{REG_INT, .reg = PC, .val_uint = 36}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 2, r1\ncmp r1, 1, r1\njg r1, l\nhalt\nl: mov 123, r1\n",                               {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov -1, r1\ncmp r1, 1, r2\njg r2, l\nmov 123, r1\nl: halt\n",                              {{REG_INT, .reg = PC, .val_uint = 36}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 1, r1\njle r1, l\nhalt\nl: mov 123, r1\n",                              {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov -1, r1\ncmp r1, 1, r1\njle r1, l\nhalt\nl: mov 123, r1\n",                             {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, -1, r2\njle r2, l\nmov 123, r1\nl: halt\n",                             {{REG_INT, .reg = PC, .val_uint = 36}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, 1, r1\njge r1, l\nhalt\nl: mov 123, r1\n",                              {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov 1, r1\ncmp r1, -1, r1\njge r1, l\nhalt\nl: mov 123, r1\n",                             {{REG_INT, .reg = PC, .val_uint = 40}, {REG_INT, .reg = R1, .val_int = 123}}},
-			{"mov -1, r1\ncmp r1, 1, r2\njge r2, l\nmov 123, r1\nl: halt\n",                             {{REG_INT, .reg = PC, .val_uint = 36}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"jmp l\nhalt\nl: mov 123, r1\n",                                                            {{REG_INT, .reg = PC, .val_uint = 16}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 1, r1\nje r1, l\nhalt\nl: mov 123, r1\n",                               {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 2, r2\nje r2, l\nmov 123, r1\nl: halt\n",                               {{REG_INT, .reg = PC, .val_uint = 20}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 2, r1\njne r1, l\nhalt\nl: mov 123, r1\n",                              {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 1, r2\njne r2, l\nmov 123, r1\nl: halt\n",                              {{REG_INT, .reg = PC, .val_uint = 20}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 2, r1\njl r1, l\nhalt\nl: mov 123, r1\n",                               {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, -1, r2\njl r2, l\nmov 123, r1\nl: halt\n",                              {{REG_INT, .reg = PC, .val_uint = 20}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 2, r1\ncmp r1, 1, r1\njg r1, l\nhalt\nl: mov 123, r1\n",                               {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov -1, r1\ncmp r1, 1, r2\njg r2, l\nmov 123, r1\nl: halt\n",                              {{REG_INT, .reg = PC, .val_uint = 20}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 1, r1\njle r1, l\nhalt\nl: mov 123, r1\n",                              {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov -1, r1\ncmp r1, 1, r1\njle r1, l\nhalt\nl: mov 123, r1\n",                             {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, -1, r2\njle r2, l\nmov 123, r1\nl: halt\n",                             {{REG_INT, .reg = PC, .val_uint = 20}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, 1, r1\njge r1, l\nhalt\nl: mov 123, r1\n",                              {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov 1, r1\ncmp r1, -1, r1\njge r1, l\nhalt\nl: mov 123, r1\n",                             {{REG_INT, .reg = PC, .val_uint = 24}, {REG_INT, .reg = R1, .val_int = 123}}},
+			{"mov -1, r1\ncmp r1, 1, r2\njge r2, l\nmov 123, r1\nl: halt\n",                             {{REG_INT, .reg = PC, .val_uint = 20}, {REG_INT, .reg = R1, .val_int = 123}}},
 
 
 			// load, store int
 			{"ld a, 1, r1\nhalt\na: byte 1 int 0xdeadbeef\n",                                            {{REG_INT, .reg = R1, .val_int = 0xdeadbeef}}},
 			{"mov a, r1\nld r1, 2, r2\nhalt\na: byte 0 x 2 int 0xdeadbeef",                              {{REG_INT, .reg = R2, .val_int = 0xdeadbeef}}},
+			{"halt\na: int 7 x 100000",                                                                 {{MEM_INT, .address = 4 + 99999 * 4, .val_int = 7}}}, // Grows past twice the arena's block size
 			{"mov 0xdeadbeef, r1\nsto r1, a, 0\nhalt\na: int 123",                                       {{MEM_INT, .address = 5 * 4, .val_int = 0xdeadbeef}}},
 			{"mov 0xdeadbeef, r1\nmov a, r2\nsto r1, r2, 0\nhalt\nreserve byte x 1\na: reserve int x 1", {{REG_INT, .reg = R2, .val_int = 25},  {MEM_INT, .address = 6 * 4 + 1, .val_int = 0xdeadbeef}}},
 
@@ -327,14 +934,47 @@ int main(int argc, char **argv) {
 			// load, store byte
 			{"ldb a, 1, r1\nhalt\na: byte 1 byte -1\n",                                                  {{REG_INT, .reg = R1, .val_int = 0xff}}},
 			{"mov a, r1\nldb r1, 2, r2\nhalt\na: byte 0 x 2 byte -1",                                    {{REG_INT, .reg = R2, .val_int = 0xff}}},
-			{"mov -1, r1\nstob r1, a, 0\nhalt\na: byte 0 byte 123",                                      {{MEM_INT, .address = 5 * 4, .val_int = 0x7bff}}}, // 0x7bff to check if we write more than 1 byte
-			{"mov -1, r1\nmov a, r2\nstob r1, r2, 0\nhalt\nreserve byte x 1\na: reserve byte x 1",       {{REG_INT, .reg = R2, .val_int = 25},  {MEM_INT, .address = 6 * 4 + 1, .val_int = 0xff}}},
+			{"mov -1, r1\nstob r1, a, 0\nhalt\na: byte 0 byte 123",                                      {{MEM_INT, .address = 4 * 4, .val_int = 0x7bff}}}, // 0x7bff to check if we write more than 1 byte
+			{"mov -1, r1\nmov a, r2\nstob r1, r2, 0\nhalt\nreserve byte x 1\na: reserve byte x 1",       {{REG_INT, .reg = R2, .val_int = 21},  {MEM_INT, .address = 5 * 4 + 1, .val_int = 0xff}}},
 
 			// load, store short
 			{"lds a, 1, r1\nhalt\na: byte 1 short -1\n",                                            {{REG_INT, .reg = R1, .val_int = 0xffff}}},
 			{"mov a, r1\nlds r1, 2, r2\nhalt\na: byte 0 x 2 short -1",                              {{REG_INT, .reg = R2, .val_int = 0xffff}}},
-			{"mov -1, r1\nstos r1, a, 0\nhalt\na: short 0 short 123",                               {{MEM_INT, .address = 5 * 4, .val_int = 0x7bffff}}}, // 0x7bffff to check if we write more than 2 bytes
-			{"mov -1, r1\nmov a, r2\nstos r1, r2, 0\nhalt\nreserve byte x 1\na: reserve byte x 1", {{REG_INT, .reg = R2, .val_int = 25},  {MEM_INT, .address = 6 * 4 + 1, .val_int = 0xffff}}},
+			{"mov -1, r1\nstos r1, a, 0\nhalt\na: short 0 short 123",                               {{MEM_INT, .address = 4 * 4, .val_int = 0x7bffff}}}, // 0x7bffff to check if we write more than 2 bytes
+			{"mov -1, r1\nmov a, r2\nstos r1, r2, 0\nhalt\nreserve byte x 1\na: reserve byte x 1", {{REG_INT, .reg = R2, .val_int = 21},  {MEM_INT, .address = 5 * 4 + 1, .val_int = 0xffff}}},
+
+			// load, store indexed
+			{"mov a, r1\nmov 2, r2\nld r1, r2 * 4 + 4, r3\nhalt\na: int 10, 20, 30, 40",             {{REG_INT, .reg = R3, .val_int = 40}}},
+			{"mov a, r1\nmov 3, r2\nldb r1, r2, r3\nlds r1, r2 * 2 - 4, r4\nhalt\na: byte 1, 2, 3, 4, 5, 6", {{REG_INT, .reg = R3, .val_int = 4}, {REG_INT, .reg = R4, .val_int = 0x0403}}},
+			{"mov a, r1\nmov 1, r2\nmov 77, r3\nsto r3, r1, r2 * 4 + 4\nhalt\na: int 0, 0, 0",        {{MEM_INT, .address = 8 * 4, .val_int = 77}}},
+			{"mov a, r1\nld r1+, 0, r2\nld r1+, 0, r3\nhalt\na: int 5, 6",                            {{REG_INT, .reg = R1, .val_int = 7 * 4}, {REG_INT, .reg = R2, .val_int = 5}, {REG_INT, .reg = R3, .val_int = 6}}},
+			{"mov a, r1\nmov -1, r2\nstob r2, r1+, 0\nstos r2, r1+, 1\nhalt\na: int 0, 0",          {{REG_INT, .reg = R1, .val_int = 6 * 4 + 3}, {MEM_INT, .address = 6 * 4, .val_uint = 0xffff00ff}}},
+
+			// block memory
+			{"mov a, r2\nmov 0x1ff, r1\nmov 3, r3\nmemset r1, r2, r3\nhalt\na: int 0x11111111",        {{MEM_INT, .address = 6 * 4, .val_uint = 0x11ffffff}}},
+			{"mov a, r1\nadd r1, 1, r2\nmov 3, r3\nmemcpy r1, r2, r3\nhalt\na: byte 1, 2, 3, 4",        {{MEM_INT, .address = 6 * 4, .val_uint = 0x03020101}}},
+			{"mov a, r1\nmov b, r2\nmov 4, r3\nmemcmp r1, r2, r3\nhalt\na: byte 1, 2, 3, 4\nb: byte 1, 2, 4, 0", {{REG_INT, .reg = R3, .val_int = -1}}},
+			{"mov -4, r2\nmov 8, r3\nmemset r1, r2, r3\nhalt",                                        {{REG_INT, .reg = PC, .val_uint = 2 * 4}, {REG_INT, .reg = R3, .val_int = 8}}},
+
+			// vectors
+			{"mov a, r1\nvld r1, 0, v0\nvld r1, 16, v1\nvadd v0, v1, v2\nvst v2, r1, 32\nhalt\na: int 1, 2, 3, 4, 10, 20, 30, 40, 0 x 4", {{MEM_INT, .address = 15 * 4, .val_int = 11}, {MEM_INT, .address = 18 * 4, .val_int = 44}}},
+			{"mov 1.5, r1\nvsplat r1, v0\nmov a, r2\nvld r2, 0, v1\nvmaxf v0, v1, v2\nvshuf v2, 0x1b, v3\nvget v3, 0, r3\nvget v3, 3, r4\nhalt\na: float 1.0, 2.0, 0.5, 3.0", {{REG_FLOAT, .reg = R3, .val_float = 3}, {REG_FLOAT, .reg = R4, .val_float = 1.5}}},
+			{"mov a, r1\nvldb r1+, 0, v0\nvldb r1+, 0, v1\nvmul v0, v1, v2\nvsub v2, v0, v2\nvstb v2, r1, 0\nhalt\na: byte 1, 2, 3, 4, 5, 6, 7, 8, 0 x 4", {{REG_INT, .reg = R1, .val_int = 10 * 4}, {MEM_INT, .address = 10 * 4, .val_uint = 0x1c120a04}}},
+
+			// select, min, max, abs, clamp
+			{"mov 5, r1\nmov 7, r2\ncmp r1, r2, r3\nsell r3, r2, r1\nselg r3, r1, r2\nsele r3, r3, r4\nhalt",       {{REG_INT, .reg = R1, .val_int = 7}, {REG_INT, .reg = R2, .val_int = 7}, {REG_INT, .reg = R4, .val_int = 0}}},
+			{"mov -5, r1\nmov 3, r2\nmin r1, r2, r3\nmax r1, 0, r4\nabs r1, r5\nmov 300, r6\nmov 0, r7\nmov 255, r8\nclamp r7, r8, r6\nhalt", {{REG_INT, .reg = R3, .val_int = -5}, {REG_INT, .reg = R4, .val_int = 0}, {REG_INT, .reg = R5, .val_int = 5}, {REG_INT, .reg = R6, .val_int = 255}}},
+			{"mov -1.5, r1\nmov 2.5, r2\nmaxf r1, r2, r3\nminf r1, 0.5, r4\nabsf r1, r5\nmov 0.0, r6\nclampf r6, r2, r1\nhalt", {{REG_FLOAT, .reg = R3, .val_float = 2.5}, {REG_FLOAT, .reg = R4, .val_float = -1.5}, {REG_FLOAT, .reg = R5, .val_float = 1.5}, {REG_FLOAT, .reg = R1, .val_float = 0}}},
+
+			// bit manipulation
+			{"mov 0xf0f10, r1\npopcnt r1, r2\nclz r1, r3\nctz r1, r4\nbswap r1, r5\nmov 0, r6\nclz r6, r6\nhalt", {{REG_INT, .reg = R2, .val_int = 9}, {REG_INT, .reg = R3, .val_int = 12}, {REG_INT, .reg = R4, .val_int = 4}, {REG_INT, .reg = R5, .val_uint = 0x100f0f00}, {REG_INT, .reg = R6, .val_int = 32}}},
+			{"mov 0x80000001, r1\nrol r1, 4, r2\nror r1, 4, r3\nmov 36, r4\nrol r1, r4, r5\nror r1, r4, r6\nhalt", {{REG_INT, .reg = R2, .val_uint = 0x18}, {REG_INT, .reg = R3, .val_uint = 0x18000000}, {REG_INT, .reg = R5, .val_uint = 0x18}, {REG_INT, .reg = R6, .val_uint = 0x18000000}}},
+			// compare and branch, each branch not taken sets a bit of r3
+			{"mov -1, r1\nmov 1, r2\nbl r1, r2, a\nor r3, 1, r3\na: blu r1, r2, b\nor r3, 2, r3\nb: bge r1, -1, c\nor r3, 4, r3\nc: bgu r1, 5, d\nor r3, 8, r3\nd: bne r2, 1, e\nor r3, 16, r3\ne: halt", {{REG_INT, .reg = R3, .val_int = 18}}},
+			{"mov 1.5, r1\nmov 2.5, r2\nblf r1, r2, a\nor r3, 1, r3\na: bgef r1, 2, b\nor r3, 2, r3\nb: bgf r2, 2.0, c\nor r3, 4, r3\nc: bef r1, r1, d\nor r3, 8, r3\nd: blef r2, -3, e\nor r3, 16, r3\ne: halt", {{REG_INT, .reg = R3, .val_int = 18}}},
+			{"push 7\npush 9\ncall f\nhalt\nf: enter r13, 2\nld r13, 8, r1\nld r13, 12, r2\nsub r1, r2, r3\nsto r3, sp, 4\nleave r13\nretn 2", {{REG_INT, .reg = R3, .val_int = 2}, {REG_INT, .reg = R13, .val_int = 0}, {REG_INT, .reg = SP, .val_uint = UL_VM_MEMORY_SIZE}}},
+			{"mov 1, r1\nmov 3, r3\nmov 4, r4\nmov 5, r5\npushm r1 | r3-r5\nld sp, 0, r6\nld sp, 12, r7\nmov 0, r1\nmov 0, r4\npopm r1 | r3-r5\nhalt", {{REG_INT, .reg = R1, .val_int = 1}, {REG_INT, .reg = R4, .val_int = 4}, {REG_INT, .reg = R6, .val_int = 1}, {REG_INT, .reg = R7, .val_int = 5}, {REG_INT, .reg = SP, .val_uint = UL_VM_MEMORY_SIZE}}},
+			{"push 0\npush 10000\ncall sum\nhalt\nsum: enter r13, 0\nld r13, 8, r1\nld r13, 12, r2\nbe r1, 0, done\nadd r2, r1, r2\nsub r1, 1, r1\npush r2\npush r1\ntcall r13, 2, sum\ndone: mov r2, r14\nleave r13\nretn 2", {{REG_INT, .reg = R14, .val_int = 50005000}, {REG_INT, .reg = SP, .val_uint = UL_VM_MEMORY_SIZE}}},
 			{"mov 123, r1\npush r1\nhalt\n",                                                      {{REG_INT, .reg = SP, .val_int = UL_VM_MEMORY_SIZE - 4}, {MEM_INT, .address = UL_VM_MEMORY_SIZE - 4, .val_int = 123}}},
 			{"push 123\nhalt\n",                                                                  {{REG_INT, .reg = SP, .val_int = UL_VM_MEMORY_SIZE - 4}, {MEM_INT, .address = UL_VM_MEMORY_SIZE - 4, .val_int = 123}}},
 			{"push 123.456\nhalt\n",                                                              {{REG_INT, .reg = SP, .val_int = UL_VM_MEMORY_SIZE - 4}, {MEM_FLOAT, .address = UL_VM_MEMORY_SIZE - 4, .val_float = 123.456}}},
@@ -343,15 +983,28 @@ int main(int argc, char **argv) {
 			{"push 123\npush 456.7\npop 2\nhalt",                                           	  {{REG_INT, .reg = SP, .val_int = UL_VM_MEMORY_SIZE}}},
 			{"call f\nhalt\nf: halt",                                               			  {{REG_INT, .reg = PC, .val_uint = 4 * 4}}},
 			{"mov f, r1\ncall r1\nhalt\nf: halt",                                           	{{REG_INT, .reg = PC, .val_uint = 5 * 4}}},
-			{"call f\nmov 123, r2\nhalt\nf: ret",                                           {{REG_INT, .reg = PC, .val_uint = 5 * 4}, {REG_INT, .reg = R2, .val_uint = 123}}},
-			{"push 1\ncall f\nmov 123, r2\nhalt\nf: retn 1",                                      {{REG_INT, .reg = PC, .val_uint = 7 * 4}, {REG_INT, .reg = SP, .val_uint = UL_VM_MEMORY_SIZE}, {REG_INT, .reg = R2, .val_uint = 123}}},
+			{"call f\nmov 123, r2\nhalt\nf: ret",                                           {{REG_INT, .reg = PC, .val_uint = 4 * 4}, {REG_INT, .reg = R2, .val_uint = 123}}},
+			{"push 1\ncall f\nmov 123, r2\nhalt\nf: retn 1",                                      {{REG_INT, .reg = PC, .val_uint = 5 * 4}, {REG_INT, .reg = SP, .val_uint = UL_VM_MEMORY_SIZE}, {REG_INT, .reg = R2, .val_uint = 123}}},
 			// {"syscall 0\nhalt"},
 
 			// const
 			{ "const PI 3.14\nmov PI, r1\nhalt", {{REG_FLOAT, .reg = R1, .val_float = 3.14f}}},
 
 			// expression with label and constants
-			{"const OFF 2\ndata: reserve int x 4\nmov 123, r1\nsto r1, data + OFF, 0", {{MEM_INT, .address = 4 * 4 + 2, .val_int = 123}}},
+			{"const OFF 2\ndata: reserve int x 4\nmov 123, r1\nsto r1, data + OFF, 0", {{MEM_INT, .address = 3 * 4 + 2, .val_int = 123}}},
+
+			// offset resolved after the first pass
+			{"mov 1, r1\nshl r1, SHIFT, r2\nhalt\nconst SHIFT 3",                                  {{REG_INT, .reg = R2, .val_uint = 8}}},
+
+			// white space, identifiers, and numbers longer than a vector register
+			{"                                        # a comment that is longer than a vector register\n"
+			 "mov a_label_that_is_longer_than_a_vector_register_ö_and_then_some, r1\n"
+			 "mov 0x0000000000000000000000000000000000000000000000000000000000000007, r2\n"
+			 "halt\na_label_that_is_longer_than_a_vector_register_ö_and_then_some: int 1", {{REG_INT, .reg = R1, .val_uint = 4 * 4}, {REG_INT, .reg = R2, .val_uint = 7}}},
+
+			// rewritten by the optimizer, data moves down with the code
+			{"mov 3, r1\nmov r1, r1\nadd r1, 0, r2\nmul r2, 8, r3\npush r3\npop r4\nhalt",             {{REG_INT, .reg = R2, .val_int = 3}, {REG_INT, .reg = R3, .val_int = 24}, {REG_INT, .reg = R4, .val_int = 24}}},
+			{"nop\nmov 0xdeadbeef, r1\nsto r1, a, 0\nmov a, r3\nld r3, 0, r2\nhalt\na: int 123",        {{REG_INT, .reg = R2, .val_int = 0xdeadbeef}, {MEM_INT, .address = 9 * 4, .val_int = 0xdeadbeef}}},
 
 			// fib
 			{"tests/fib.ul", {{REG_INT, .reg = R14, .val_uint = 832040}}},
@@ -359,20 +1012,83 @@ int main(int argc, char **argv) {
 			// include
 			{"tests/a.ul",                                                                                     {{REG_INT, .reg = R1, .val_uint = 1}, {REG_INT, .reg = R2, .val_uint = 3}}},
 
+			// raw include
+			{"tests/raw.ul",                                                                                   {{REG_INT, .reg = R1, .val_uint = 'A'}, {REG_INT, .reg = R2, .val_uint = 0xff}, {REG_INT, .reg = R3, .val_uint = 7 * 4 + 4}}},
+
 			// Jump to label at end of file without an instruction
-			{"jmp end\nend: halt",                                                                                     {{REG_INT, .reg = PC, .val_uint = 12}, }},
+			{"jmp end\nend: halt",                                                                                     {{REG_INT, .reg = PC, .val_uint = 8}, }},
 	};
 	// @formatter:on
 
 	for (size_t i = 0; i < sizeof(tests) / sizeof(test_case); i++) {
 		test_case *t = &tests[i];
-		if (!test(i, t)) {
+		if (!test(i, t, UL_FALSE) || !test(i, t, UL_TRUE)) {
 			ulang_print_memory();
 			return -1;
 		}
 		printf("Test #%zu: OK\n", i);
 	}
 
+	if (!test_optimizer()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test optimizer: OK\n");
+
+	if (!test_short_encodings()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test short encodings: OK\n");
+
+	if (!test_compare_and_branch()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test compare and branch: OK\n");
+
+	if (!test_profile_layout()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test profile layout: OK\n");
+
+	if (!test_coverage()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test coverage: OK\n");
+
+	if (!test_allocator()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test allocator: OK\n");
+
+	if (!test_binary_image()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test binary image: OK\n");
+
+	if (!test_line_table()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test line table: OK\n");
+
+	if (!test_streaming_compile()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test streaming compile: OK\n");
+
+	if (!test_compile_cache()) {
+		ulang_print_memory();
+		return -1;
+	}
+	printf("Test compile cache: OK\n");
+
 	ulang_print_memory();
 	return 0;
 
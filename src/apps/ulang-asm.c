@@ -0,0 +1,39 @@
+#include <stdio.h>
+#include <string.h>
+#include <ulang.h>
+
+int main(int argc, char **argv) {
+	if (argc != 3 && !(argc == 4 && (!strcmp(argv[3], "--strip") || !strcmp(argv[3], "--stream") || !strcmp(argv[3], "--optimize")))) {
+		printf("Usage: ulang-asm <file.ul> <file.ulb> [--strip|--stream|--optimize]");
+		return -1;
+	}
+
+	ulang_error error = {0};
+	ulang_program program = {0};
+	if (argc == 4 && !strcmp(argv[3], "--stream")) {
+		if (!ulang_compile_to_image(argv[1], argv[2], &error, NULL)) {
+			ulang_error_print(&error);
+			ulang_error_free(&error);
+			return -1;
+		}
+		return 0;
+	}
+
+	ulang_compile_options options = {argc == 4 && !strcmp(argv[3], "--optimize")};
+	if (!ulang_compile_with_options(argv[1], ulang_file_read, &program, &error, NULL, &options)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		return -1;
+	}
+	if (options.optimize) printf("Removed %zu instructions\n", options.numRemovedInstructions);
+
+	if (!ulang_program_save(&program, argv[2], argc != 4 || options.optimize, &error)) {
+		ulang_error_print(&error);
+		ulang_error_free(&error);
+		ulang_program_free(&program);
+		return -1;
+	}
+
+	ulang_program_free(&program);
+	return 0;
+}
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ulang.h>
 #include <MiniFB.h>
 #define SOKOL_IMPL
@@ -74,14 +75,17 @@ static ulang_bool syscallHandler(uint32_t intNum, ulang_vm *vm) {
 }
 
 int main(int argc, char **argv) {
-	if (argc != 2) {
-		printf("Usage: ulang <file>");
+	if (argc != 2 && !(argc == 4 && !strcmp(argv[2], "--coverage"))) {
+		printf("Usage: ulang <file.ul|file.ulb> [--coverage <lcov-file>]");
 		return -1;
 	}
+	const char *coverageFile = argc == 4 ? argv[3] : NULL;
 
 	ulang_error error = {0};
 	ulang_program program = {0};
-	if (!ulang_compile(argv[1], ulang_file_read, &program, &error)) {
+	size_t fileNameLength = strlen(argv[1]);
+	ulang_bool isImage = fileNameLength > 4 && !strcmp(argv[1] + fileNameLength - 4, ".ulb");
+	if (isImage ? !ulang_program_load(argv[1], &program, &error, NULL) : !ulang_compile(argv[1], ulang_file_read, &program, &error, NULL)) {
 		ulang_error_print(&error);
 		ulang_error_free(&error);
 		return -1;
@@ -99,11 +103,20 @@ int main(int argc, char **argv) {
 	}
 
 	ulang_vm vm = {0};
-	ulang_vm_init(&vm, &program);
+	ulang_coverage coverage = {0};
+	ulang_vm_init(&vm, &program, NULL);
+	if (coverageFile) {
+		ulang_coverage_init(&coverage, &program);
+		vm.coverage = &coverage;
+	}
   	for (int i = 0; i <= 255; i++) vm.syscalls[i] = syscallHandler;
 	while (ulang_vm_step(&vm));
 	if (vm.error.is_set) ulang_error_print(&vm.error);
 	ulang_vm_print(&vm);
+	if (coverageFile) {
+		if (!ulang_coverage_write_lcov(&coverage, &program, coverageFile)) printf("Couldn't write coverage to %s\n", coverageFile);
+		ulang_coverage_free(&coverage);
+	}
 
 	mfb_close(window);
 
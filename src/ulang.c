@@ -11,19 +11,138 @@
 #define EMSCRIPTEN_KEEPALIVE
 #endif
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define UL_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Vectorised tokenizer scanning and vector instructions, define UL_NO_SIMD to use the
+// scalar path only.
+#if !defined(UL_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define UL_SIMD_SSE2
+#include <emmintrin.h>
+#if defined(__AVX2__)
+#define UL_SIMD_AVX2
+#include <immintrin.h>
+#endif
+#elif !defined(UL_NO_SIMD) && (defined(__ARM_NEON) || defined(_M_ARM64))
+#define UL_SIMD_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #define STR(str) str, sizeof(str) - 1
 #define STR_OBJ(str) (ulang_string){ str, sizeof(str) - 1 }
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_MAX_BLOCK_SIZE (8 * 1024 * 1024)
+#define ARENA_LARGE_ALLOCATION (1024 * 1024)
+#define ARENA_ALIGN(numBytes) (((numBytes) + 15) & ~(size_t) 15)
+
+// Bump allocator for transient compiler state. Allocations are never freed
+// individually, all blocks are released at once by arena_free. Large allocations,
+// like the token array of a big source file, get a block of their own, which
+// can be resized in place instead of leaving stale copies behind.
+typedef struct arena_block {
+	struct arena_block *next;
+	size_t size;
+	size_t used;
+} arena_block;
+
+typedef struct arena {
+	arena_block *blocks;
+	arena_block *largeBlocks;
+	ulang_allocator *allocator;
+} arena;
+
+static uint8_t *arena_block_data(arena_block *block) {
+	return (uint8_t *) block + ARENA_ALIGN(sizeof(arena_block));
+}
+
+static arena_block *arena_block_new(arena *arena, arena_block **list, size_t size) {
+	arena_block *block = (arena_block *) ulang_allocator_alloc(arena->allocator, ARENA_ALIGN(sizeof(arena_block)) + size);
+	block->next = *list;
+	block->size = size;
+	block->used = 0;
+	*list = block;
+	return block;
+}
+
+static void *arena_alloc(arena *arena, size_t numBytes) {
+	numBytes = ARENA_ALIGN(numBytes);
+	if (numBytes > ARENA_LARGE_ALLOCATION) {
+		arena_block *block = arena_block_new(arena, &arena->largeBlocks, numBytes);
+		block->used = numBytes;
+		return arena_block_data(block);
+	}
+
+	arena_block *block = arena->blocks;
+	if (!block || block->used + numBytes > block->size) {
+		size_t size = block ? MIN(block->size * 2, ARENA_MAX_BLOCK_SIZE) : ARENA_BLOCK_SIZE;
+		block = arena_block_new(arena, &arena->blocks, MAX(size, numBytes));
+	}
+	void *result = arena_block_data(block) + block->used;
+	block->used += numBytes;
+	return result;
+}
+
+static void *arena_realloc(arena *arena, void *old, size_t oldNumBytes, size_t numBytes) {
+	if (old) {
+		// Grow in place if this is the last allocation in the current block
+		arena_block *block = arena->blocks;
+		if (block && (uint8_t *) old + ARENA_ALIGN(oldNumBytes) == arena_block_data(block) + block->used &&
+			block->used - ARENA_ALIGN(oldNumBytes) + ARENA_ALIGN(numBytes) <= block->size) {
+			block->used = block->used - ARENA_ALIGN(oldNumBytes) + ARENA_ALIGN(numBytes);
+			return old;
+		}
+
+		// Resize large allocations together with their block
+		for (arena_block **link = &arena->largeBlocks; *link; link = &(*link)->next) {
+			if (arena_block_data(*link) != old) continue;
+			block = (arena_block *) ulang_allocator_realloc(arena->allocator, *link, ARENA_ALIGN(sizeof(arena_block)) + ARENA_ALIGN(numBytes));
+			block->size = block->used = ARENA_ALIGN(numBytes);
+			*link = block;
+			return arena_block_data(block);
+		}
+	}
+
+	void *result = arena_alloc(arena, numBytes);
+	if (old) memcpy(result, old, MIN(oldNumBytes, numBytes));
+	return result;
+}
+
+static void arena_free_blocks(arena *arena, arena_block *block) {
+	while (block) {
+		arena_block *next = block->next;
+		ulang_allocator_free(arena->allocator, block);
+		block = next;
+	}
+}
+
+static void arena_free(arena *arena) {
+	arena_free_blocks(arena, arena->blocks);
+	arena_free_blocks(arena, arena->largeBlocks);
+	arena->blocks = NULL;
+	arena->largeBlocks = NULL;
+}
+
 // NOLINTBEGIN
 #define ARRAY_IMPLEMENT(name, itemType) \
-    typedef struct name { size_t size; size_t capacity; itemType* items; } name; \
+    typedef struct name { size_t size; size_t capacity; itemType* items; arena *arena; } name; \
     name* name##_init(size_t initialCapacity) { \
         name* array = (name *)ulang_alloc(sizeof(name)); \
         array->size = 0; \
         array->capacity = initialCapacity; \
         array->items = (itemType*)ulang_alloc(sizeof(itemType) * initialCapacity); \
+        array->arena = NULL; \
         return array; \
     } \
     void name##_free(name *self) { \
@@ -34,14 +153,23 @@
         array->size = 0; \
         array->capacity = initialCapacity; \
         array->items = (itemType*)ulang_alloc(sizeof(itemType) * initialCapacity); \
+        array->arena = NULL; \
+    } \
+    void name##_init_arena(name* array, arena *arena, size_t initialCapacity) { \
+        array->size = 0; \
+        array->capacity = initialCapacity; \
+        array->items = (itemType*)arena_alloc(arena, sizeof(itemType) * initialCapacity); \
+        array->arena = arena; \
     } \
     void name##_free_inplace(name *self) { \
-        ulang_free(self->items); \
+        if (!self->arena) ulang_free(self->items); \
     } \
     void name##_ensure(name* self, size_t numElements) { \
         if (self->size + numElements >= self->capacity) { \
-            self->capacity = MAX(8, (size_t)((self->size + numElements) * 1.75f)); \
-            self->items = (itemType*)ulang_realloc(self->items, sizeof(itemType) * self->capacity); \
+            size_t capacity = MAX(8, (size_t)((self->size + numElements) * 1.75f)); \
+            if (self->arena) self->items = (itemType*)arena_realloc(self->arena, self->items, sizeof(itemType) * self->capacity, sizeof(itemType) * capacity); \
+            else self->items = (itemType*)ulang_realloc(self->items, sizeof(itemType) * capacity); \
+            self->capacity = capacity; \
         } \
     }\
     void name##_add(name* self, itemType value) { \
@@ -50,14 +178,50 @@
     }
 // NOLINTEND
 
+typedef enum token_type {
+	TOKEN_INTEGER,
+	TOKEN_FLOAT,
+	TOKEN_STRING,
+	TOKEN_IDENTIFIER,
+	TOKEN_SPECIAL_CHAR,
+	TOKEN_EOF
+} token_type;
+
+// Tokens only store where their text is in the file. Line numbers are looked up
+// in the file's line table when a span is needed, see token_span.
+typedef struct token {
+	uint32_t offset;
+	uint32_t length;
+	token_type type;
+} token;
+
 typedef struct expression_value {
 	value_type type;
 	int32_t i;
 	float f;
-	uint32_t startToken;
+	uint32_t firstOp;
+	uint32_t numOps;
 	ulang_bool unresolved;
 } expression_value;
 
+typedef enum expression_op_type {
+	EO_VALUE,
+	EO_SYMBOL,
+	EO_UNARY,
+	EO_BINARY
+} expression_op_type;
+
+// Step of an expression in postfix form, kept for expressions that reference labels
+// so they can be evaluated once all labels are known. The source is the symbol or the
+// operator, values hold literals and constants already resolved in the first pass.
+typedef struct expression_op {
+	expression_op_type type;
+	token source;
+	value_type valueType;
+	int32_t i;
+	float f;
+} expression_op;
+
 typedef enum patch_type {
 	PT_VALUE,
 	PT_OFFSET
@@ -66,23 +230,11 @@ typedef enum patch_type {
 typedef struct patch {
 	patch_type type;
 	expression_value expr;
+	token source;
 	size_t patchAddress;
+	ulang_file *file;
 } patch;
 
-typedef enum token_type {
-	TOKEN_INTEGER,
-	TOKEN_FLOAT,
-	TOKEN_STRING,
-	TOKEN_IDENTIFIER,
-	TOKEN_SPECIAL_CHAR,
-	TOKEN_EOF
-} token_type;
-
-typedef struct token {
-	ulang_span span;
-	token_type type;
-} token;
-
 ARRAY_IMPLEMENT(file_array, ulang_file*)
 
 ARRAY_IMPLEMENT(token_array, token)
@@ -97,27 +249,196 @@ ARRAY_IMPLEMENT(byte_array, uint8_t)
 
 ARRAY_IMPLEMENT(int_array, uint32_t)
 
+ARRAY_IMPLEMENT(expression_op_array, expression_op)
+
+ARRAY_IMPLEMENT(value_array, expression_value)
+
+ARRAY_IMPLEMENT(line_range_array, ulang_line_range)
+
+// Open addressing hash table over the labels or constants of a compilation.
+// Each slot holds the index + 1 of a symbol in its array, 0 marks an empty slot.
+typedef struct symbol_table {
+	uint32_t *slots;
+	size_t numSlots;
+	size_t size;
+	arena *arena;
+} symbol_table;
+
+typedef ulang_string *(*symbol_name_function)(void *symbols, uint32_t index);
+
 typedef struct token_stream {
 	ulang_file *file;
 	token_array *tokens;
 	size_t index;
 	size_t end;
+	uint32_t line;
 } token_stream;
 
+// A piece of a unit's sections, ending where another unit is included.
+typedef struct unit_piece {
+	size_t code;
+	size_t data;
+	size_t reserved;
+	size_t labels;
+	size_t constants;
+	ulang_label_target firstEmission;
+	struct compile_unit *include;
+} unit_piece;
+
+ARRAY_IMPLEMENT(piece_array, unit_piece)
+
+// A constant looked up while assembling a unit or the units it includes. Index is
+// the constant defined before the unit that was found, -1 if there was none.
+typedef struct unit_import {
+	ulang_string name;
+	int32_t index;
+} unit_import;
+
+ARRAY_IMPLEMENT(import_array, unit_import)
+
+// Object unit assembled from a single file. Label addresses and patches are
+// relative to the unit's own code, data and reserved sections, patch expressions
+// index the unit's expression ops. Labels without
+// a target yet are bound by the linker to whatever is emitted next, possibly
+// by another unit.
+typedef struct compile_unit {
+	ulang_file *file;
+	uint32_t fileIndex;
+	byte_array code;
+	byte_array data;
+	size_t numReservedBytes;
+	label_array labels;
+	symbol_table labelTable;
+	patch_array patches;
+	expression_op_array ops;
+	int_array addressToLine;
+	piece_array pieces;
+	// Constants defined by the unit, and what it depends on from outside for the
+	// compile cache: imported constants and includes skipped as already compiled
+	int_array constants;
+	import_array imports;
+	symbol_table importTable;
+	int_array externalIncludes;
+	uint32_t constantsStart;
+	uint32_t filesStart;
+	ulang_bool reused;
+	// Code and data already written out by a streaming compile, see stream_flush
+	size_t codeBase;
+	size_t dataBase;
+} compile_unit;
+
+// A unit assembled by an earlier cached compile along with its dependencies. It is
+// replayed instead of assembled as long as its file and the files it included are
+// unchanged, its imports resolve to the same constants and its external includes
+// are already part of the compile. Spans point into the cached file contents.
+typedef struct unit_object {
+	uint32_t version;
+	uint8_t *code;
+	size_t codeLength;
+	uint8_t *data;
+	size_t dataLength;
+	size_t numReservedBytes;
+	uint32_t *addressToLine;
+	ulang_label *labels;
+	size_t numLabels;
+	patch *patches;
+	size_t numPatches;
+	expression_op *ops;
+	size_t numOps;
+	ulang_constant *constants;
+	size_t numConstants;
+	unit_piece *pieces;
+	uint8_t *pieceIncludes;
+	size_t numPieces;
+	ulang_constant *imports;
+	uint8_t *importsFound;
+	size_t numImports;
+	char **externalIncludes;
+	size_t numExternalIncludes;
+	// Files of the included units in include order and the versions of their objects
+	char **includes;
+	uint32_t *includeVersions;
+	size_t numIncludes;
+} unit_object;
+
+// Contents and tokens of a file seen by a cached compile. Tokens only hold
+// offsets, they apply to the file being compiled as is on a hit.
+typedef struct cached_file {
+	char *fileName;
+	uint32_t hash;
+	char *data;
+	size_t length;
+	token *tokens;
+	size_t numTokens;
+	uint32_t generation;
+	unit_object *object;
+} cached_file;
+
+struct ulang_compile_cache {
+	ulang_allocator *allocator;
+	cached_file *files;
+	size_t numFiles;
+	uint32_t generation;
+	// Result of the last successful compile. Labels and constants point into the
+	// cached file contents, the line ranges' files index programFiles.
+	ulang_bool hasProgram;
+	ulang_program program;
+	uint32_t *programFiles;
+	uint32_t objectVersion;
+	// Files included raw aren't tracked, compiles including them aren't kept
+	ulang_bool rawIncludes;
+	ulang_compile_cache_stats stats;
+};
+
+// Source file read a window at a time by a streaming compile. The window's file holds
+// complete lines only, the start of the next line is buffered behind them. Lines are
+// numbered from firstLine, the line of the file the window starts at.
+typedef struct source_window {
+	FILE *source;
+	ulang_file *file;
+	ulang_allocator *allocator;
+	size_t capacity;
+	size_t buffered;
+	uint32_t firstLine;
+	ulang_bool eof;
+} source_window;
+
+// State of a streaming compile, see ulang_compile_to_image. The first pass lays out
+// the program, the second writes code and data to the image as it is assembled.
+typedef struct stream_output {
+	uint32_t pass;
+	const char *imageFileName;
+	FILE *image;
+	size_t codeOffset;
+	size_t dataOffset;
+	uint32_t visibleConstants;
+	size_t relocatedLabels;
+	size_t relocatedConstants;
+} stream_output;
+
 typedef struct compiler_context {
+	arena arena;
+	ulang_compile_cache *cache;
+	compile_unit *unit;
 	file_array files;
 	token_array tokens;
 	token_stream stream;
 	patch_array patches;
+	expression_op_array ops;
+	value_array stack;
 	label_array labels;
 	constant_array constants;
+	symbol_table labelTable;
+	symbol_table constantTable;
 	byte_array code;
 	byte_array data;
-	int_array addressToLine;
-	file_array addressToFile;
+	line_range_array lineRanges;
 	size_t numReservedBytes;
 	ulang_error *error;
-	ulang_bool resolveLabelsInExpressions;
+	stream_output *output;
+	source_window *window;
+	ulang_bool rawIncludes;
+	ulang_compile_profile *profile;
 } compiler_context;
 
 typedef enum ulang_opcode {
@@ -208,9 +529,104 @@ typedef enum ulang_opcode {
 	CALL_VAL,
 	RET,
 	RETN,
-	SYSCALL
+	SYSCALL,
+	ADD_IMM,
+	CMP_IMM,
+	MOVE_IMM,
+	PUSH_IMM,
+	JUMP_NEAR,
+	LOAD_INDEXED,
+	LOAD_BYTE_INDEXED,
+	LOAD_SHORT_INDEXED,
+	STORE_INDEXED,
+	STORE_BYTE_INDEXED,
+	STORE_SHORT_INDEXED,
+	MEMSET,
+	MEMCPY,
+	MEMCMP,
+	VECTOR_LOAD,
+	VECTOR_LOAD_BYTE,
+	VECTOR_STORE,
+	VECTOR_STORE_BYTE,
+	VECTOR_MATH,
+	VECTOR_SHUFFLE,
+	VECTOR_SPLAT,
+	VECTOR_GET,
+	SELECT,
+	MIN_MAX,
+	MIN_MAX_VAL,
+	ABS,
+	CLAMP,
+	BITS,
+	ROTATE_LEFT,
+	ROTATE_LEFT_VAL,
+	ROTATE_RIGHT,
+	ROTATE_RIGHT_VAL,
+	BRANCH,
+	BRANCH_IMM,
+	BRANCH_NEAR,
+	BRANCH_IMM_NEAR,
+	FRAME,
+	PUSH_MASK,
+	TAIL_CALL,
+	NUM_OPCODES
 } ulang_opcode;
 
+// Lane-wise operations of VECTOR_MATH, kept in its offset field
+typedef enum vector_function {
+	VF_ADD,
+	VF_SUB,
+	VF_MUL,
+	VF_MIN,
+	VF_MAX,
+	VF_ADD_FLOAT,
+	VF_SUB_FLOAT,
+	VF_MUL_FLOAT,
+	VF_MIN_FLOAT,
+	VF_MAX_FLOAT
+} vector_function;
+
+// Functions of MIN_MAX, MIN_MAX_VAL, ABS and CLAMP are a combination of these
+typedef enum math_function {
+	MF_MAX = 1,
+	MF_FLOAT = 2
+} math_function;
+
+// Functions of BITS
+typedef enum bit_function {
+	BF_POPCNT,
+	BF_CLZ,
+	BF_CTZ,
+	BF_BSWAP
+} bit_function;
+
+// Conditions of BRANCH and its forms. Those of j<cond> on a signed compare come first,
+// then the ordered ones on an unsigned compare and all of them on a float compare.
+typedef enum branch_condition {
+	BC_EQUAL,
+	BC_NOT_EQUAL,
+	BC_LESS,
+	BC_GREATER,
+	BC_LESS_EQUAL,
+	BC_GREATER_EQUAL,
+	BC_LESS_UNSIGNED,
+	BC_GREATER_UNSIGNED,
+	BC_LESS_EQUAL_UNSIGNED,
+	BC_GREATER_EQUAL_UNSIGNED,
+	BC_EQUAL_FLOAT,
+	BC_NOT_EQUAL_FLOAT,
+	BC_LESS_FLOAT,
+	BC_GREATER_FLOAT,
+	BC_LESS_EQUAL_FLOAT,
+	BC_GREATER_EQUAL_FLOAT
+} branch_condition;
+
+// Functions of FRAME and PUSH_MASK, the second undoes the first
+typedef enum frame_function {
+	FF_ENTER, // enter and pushm
+	FF_LEAVE // leave and popm
+} frame_function;
+
 typedef enum operand_type {
 	UL_NIL = 0,  // No operand
 	UL_REG, // Register
@@ -219,12 +635,18 @@ typedef enum operand_type {
 	UL_INT, // int
 	UL_FLT, // float
 	UL_OFF, // Offset
+	UL_IMM, // Signed integer in the offset field, only picked by the assembler or compared by a branch
+	UL_BASE, // Register, optionally followed by + to increment it by the access width
+	UL_INDEX, // Register times 1, 2 or 4 plus an optional offset, or just an offset
+	UL_VREG, // Vector register
+	UL_MASK, // Registers r1 to r14 joined by |, or ranges of them like r2-r5
 } operand_type;
 
 typedef struct opcode {
 	ulang_opcode code;
 	ulang_string name;
 	operand_type operands[3];
+	uint32_t function;
 	int numOperands;
 	ulang_bool hasValueOperand;
 	uint32_t index;
@@ -334,6 +756,143 @@ static opcode opcodes[] = {
 
 
 		{SYSCALL,                STR_OBJ("syscall"),    {UL_OFF}},
+
+		// Single word forms of add, sub, cmp, mov and push with a small integer, and of
+		// jumps to code close by. JUMP_NEAR keeps the condition as the jump's distance to
+		// JUMP in its second register and jumps by the offset in words.
+		{ADD_IMM,                STR_OBJ("add"),        {UL_REG,         UL_IMM,     UL_REG}},
+		{CMP_IMM,                STR_OBJ("cmp"),        {UL_REG,         UL_IMM,     UL_REG}},
+		{MOVE_IMM,               STR_OBJ("mov"),        {UL_IMM,         UL_REG}},
+		{PUSH_IMM,               STR_OBJ("push"),       {UL_IMM}},
+		{JUMP_NEAR,              STR_OBJ("jmp"),        {UL_REG,         UL_REG,     UL_IMM}},
+
+		// Loads and stores from base + index * scale + offset, picked by the assembler when
+		// the address has a scale, an index register or an incremented base. The offset
+		// field holds the scale's shift in bits 0-1, 3 if there is no index register, the
+		// increment in bit 2 and a signed 10 bit offset above.
+		{LOAD_INDEXED,           STR_OBJ("ld"),         {UL_BASE,        UL_INDEX,   UL_REG}},
+		{LOAD_BYTE_INDEXED,      STR_OBJ("ldb"),        {UL_BASE,        UL_INDEX,   UL_REG}},
+		{LOAD_SHORT_INDEXED,     STR_OBJ("lds"),        {UL_BASE,        UL_INDEX,   UL_REG}},
+		{STORE_INDEXED,          STR_OBJ("sto"),        {UL_REG,         UL_BASE,    UL_INDEX}},
+		{STORE_BYTE_INDEXED,     STR_OBJ("stob"),       {UL_REG,         UL_BASE,    UL_INDEX}},
+		{STORE_SHORT_INDEXED,    STR_OBJ("stos"),       {UL_REG,         UL_BASE,    UL_INDEX}},
+
+		// Block operations on the number of bytes in the last register. memset takes the
+		// byte and the address, memcpy the source and the destination, which may overlap.
+		// memcmp replaces the number of bytes with -1, 0 or 1, like cmp.
+		{MEMSET,                 STR_OBJ("memset"),     {UL_REG,         UL_REG,     UL_REG}},
+		{MEMCPY,                 STR_OBJ("memcpy"),     {UL_REG,         UL_REG,     UL_REG}},
+		{MEMCMP,                 STR_OBJ("memcmp"),     {UL_REG,         UL_REG,     UL_REG}},
+
+		// Vector registers hold four ints or floats. vldb widens four bytes to ints, vstb
+		// stores the low byte of each lane. vshuf takes the source lane of each lane from
+		// two bits of its offset, starting with the lowest.
+		{VECTOR_LOAD,            STR_OBJ("vld"),        {UL_BASE,        UL_INDEX,   UL_VREG}},
+		{VECTOR_LOAD_BYTE,       STR_OBJ("vldb"),       {UL_BASE,        UL_INDEX,   UL_VREG}},
+		{VECTOR_STORE,           STR_OBJ("vst"),        {UL_VREG,        UL_BASE,    UL_INDEX}},
+		{VECTOR_STORE_BYTE,      STR_OBJ("vstb"),       {UL_VREG,        UL_BASE,    UL_INDEX}},
+		{VECTOR_MATH,            STR_OBJ("vadd"),       {UL_VREG,        UL_VREG,    UL_VREG}, VF_ADD},
+		{VECTOR_SHUFFLE,         STR_OBJ("vshuf"),      {UL_VREG,        UL_OFF,     UL_VREG}},
+		{VECTOR_SPLAT,           STR_OBJ("vsplat"),     {UL_REG,         UL_VREG}},
+		{VECTOR_GET,             STR_OBJ("vget"),       {UL_VREG,        UL_OFF,     UL_REG}},
+
+		// sel<cond> moves its second register to the third if the first fulfills the condition
+		// of j<cond>. The condition is kept as its jump's distance to JUMP. clamp limits its
+		// last register to the range given by the first two.
+		{SELECT,                 STR_OBJ("sele"),       {UL_REG,         UL_REG,     UL_REG}, JUMP_EQUAL - JUMP},
+		{MIN_MAX,                STR_OBJ("min"),        {UL_REG,         UL_REG,     UL_REG}},
+		{MIN_MAX_VAL,            STR_OBJ("min"),        {UL_REG,         UL_LBL_INT, UL_REG}},
+		{ABS,                    STR_OBJ("abs"),        {UL_REG,         UL_REG}},
+		{CLAMP,                  STR_OBJ("clamp"),      {UL_REG,         UL_REG,     UL_REG}},
+
+		// clz and ctz count 32 for 0. Rotates take the amount modulo 32.
+		{BITS,                   STR_OBJ("popcnt"),     {UL_REG,         UL_REG}},
+		{ROTATE_LEFT,            STR_OBJ("rol"),        {UL_REG,         UL_REG,     UL_REG}},
+		{ROTATE_LEFT_VAL,        STR_OBJ("rol"),        {UL_REG,         UL_OFF,     UL_REG}},
+		{ROTATE_RIGHT,           STR_OBJ("ror"),        {UL_REG,         UL_REG,     UL_REG}},
+		{ROTATE_RIGHT_VAL,       STR_OBJ("ror"),        {UL_REG,         UL_OFF,     UL_REG}},
+
+		// b<cond> compares its first register to the second or an immediate and jumps to the
+		// label like a cmp, cmpu or cmpf followed by j<cond>, without a flag register. The
+		// condition takes the register slot after the registers. Float conditions compare to
+		// immediates holding whole numbers. The near forms are picked by the linker, see
+		// resize_jumps. BRANCH_IMM_NEAR keeps an 8 bit immediate in bits 15-22 and the 9 bit
+		// offset in words above.
+		{BRANCH,                 STR_OBJ("be"),         {UL_REG,         UL_REG,     UL_LBL_INT}, BC_EQUAL},
+		{BRANCH_IMM,             STR_OBJ("be"),         {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_EQUAL},
+		{BRANCH_NEAR,            STR_OBJ("b"),          {UL_REG,         UL_REG,     UL_IMM}},
+		{BRANCH_IMM_NEAR,        STR_OBJ("b"),          {UL_REG,         UL_IMM}},
+
+		// enter pushes the frame pointer register, points it at the saved value and reserves
+		// the number of words for locals, arguments start 8 bytes above it. leave undoes that.
+		// pushm pushes the registers of a mask kept in bits 11-24 with r1 on top, popm pops
+		// them in reverse. tcall leaves the frame and replaces the current arguments with the
+		// given number of words on the stack before jumping, the function called returns to
+		// the caller of this one and has to take as many arguments. Functions go in the
+		// register slot after the registers.
+		{FRAME,                  STR_OBJ("enter"),      {UL_REG,         UL_OFF},              FF_ENTER},
+		{PUSH_MASK,              STR_OBJ("pushm"),      {UL_MASK},                             FF_ENTER},
+		{TAIL_CALL,              STR_OBJ("tcall"),      {UL_REG,         UL_OFF,     UL_LBL_INT}},
+
+		// Entries past the opcodes are further mnemonics of one, the function in the
+		// offset field or the condition of a branch tells them apart.
+		{VECTOR_MATH,            STR_OBJ("vsub"),       {UL_VREG,        UL_VREG,    UL_VREG}, VF_SUB},
+		{VECTOR_MATH,            STR_OBJ("vmul"),       {UL_VREG,        UL_VREG,    UL_VREG}, VF_MUL},
+		{VECTOR_MATH,            STR_OBJ("vmin"),       {UL_VREG,        UL_VREG,    UL_VREG}, VF_MIN},
+		{VECTOR_MATH,            STR_OBJ("vmax"),       {UL_VREG,        UL_VREG,    UL_VREG}, VF_MAX},
+		{VECTOR_MATH,            STR_OBJ("vaddf"),      {UL_VREG,        UL_VREG,    UL_VREG}, VF_ADD_FLOAT},
+		{VECTOR_MATH,            STR_OBJ("vsubf"),      {UL_VREG,        UL_VREG,    UL_VREG}, VF_SUB_FLOAT},
+		{VECTOR_MATH,            STR_OBJ("vmulf"),      {UL_VREG,        UL_VREG,    UL_VREG}, VF_MUL_FLOAT},
+		{VECTOR_MATH,            STR_OBJ("vminf"),      {UL_VREG,        UL_VREG,    UL_VREG}, VF_MIN_FLOAT},
+		{VECTOR_MATH,            STR_OBJ("vmaxf"),      {UL_VREG,        UL_VREG,    UL_VREG}, VF_MAX_FLOAT},
+		{SELECT,                 STR_OBJ("selne"),      {UL_REG,         UL_REG,     UL_REG}, JUMP_NOT_EQUAL - JUMP},
+		{SELECT,                 STR_OBJ("sell"),       {UL_REG,         UL_REG,     UL_REG}, JUMP_LESS - JUMP},
+		{SELECT,                 STR_OBJ("selg"),       {UL_REG,         UL_REG,     UL_REG}, JUMP_GREATER - JUMP},
+		{SELECT,                 STR_OBJ("selle"),      {UL_REG,         UL_REG,     UL_REG}, JUMP_LESS_EQUAL - JUMP},
+		{SELECT,                 STR_OBJ("selge"),      {UL_REG,         UL_REG,     UL_REG}, JUMP_GREATER_EQUAL - JUMP},
+		{MIN_MAX,                STR_OBJ("max"),        {UL_REG,         UL_REG,     UL_REG}, MF_MAX},
+		{MIN_MAX_VAL,            STR_OBJ("max"),        {UL_REG,         UL_LBL_INT, UL_REG}, MF_MAX},
+		{MIN_MAX,                STR_OBJ("minf"),       {UL_REG,         UL_REG,     UL_REG}, MF_FLOAT},
+		{MIN_MAX_VAL,            STR_OBJ("minf"),       {UL_REG,         UL_FLT,     UL_REG}, MF_FLOAT},
+		{MIN_MAX,                STR_OBJ("maxf"),       {UL_REG,         UL_REG,     UL_REG}, MF_MAX | MF_FLOAT},
+		{MIN_MAX_VAL,            STR_OBJ("maxf"),       {UL_REG,         UL_FLT,     UL_REG}, MF_MAX | MF_FLOAT},
+		{ABS,                    STR_OBJ("absf"),       {UL_REG,         UL_REG},              MF_FLOAT},
+		{CLAMP,                  STR_OBJ("clampf"),     {UL_REG,         UL_REG,     UL_REG}, MF_FLOAT},
+		{BITS,                   STR_OBJ("clz"),        {UL_REG,         UL_REG},              BF_CLZ},
+		{BITS,                   STR_OBJ("ctz"),        {UL_REG,         UL_REG},              BF_CTZ},
+		{BITS,                   STR_OBJ("bswap"),      {UL_REG,         UL_REG},              BF_BSWAP},
+		{FRAME,                  STR_OBJ("leave"),      {UL_REG},                              FF_LEAVE},
+		{PUSH_MASK,              STR_OBJ("popm"),       {UL_MASK},                             FF_LEAVE},
+		{BRANCH,                 STR_OBJ("bne"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_NOT_EQUAL},
+		{BRANCH_IMM,             STR_OBJ("bne"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_NOT_EQUAL},
+		{BRANCH,                 STR_OBJ("bl"),         {UL_REG,         UL_REG,     UL_LBL_INT}, BC_LESS},
+		{BRANCH_IMM,             STR_OBJ("bl"),         {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_LESS},
+		{BRANCH,                 STR_OBJ("bg"),         {UL_REG,         UL_REG,     UL_LBL_INT}, BC_GREATER},
+		{BRANCH_IMM,             STR_OBJ("bg"),         {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_GREATER},
+		{BRANCH,                 STR_OBJ("ble"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_LESS_EQUAL},
+		{BRANCH_IMM,             STR_OBJ("ble"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_LESS_EQUAL},
+		{BRANCH,                 STR_OBJ("bge"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_GREATER_EQUAL},
+		{BRANCH_IMM,             STR_OBJ("bge"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_GREATER_EQUAL},
+		{BRANCH,                 STR_OBJ("blu"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_LESS_UNSIGNED},
+		{BRANCH_IMM,             STR_OBJ("blu"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_LESS_UNSIGNED},
+		{BRANCH,                 STR_OBJ("bgu"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_GREATER_UNSIGNED},
+		{BRANCH_IMM,             STR_OBJ("bgu"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_GREATER_UNSIGNED},
+		{BRANCH,                 STR_OBJ("bleu"),       {UL_REG,         UL_REG,     UL_LBL_INT}, BC_LESS_EQUAL_UNSIGNED},
+		{BRANCH_IMM,             STR_OBJ("bleu"),       {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_LESS_EQUAL_UNSIGNED},
+		{BRANCH,                 STR_OBJ("bgeu"),       {UL_REG,         UL_REG,     UL_LBL_INT}, BC_GREATER_EQUAL_UNSIGNED},
+		{BRANCH_IMM,             STR_OBJ("bgeu"),       {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_GREATER_EQUAL_UNSIGNED},
+		{BRANCH,                 STR_OBJ("bef"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_EQUAL_FLOAT},
+		{BRANCH_IMM,             STR_OBJ("bef"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_EQUAL_FLOAT},
+		{BRANCH,                 STR_OBJ("bnef"),       {UL_REG,         UL_REG,     UL_LBL_INT}, BC_NOT_EQUAL_FLOAT},
+		{BRANCH_IMM,             STR_OBJ("bnef"),       {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_NOT_EQUAL_FLOAT},
+		{BRANCH,                 STR_OBJ("blf"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_LESS_FLOAT},
+		{BRANCH_IMM,             STR_OBJ("blf"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_LESS_FLOAT},
+		{BRANCH,                 STR_OBJ("bgf"),        {UL_REG,         UL_REG,     UL_LBL_INT}, BC_GREATER_FLOAT},
+		{BRANCH_IMM,             STR_OBJ("bgf"),        {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_GREATER_FLOAT},
+		{BRANCH,                 STR_OBJ("blef"),       {UL_REG,         UL_REG,     UL_LBL_INT}, BC_LESS_EQUAL_FLOAT},
+		{BRANCH_IMM,             STR_OBJ("blef"),       {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_LESS_EQUAL_FLOAT},
+		{BRANCH,                 STR_OBJ("bgef"),       {UL_REG,         UL_REG,     UL_LBL_INT}, BC_GREATER_EQUAL_FLOAT},
+		{BRANCH_IMM,             STR_OBJ("bgef"),       {UL_REG,         UL_IMM,     UL_LBL_INT}, BC_GREATER_EQUAL_FLOAT},
 };
 
 static size_t opcodeLength = sizeof(opcodes) / sizeof(opcode);
@@ -359,11 +918,36 @@ static reg registers[] = {
 		{{STR("r13")}},
 		{{STR("r14")}},
 		{{STR("sp")}},
-		{{STR("pc")}}
+		{{STR("pc")}},
+		{{STR("v0")}},
+		{{STR("v1")}},
+		{{STR("v2")}},
+		{{STR("v3")}}
 };
 
+// Registers from v0 on are vector registers
+#define FIRST_VECTOR_REGISTER 16
+
+#define OPCODE_TABLE_SIZE 512
+#define REGISTER_TABLE_SIZE 64
+
+// Open addressing hash tables mapping mnemonics and register names to their
+// table entries. Opcodes sharing a mnemonic are stored consecutively in opcodes,
+// so only the first entry of each mnemonic is inserted.
+static opcode *opcodeTable[OPCODE_TABLE_SIZE];
+static reg *registerTable[REGISTER_TABLE_SIZE];
+
 static ulang_bool initialized = UL_FALSE;
 
+static uint32_t hash_string(const char *data, size_t length) {
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; i++) {
+		hash ^= (uint8_t) data[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
 static void init_opcodes_and_registers() {
 	if (initialized) return;
 
@@ -377,42 +961,94 @@ static void init_opcodes_and_registers() {
 				opcode->hasValueOperand = UL_TRUE;
 			opcode->numOperands++;
 		}
+
+		// Forms the assembler picks itself are reached through their mnemonic's other forms
+		if ((opcode->code >= ADD_IMM && opcode->code <= STORE_SHORT_INDEXED) || opcode->code == BRANCH_NEAR || opcode->code == BRANCH_IMM_NEAR) continue;
+		if (i > 0 && ulang_string_equals(&opcode->name, &opcodes[i - 1].name)) continue;
+		uint32_t slot = hash_string(opcode->name.data, opcode->name.length) & (OPCODE_TABLE_SIZE - 1);
+		while (opcodeTable[slot]) slot = (slot + 1) & (OPCODE_TABLE_SIZE - 1);
+		opcodeTable[slot] = opcode;
 	}
 
 	for (size_t i = 0; i < (sizeof(registers) / sizeof(reg)); i++) {
 		registers[i].index = (int) i;
+		uint32_t slot = hash_string(registers[i].name.data, registers[i].name.length) & (REGISTER_TABLE_SIZE - 1);
+		while (registerTable[slot]) slot = (slot + 1) & (REGISTER_TABLE_SIZE - 1);
+		registerTable[slot] = &registers[i];
 	}
 	initialized = UL_TRUE;
 }
 
-static int allocs = 0;
-static int frees = 0;
-
-void *ulang_alloc(size_t numBytes) {
-	allocs++;
+static void *default_alloc(size_t numBytes, void *userData) {
+	(void) userData;
 	return malloc(numBytes);
 }
 
-EMSCRIPTEN_KEEPALIVE void *ulang_calloc(size_t numBytes) {
-	allocs++;
-	void *result = malloc(numBytes);
+static void *default_realloc(void *old, size_t numBytes, void *userData) {
+	(void) userData;
+	return realloc(old, numBytes);
+}
+
+static void default_free(void *ptr, void *userData) {
+	(void) userData;
+	free(ptr);
+}
+
+static ulang_allocator defaultAllocator = {default_alloc, default_realloc, default_free};
+
+EMSCRIPTEN_KEEPALIVE ulang_allocator *ulang_default_allocator() {
+	return &defaultAllocator;
+}
+
+void *ulang_allocator_alloc(ulang_allocator *allocator, size_t numBytes) {
+	allocator->allocs++;
+	allocator->bytesRequested += numBytes;
+	return allocator->allocFunction(numBytes, allocator->userData);
+}
+
+static void *allocator_calloc(ulang_allocator *allocator, size_t numBytes) {
+	void *result = ulang_allocator_alloc(allocator, numBytes);
 	memset(result, 0, numBytes);
 	return result;
 }
 
-void *ulang_realloc(void *old, size_t numBytes) {
-	return realloc(old, numBytes);
+void *ulang_allocator_realloc(ulang_allocator *allocator, void *old, size_t numBytes) {
+	if (old) allocator->reallocs++;
+	else allocator->allocs++;
+	allocator->bytesRequested += numBytes;
+	return allocator->reallocFunction(old, numBytes, allocator->userData);
 }
 
-EMSCRIPTEN_KEEPALIVE void ulang_free(void *ptr) {
+void ulang_allocator_free(ulang_allocator *allocator, void *ptr) {
 	if (!ptr)
 		return;
-	frees++;
-	free(ptr);
+	allocator->frees++;
+	allocator->freeFunction(ptr, allocator->userData);
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_allocator_print(ulang_allocator *allocator) {
+	printf("Allocations: %zu\nReallocations: %zu\nFrees: %zu\nDiff: %zi\nBytes requested: %zu\n", allocator->allocs,
+		   allocator->reallocs, allocator->frees, (ptrdiff_t) (allocator->allocs - allocator->frees), allocator->bytesRequested);
+}
+
+void *ulang_alloc(size_t numBytes) {
+	return ulang_allocator_alloc(&defaultAllocator, numBytes);
+}
+
+EMSCRIPTEN_KEEPALIVE void *ulang_calloc(size_t numBytes) {
+	return allocator_calloc(&defaultAllocator, numBytes);
+}
+
+void *ulang_realloc(void *old, size_t numBytes) {
+	return ulang_allocator_realloc(&defaultAllocator, old, numBytes);
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_free(void *ptr) {
+	ulang_allocator_free(&defaultAllocator, ptr);
 }
 
 EMSCRIPTEN_KEEPALIVE void ulang_print_memory() {
-	printf("Allocations: %i\nFrees: %i\nDiff: %i\n", allocs, frees, allocs - frees);
+	ulang_allocator_print(&defaultAllocator);
 }
 
 ulang_bool ulang_file_read(const char *fileName, ulang_file *file) {
@@ -520,6 +1156,11 @@ void ulang_error_init(ulang_error *error, ulang_file *file, ulang_span *span, co
 		error->file->data = ulang_alloc(file->length);
 		error->file->length = file->length;
 		memcpy(error->file->data, file->data, file->length);
+		// Windows of streamed sources number their lines from where they start in the file
+		if (file->lines && file->numLines && file->lines[1].lineNumber != 1) {
+			ulang_file_get_lines(error->file);
+			for (size_t i = 1; i <= error->file->numLines; i++) error->file->lines[i].lineNumber += file->lines[1].lineNumber - 1;
+		}
 	} else {
 		error->file = NULL;
 	}
@@ -608,17 +1249,70 @@ ulang_bool ulang_span_matches(ulang_span *span, const char *needle, size_t lengt
 	return UL_TRUE;
 }
 
+static ulang_string *label_name(void *labels, uint32_t index) {
+	return &((ulang_label *) labels)[index].label.data;
+}
+
+static ulang_string *constant_name(void *constants, uint32_t index) {
+	return &((ulang_constant *) constants)[index].name.data;
+}
+
+static int32_t symbol_table_find(uint32_t *slots, size_t numSlots, void *symbols, symbol_name_function name, ulang_string *needle) {
+	if (numSlots == 0) return -1;
+	uint32_t slot = hash_string(needle->data, needle->length) & (numSlots - 1);
+	while (slots[slot]) {
+		if (ulang_string_equals(name(symbols, slots[slot] - 1), needle)) return (int32_t) slots[slot] - 1;
+		slot = (slot + 1) & (numSlots - 1);
+	}
+	return -1;
+}
+
+static void symbol_table_insert_slot(uint32_t *slots, size_t numSlots, void *symbols, symbol_name_function name, uint32_t index) {
+	ulang_string *str = name(symbols, index);
+	uint32_t slot = hash_string(str->data, str->length) & (numSlots - 1);
+	while (slots[slot]) slot = (slot + 1) & (numSlots - 1);
+	slots[slot] = index + 1;
+}
+
+static void symbol_table_insert(symbol_table *table, void *symbols, symbol_name_function name, uint32_t index) {
+	if ((table->size + 1) * 2 > table->numSlots) {
+		size_t numSlots = MAX(16, table->numSlots * 2);
+		uint32_t *slots = table->arena ? arena_alloc(table->arena, sizeof(uint32_t) * numSlots) : ulang_alloc(sizeof(uint32_t) * numSlots);
+		memset(slots, 0, sizeof(uint32_t) * numSlots);
+		for (size_t i = 0; i < table->numSlots; i++) {
+			if (table->slots[i]) symbol_table_insert_slot(slots, numSlots, symbols, name, table->slots[i] - 1);
+		}
+		if (!table->arena) ulang_free(table->slots);
+		table->slots = slots;
+		table->numSlots = numSlots;
+	}
+	symbol_table_insert_slot(table->slots, table->numSlots, symbols, name, index);
+	table->size++;
+}
+
+static ulang_string *import_name(void *imports, uint32_t index) {
+	return &((unit_import *) imports)[index].name;
+}
+
+// Records a constant lookup of a unit for the compile cache. Constants the unit
+// defined itself count as not found, a definition before the unit would have won.
+static void compile_unit_add_import(compile_unit *unit, ulang_string *name, int32_t index) {
+	if (symbol_table_find(unit->importTable.slots, unit->importTable.numSlots, unit->imports.items, import_name, name) >= 0) return;
+	unit_import import = {*name, index >= (int32_t) unit->constantsStart ? -1 : index};
+	import_array_add(&unit->imports, import);
+	symbol_table_insert(&unit->importTable, unit->imports.items, import_name, (uint32_t) unit->imports.size - 1);
+}
+
+
 typedef struct {
 	ulang_file *data;
 	uint32_t index;
 	uint32_t end;
-	uint32_t line;
 } char_stream;
 
 static void char_stream_init(char_stream *stream, ulang_file *fileData) {
 	stream->data = fileData;
 	stream->index = 0;
-	stream->line = 1;
 	stream->end = (uint32_t) fileData->length;
 }
 
@@ -628,6 +1322,13 @@ static uint32_t next_utf8_character(const char *data, uint32_t *index, uint32_t
 			0x03C82080UL, 0xFA082080UL, 0x82082080UL
 	};
 
+	// ASCII character not followed by a continuation byte
+	char first = data[*index];
+	if (first >= 0 && (*index + 1 == end || (data[*index + 1] & 0xC0) != 0x80)) {
+		(*index)++;
+		return (uint32_t) first;
+	}
+
 	uint32_t character = 0;
 	int sz = 0;
 	do {
@@ -670,16 +1371,6 @@ static ulang_bool char_stream_match_digit(char_stream *stream, ulang_bool consum
 	return UL_FALSE;
 }
 
-static ulang_bool char_stream_match_hex(char_stream *stream) {
-	if (!char_stream_has_more(stream)) return UL_FALSE;
-	char c = stream->data->data[stream->index];
-	if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F')) {
-		stream->index++;
-		return UL_TRUE;
-	}
-	return UL_FALSE;
-}
-
 static ulang_bool char_stream_match_identifier_start(char_stream *stream) {
 	if (!char_stream_has_more(stream)) return UL_FALSE;
 	uint32_t idx = stream->index;
@@ -704,47 +1395,229 @@ static ulang_bool char_stream_match_identifier_part(char_stream *stream) {
 	return UL_FALSE;
 }
 
+// Byte classes the tokenizer skips in bulk. Only ASCII bytes are members,
+// UTF-8 sequences are left to next_utf8_character.
+typedef enum char_class {
+	CHAR_CLASS_WHITE_SPACE,
+	CHAR_CLASS_DIGIT,
+	CHAR_CLASS_HEX,
+	CHAR_CLASS_IDENTIFIER
+} char_class;
+
+static inline ulang_bool char_class_matches(char c, char_class cls) {
+	char lower = (char) (c | 0x20);
+	switch (cls) {
+		case CHAR_CLASS_WHITE_SPACE:
+			return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+		case CHAR_CLASS_DIGIT:
+			return c >= '0' && c <= '9';
+		case CHAR_CLASS_HEX:
+			return (c >= '0' && c <= '9') || (lower >= 'a' && lower <= 'f');
+		case CHAR_CLASS_IDENTIFIER:
+			return (c >= '0' && c <= '9') || (lower >= 'a' && lower <= 'z') || c == '_';
+	}
+	return UL_FALSE;
+}
+
+static inline uint32_t count_trailing_zeros(uint64_t value) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+	unsigned long index;
+	_BitScanForward64(&index, value);
+	return (uint32_t) index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (uint32_t) value)) return (uint32_t) index;
+	_BitScanForward(&index, (uint32_t) (value >> 32));
+	return (uint32_t) index + 32;
+#else
+	return (uint32_t) __builtin_ctzll(value);
+#endif
+}
+
+#ifdef UL_SIMD_SSE2
+// Bytes are compared as signed, so bytes >= 0x80 never fall into an ASCII range.
+static inline __m128i simd_in_range_16(__m128i v, char low, char high) {
+	return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8((char) (low - 1))), _mm_cmplt_epi8(v, _mm_set1_epi8((char) (high + 1))));
+}
+
+static inline uint32_t simd_class_mask_16(const char *data, char_class cls) {
+	__m128i v = _mm_loadu_si128((const __m128i *) data);
+	__m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i m;
+	switch (cls) {
+		case CHAR_CLASS_WHITE_SPACE:
+			m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t'))),
+							 _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\r')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+			break;
+		case CHAR_CLASS_DIGIT:
+			m = simd_in_range_16(v, '0', '9');
+			break;
+		case CHAR_CLASS_HEX:
+			m = _mm_or_si128(simd_in_range_16(v, '0', '9'), simd_in_range_16(lower, 'a', 'f'));
+			break;
+		default:
+			m = _mm_or_si128(_mm_or_si128(simd_in_range_16(v, '0', '9'), simd_in_range_16(lower, 'a', 'z')),
+							 _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+			break;
+	}
+	return (uint32_t) _mm_movemask_epi8(m);
+}
+#endif
+
+#ifdef UL_SIMD_AVX2
+static inline __m256i simd_in_range_32(__m256i v, char low, char high) {
+	return _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char) (low - 1))), _mm256_cmpgt_epi8(_mm256_set1_epi8((char) (high + 1)), v));
+}
+
+static inline uint32_t simd_class_mask_32(const char *data, char_class cls) {
+	__m256i v = _mm256_loadu_si256((const __m256i *) data);
+	__m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+	__m256i m;
+	switch (cls) {
+		case CHAR_CLASS_WHITE_SPACE:
+			m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t'))),
+								_mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')), _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n'))));
+			break;
+		case CHAR_CLASS_DIGIT:
+			m = simd_in_range_32(v, '0', '9');
+			break;
+		case CHAR_CLASS_HEX:
+			m = _mm256_or_si256(simd_in_range_32(v, '0', '9'), simd_in_range_32(lower, 'a', 'f'));
+			break;
+		default:
+			m = _mm256_or_si256(_mm256_or_si256(simd_in_range_32(v, '0', '9'), simd_in_range_32(lower, 'a', 'z')),
+								_mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+			break;
+	}
+	return (uint32_t) _mm256_movemask_epi8(m);
+}
+#endif
+
+#ifdef UL_SIMD_NEON
+static inline uint8x16_t simd_in_range_16(uint8x16_t v, char low, char high) {
+	return vandq_u8(vcgeq_u8(v, vdupq_n_u8((uint8_t) low)), vcleq_u8(v, vdupq_n_u8((uint8_t) high)));
+}
+
+// NEON has no movemask, the result holds 4 bits per byte instead.
+static inline uint64_t simd_class_mask_16(const char *data, char_class cls) {
+	uint8x16_t v = vld1q_u8((const uint8_t *) data);
+	uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+	uint8x16_t m;
+	switch (cls) {
+		case CHAR_CLASS_WHITE_SPACE:
+			m = vorrq_u8(vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')), vceqq_u8(v, vdupq_n_u8('\t'))),
+						 vorrq_u8(vceqq_u8(v, vdupq_n_u8('\r')), vceqq_u8(v, vdupq_n_u8('\n'))));
+			break;
+		case CHAR_CLASS_DIGIT:
+			m = simd_in_range_16(v, '0', '9');
+			break;
+		case CHAR_CLASS_HEX:
+			m = vorrq_u8(simd_in_range_16(v, '0', '9'), simd_in_range_16(lower, 'a', 'f'));
+			break;
+		default:
+			m = vorrq_u8(vorrq_u8(simd_in_range_16(v, '0', '9'), simd_in_range_16(lower, 'a', 'z')), vceqq_u8(v, vdupq_n_u8('_')));
+			break;
+	}
+	return vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+}
+#endif
+
+// Returns the index of the first byte at or after index that is not in the class.
+static uint32_t scan_char_class(const char *data, uint32_t index, uint32_t end, char_class cls) {
+#ifdef UL_SIMD_AVX2
+	while (end - index >= 32) {
+		uint32_t mask = ~simd_class_mask_32(data + index, cls);
+		if (mask) return index + count_trailing_zeros(mask);
+		index += 32;
+	}
+#endif
+#ifdef UL_SIMD_SSE2
+	while (end - index >= 16) {
+		uint32_t mask = ~simd_class_mask_16(data + index, cls) & 0xffff;
+		if (mask) return index + count_trailing_zeros(mask);
+		index += 16;
+	}
+#endif
+#ifdef UL_SIMD_NEON
+	while (end - index >= 16) {
+		uint64_t mask = ~simd_class_mask_16(data + index, cls);
+		if (mask) return index + count_trailing_zeros(mask) / 4;
+		index += 16;
+	}
+#endif
+	while (index < end && char_class_matches(data[index], cls)) index++;
+	return index;
+}
+
+static void char_stream_skip_class(char_stream *stream, char_class cls) {
+	stream->index = scan_char_class(stream->data->data, stream->index, stream->end, cls);
+}
+
+static void char_stream_skip_identifier_part(char_stream *stream) {
+	while (UL_TRUE) {
+		// ASCII runs are skipped in bulk. The last byte of a run is matched by
+		// char_stream_match_identifier_part, which decodes it together with any
+		// UTF-8 continuation bytes following it.
+		uint32_t runEnd = scan_char_class(stream->data->data, stream->index, stream->end, CHAR_CLASS_IDENTIFIER);
+		if (runEnd > stream->index + 1) stream->index = runEnd - 1;
+		if (!char_stream_match_identifier_part(stream)) return;
+	}
+}
+
 static void char_stream_skip_white_space(char_stream *stream) {
 	const char *sourceData = stream->data->data;
 	while (UL_TRUE) {
-		if (stream->index >= stream->end) return;
-		char c = sourceData[stream->index];
-		switch (c) {
-			case '#': {
-				while (stream->index < stream->end && c != '\n') {
-					c = sourceData[stream->index];
-					stream->index++;
-				}
-				stream->line++;
-				continue;
-			}
-			case ' ':
-			case '\r':
-			case '\t': {
-				stream->index++;
-				continue;
-			}
-			case '\n': {
-				stream->index++;
-				stream->line++;
-				continue;
-			}
-			default:
-				return;
+		char_stream_skip_class(stream, CHAR_CLASS_WHITE_SPACE);
+		if (stream->index >= stream->end || sourceData[stream->index] != '#') return;
+		const char *lineEnd = memchr(sourceData + stream->index, '\n', stream->end - stream->index);
+		stream->index = lineEnd ? (uint32_t) (lineEnd - sourceData) + 1 : stream->end;
+	}
+}
+
+static uint32_t file_line_start(ulang_file *file, uint32_t line) {
+	return (uint32_t) (file->lines[line].data.data - file->data);
+}
+
+// Returns the line containing the offset. Lookups are mostly made in source order,
+// so the search walks forward from the line of the last lookup if it is given.
+static uint32_t file_line(ulang_file *file, uint32_t offset, uint32_t lastLine) {
+	ulang_file_get_lines(file);
+	if (file->numLines == 0) return 1;
+	uint32_t line = lastLine;
+	if (line < 1 || line > file->numLines || file_line_start(file, line) > offset) {
+		uint32_t low = 1, high = (uint32_t) file->numLines;
+		while (low < high) {
+			uint32_t mid = (low + high + 1) / 2;
+			if (file_line_start(file, mid) <= offset) low = mid;
+			else high = mid - 1;
 		}
+		return low;
 	}
+	while (line < file->numLines && file_line_start(file, line + 1) <= offset) line++;
+	return line;
+}
+
+static ulang_string token_text(ulang_file *file, token *tok) {
+	return (ulang_string) {file->data + tok->offset, tok->length};
+}
+
+static ulang_span token_span(ulang_file *file, token *tok) {
+	uint32_t line = file_line(file, tok->offset, 0);
+	return (ulang_span) {token_text(file, tok), line, line};
+}
+
+static void token_error(ulang_error *error, ulang_file *file, token *tok, const char *message) {
+	ulang_span span = token_span(file, tok);
+	ulang_error_init(error, file, &span, "%s", message);
 }
 
-static void char_stream_start_span_inplace(char_stream *stream, ulang_span *span) {
-	span->endLine = stream->index;
-	span->startLine = stream->line;
+static ulang_bool token_matches(ulang_file *file, token *tok, const char *needle, size_t length) {
+	return tok->length == length && !memcmp(file->data + tok->offset, needle, length);
 }
 
-static ulang_span *char_stream_end_span_inplace(char_stream *stream, ulang_span *span) {
-	span->data.data = stream->data->data + span->endLine;
-	span->data.length = stream->index - span->endLine;
-	span->endLine = stream->line;
-	return span;
+static ulang_span char_stream_span(char_stream *stream, uint32_t start) {
+	token tok = {start, stream->index - start};
+	return token_span(stream->data, &tok);
 }
 
 static const char *token_type_to_string(token_type type) {
@@ -766,75 +1639,77 @@ static const char *token_type_to_string(token_type type) {
 	}
 }
 
-static reg *token_matches_register(token *token) {
-	ulang_span *span = &token->span;
-	for (size_t i = 0; i < (sizeof(registers) / sizeof(reg)); i++) {
-		if (ulang_span_matches(span, registers[i].name.data, registers[i].name.length)) {
-			return &registers[i];
-		}
+static reg *token_matches_register(ulang_file *file, token *token) {
+	if (token->type != TOKEN_IDENTIFIER) return NULL;
+	ulang_string text = token_text(file, token);
+	uint32_t slot = hash_string(text.data, text.length) & (REGISTER_TABLE_SIZE - 1);
+	while (registerTable[slot]) {
+		if (ulang_string_equals(&text, &registerTable[slot]->name)) return registerTable[slot];
+		slot = (slot + 1) & (REGISTER_TABLE_SIZE - 1);
 	}
 	return NULL;
 }
 
-static opcode *token_matches_opcode(token *token) {
-	ulang_span *span = &token->span;
-	for (size_t i = 0; i < opcodeLength; i++) {
-		if (ulang_span_matches(span, opcodes[i].name.data, opcodes[i].name.length)) {
-			return &opcodes[i];
-		}
+static opcode *token_matches_opcode(ulang_file *file, token *token) {
+	if (token->type != TOKEN_IDENTIFIER) return NULL;
+	ulang_string text = token_text(file, token);
+	uint32_t slot = hash_string(text.data, text.length) & (OPCODE_TABLE_SIZE - 1);
+	while (opcodeTable[slot]) {
+		if (ulang_string_equals(&text, &opcodeTable[slot]->name)) return opcodeTable[slot];
+		slot = (slot + 1) & (OPCODE_TABLE_SIZE - 1);
 	}
 	return NULL;
 }
 
-int token_to_int(token *token) {
-	ulang_string *str = &token->span.data;
-	char c = str->data[str->length];
-	str->data[str->length] = 0;
-	int val = (int) strtoll(str->data, NULL, 0);
-	str->data[str->length] = c;
+int token_to_int(ulang_file *file, token *token) {
+	char *data = file->data + token->offset;
+	char c = data[token->length];
+	data[token->length] = 0;
+	int val = (int) strtoll(data, NULL, 0);
+	data[token->length] = c;
 	return val;
 }
 
-static float token_to_float(token *token) {
-	ulang_string *str = &token->span.data;
-	char c = str->data[str->length];
-	str->data[str->length] = 0;
-	float val = strtof(str->data, NULL);
-	str->data[str->length] = c;
+static float token_to_float(ulang_file *file, token *token) {
+	char *data = file->data + token->offset;
+	char c = data[token->length];
+	data[token->length] = 0;
+	float val = strtof(data, NULL);
+	data[token->length] = c;
 	return val;
 }
 
 static ulang_bool tokenize(ulang_file *file, token_array *tokens, ulang_error *error) {
 	char_stream stream;
 	char_stream_init(&stream, file);
+	token_array_ensure(tokens, file->length / 4);
 
 	while (char_stream_has_more(&stream)) {
 		char_stream_skip_white_space(&stream);
 		if (!char_stream_has_more(&stream)) break;
 		token_type type;
-		ulang_span span;
-		char_stream_start_span_inplace(&stream, &span);
+		uint32_t start = stream.index;
 
 		if (char_stream_match_digit(&stream, UL_FALSE)) {
 			type = TOKEN_INTEGER;
 			if (char_stream_match(&stream, "0x", UL_TRUE)) {
-				while (char_stream_match_hex(&stream));
+				char_stream_skip_class(&stream, CHAR_CLASS_HEX);
 			} else {
-				while (char_stream_match_digit(&stream, UL_TRUE));
+				char_stream_skip_class(&stream, CHAR_CLASS_DIGIT);
 				if (char_stream_match(&stream, ".", UL_TRUE)) {
 					type = TOKEN_FLOAT;
-					while (char_stream_match_digit(&stream, UL_TRUE));
+					char_stream_skip_class(&stream, CHAR_CLASS_DIGIT);
 				}
 			}
 			if (char_stream_match(&stream, "b", UL_TRUE)) {
 				if (type == TOKEN_FLOAT) {
-					ulang_error_init(error, stream.data, char_stream_end_span_inplace(&stream, &span), "Byte literal can not have a decimal point.");
+					ulang_span span = char_stream_span(&stream, start);
+					ulang_error_init(error, stream.data, &span, "Byte literal can not have a decimal point.");
 					return UL_FALSE;
 				}
 				type = TOKEN_INTEGER;
 			}
-			char_stream_end_span_inplace(&stream, &span);
-			token_array_add(tokens, (token) {span, type});
+			token_array_add(tokens, (token) {start, stream.index - start, type});
 			continue;
 		}
 
@@ -851,27 +1726,26 @@ static ulang_bool tokenize(ulang_file *file, token_array *tokens, ulang_error *e
 					break;
 				}
 				if (char_stream_match(&stream, "\n", UL_FALSE)) {
-					ulang_error_init(error, stream.data, char_stream_end_span_inplace(&stream, &span),
-									 "String literal is not closed by double quote");
+					ulang_span span = char_stream_span(&stream, start);
+					ulang_error_init(error, stream.data, &span, "String literal is not closed by double quote");
 					return UL_FALSE;
 				}
 				char_stream_consume(&stream);
 			}
 			if (!matchedEndQuote) {
-				ulang_error_init(error, stream.data, char_stream_end_span_inplace(&stream, &span), "String literal is not closed by double quote");
+				ulang_span span = char_stream_span(&stream, start);
+				ulang_error_init(error, stream.data, &span, "String literal is not closed by double quote");
 				return UL_FALSE;
 			}
-			char_stream_end_span_inplace(&stream, &span);
-			token_array_add(tokens, (token) {span, type});
+			token_array_add(tokens, (token) {start, stream.index - start, type});
 			continue;
 		}
 
 		// Identifier or keyword
 		if (char_stream_match_identifier_start(&stream)) {
-			while (char_stream_match_identifier_part(&stream));
+			char_stream_skip_identifier_part(&stream);
 			type = TOKEN_IDENTIFIER;
-			char_stream_end_span_inplace(&stream, &span);
-			token_array_add(tokens, (token) {span, type});
+			token_array_add(tokens, (token) {start, stream.index - start, type});
 			continue;
 		}
 
@@ -879,8 +1753,7 @@ static ulang_bool tokenize(ulang_file *file, token_array *tokens, ulang_error *e
 		// 1 character literals, like ".", ",", or ";",
 		char_stream_consume(&stream);
 		type = TOKEN_SPECIAL_CHAR;
-		char_stream_end_span_inplace(&stream, &span);
-		token_array_add(tokens, (token) {span, type});
+		token_array_add(tokens, (token) {start, stream.index - start, type});
 	}
 	return UL_TRUE;
 }
@@ -889,6 +1762,12 @@ static ulang_bool token_stream_has_more(token_stream *stream) {
 	return stream->index < stream->end;
 }
 
+// Span of a token kept beyond the compile, like a label name or a line of code.
+static ulang_span token_stream_span(token_stream *stream, token *tok) {
+	stream->line = file_line(stream->file, tok->offset, stream->line);
+	return (ulang_span) {token_text(stream->file, tok), stream->line, stream->line};
+}
+
 static token *token_stream_consume(token_stream *stream) {
 	if (!token_stream_has_more(stream)) return NULL;
 	return &stream->tokens->items[stream->index++];
@@ -912,7 +1791,7 @@ static token *token_stream_match(token_stream *stream, token_type type, ulang_bo
 static token *token_stream_match_string(token_stream *stream, const char *text, size_t len, ulang_bool consume) {
 	if (!token_stream_has_more(stream)) return UL_FALSE;
 	token *token = &stream->tokens->items[stream->index];
-	if (ulang_span_matches(&token->span, text, len)) {
+	if (token_matches(stream->file, token, text, len)) {
 		if (consume) stream->index++;
 		return token;
 	}
@@ -932,8 +1811,9 @@ token_stream_expect(token_stream *stream, token_type type, ulang_error *error) {
 							 token_type_to_string(type));
 			return NULL;
 		} else {
-			ulang_error_init(error, stream->file, &lastToken->span, "Expected a '%s' token, but got a '%.*s' token", token_type_to_string(type),
-							 lastToken->span.data.length, lastToken->span.data.data);
+			ulang_span span = token_span(stream->file, lastToken);
+			ulang_error_init(error, stream->file, &span, "Expected a '%s' token, but got a '%.*s' token", token_type_to_string(type),
+							 span.data.length, span.data.data);
 		}
 		return NULL;
 	} else {
@@ -954,8 +1834,9 @@ token_stream_expect_string(token_stream *stream, char *str, size_t len, const ch
 							 len, str, message);
 			return NULL;
 		} else {
-			ulang_error_init(error, stream->file, &lastToken->span, "Expected '%.*s' %s, but got '%.*s'", len, str, message,
-							 lastToken->span.data.length, lastToken->span.data.data);
+			ulang_span span = token_span(stream->file, lastToken);
+			ulang_error_init(error, stream->file, &span, "Expected '%.*s' %s, but got '%.*s'", len, str, message,
+							 span.data.length, span.data.data);
 		}
 		return NULL;
 	} else {
@@ -971,140 +1852,219 @@ static ulang_string binaryOperators[][4] = {
 		{STR_OBJ("/"), STR_OBJ("*"), STR_OBJ("%"), {0}}
 };
 
-static ulang_bool parse_expression(compiler_context *ctx, expression_value *value, ulang_span *span);
+static ulang_bool parse_expression(compiler_context *ctx, expression_value *value, token *source);
 
-static ulang_bool parse_unary_operator(compiler_context *ctx, expression_value *value) {
-	ulang_string *op = unaryOperators;
-	while (op->data) {
-		if (token_stream_match_string(&ctx->stream, op->data, op->length, UL_FALSE)) break;
-		op++;
+static void add_expression_op(compiler_context *ctx, expression_op_type type, token *source, expression_value *value) {
+	if (!ctx->unit) return;
+	expression_op op = {type, *source};
+	if (value) {
+		op.valueType = value->type;
+		op.i = value->i;
+		op.f = value->f;
 	}
-	if (op->data) {
-		token *opToken = token_stream_consume(&ctx->stream);
-		expression_value exprValue = { 0 };
-		if (!parse_unary_operator(ctx, &exprValue) || ctx->error->is_set) return UL_FALSE;
-		value->unresolved = exprValue.unresolved;
-		switch (opToken->span.data.data[0]) {
-			case '~':
-				if (exprValue.type == UL_FLOAT) {
-					ulang_error_init(ctx->error, ctx->stream.file, &opToken->span, "Operator ~ can not be used with float values.");
-					return UL_FALSE;
-				}
+	expression_op_array_add(&ctx->unit->ops, op);
+}
+
+static ulang_bool apply_unary_operator(compiler_context *ctx, ulang_file *file, token *opToken, expression_value *operand, expression_value *value) {
+	switch (file->data[opToken->offset]) {
+		case '~':
+			if (operand->type == UL_FLOAT) {
+				token_error(ctx->error, file, opToken, "Operator ~ can not be used with float values.");
+				return UL_FALSE;
+			}
+			value->type = UL_INTEGER;
+			value->i = ~operand->i;
+			value->f = (float) value->i;
+			break;
+		case '+':
+			if (operand->type == UL_INTEGER) {
 				value->type = UL_INTEGER;
-				value->i = ~exprValue.i;
+				value->i = operand->i;
 				value->f = (float) value->i;
-				break;
-			case '+':
-				if (exprValue.type == UL_INTEGER) {
-					value->type = UL_INTEGER;
-					value->i = exprValue.i;
-					value->f = (float) value->i;
-				} else {
-					value->type = UL_FLOAT;
-					value->f = exprValue.f;
-				}
-				break;
-			case '-':
-				if (exprValue.type == UL_INTEGER) {
-					value->type = UL_INTEGER;
-					value->i = -exprValue.i;
-					value->f = (float) value->i;
-				} else {
-					value->type = UL_FLOAT;
-					value->f = -exprValue.f;
-				}
-				break;
-		}
+			} else {
+				value->type = UL_FLOAT;
+				value->f = operand->f;
+			}
+			break;
+		case '-':
+			if (operand->type == UL_INTEGER) {
+				value->type = UL_INTEGER;
+				value->i = -operand->i;
+				value->f = (float) value->i;
+			} else {
+				value->type = UL_FLOAT;
+				value->f = -operand->f;
+			}
+			break;
+	}
+	return UL_TRUE;
+}
+
+static ulang_bool apply_binary_operator(compiler_context *ctx, ulang_file *file, token *opToken, expression_value *left, expression_value *right, expression_value *value) {
+	switch (file->data[opToken->offset]) {
+		case '|':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				token_error(ctx->error, file, opToken, "Operator | can not be used with float values.");
+				return UL_FALSE;
+			}
+			value->type = UL_INTEGER;
+			value->i = left->i | right->i;
+			value->f = (float) value->i;
+			break;
+		case '&':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				token_error(ctx->error, file, opToken, "Operator & can not be used with float values.");
+				return UL_FALSE;
+			}
+			value->type = UL_INTEGER;
+			value->i = left->i & right->i;
+			value->f = (float) value->i;
+			break;
+		case '^':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				token_error(ctx->error, file, opToken, "Operator ^ can not be used with float values.");
+				return UL_FALSE;
+			}
+			value->type = UL_INTEGER;
+			value->i = left->i ^ right->i;
+			value->f = (float) value->i;
+			break;
+		case '+':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				value->type = UL_FLOAT;
+				value->f = left->f + right->f;
+			} else {
+				value->type = UL_INTEGER;
+				value->i = left->i + right->i;
+				value->f = (float) value->i;
+			}
+			break;
+		case '-':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				value->type = UL_FLOAT;
+				value->f = left->f - right->f;
+			} else {
+				value->type = UL_INTEGER;
+				value->i = left->i - right->i;
+				value->f = (float) value->i;
+			}
+			break;
+		case '*':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				value->type = UL_FLOAT;
+				value->f = left->f * right->f;
+			} else {
+				value->type = UL_INTEGER;
+				value->i = left->i * right->i;
+				value->f = (float) value->i;
+			}
+			break;
+		case '/':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				value->type = UL_FLOAT;
+				value->f = left->f / right->f;
+			} else {
+				value->type = UL_INTEGER;
+				value->i = left->i / right->i;
+				value->f = (float) value->i;
+			}
+			break;
+		case '%':
+			if (left->type == UL_FLOAT || right->type == UL_FLOAT) {
+				token_error(ctx->error, file, opToken, "Operator % can not be used with float values.");
+				return UL_FALSE;
+			} else {
+				value->type = UL_INTEGER;
+				value->i = left->i % right->i;
+				value->f = (float) value->i;
+			}
+			break;
+	}
+	return UL_TRUE;
+}
+
+static ulang_bool parse_unary_operator(compiler_context *ctx, expression_value *value) {
+	ulang_string *op = unaryOperators;
+	while (op->data) {
+		if (token_stream_match_string(&ctx->stream, op->data, op->length, UL_FALSE)) break;
+		op++;
+	}
+	if (op->data) {
+		token *opToken = token_stream_consume(&ctx->stream);
+		expression_value exprValue = { 0 };
+		if (!parse_unary_operator(ctx, &exprValue) || ctx->error->is_set) return UL_FALSE;
+		value->unresolved = exprValue.unresolved;
+		if (!apply_unary_operator(ctx, ctx->stream.file, opToken, &exprValue, value)) return UL_FALSE;
+		add_expression_op(ctx, EO_UNARY, opToken, NULL);
 		return UL_TRUE;
 	} else {
 		if (token_stream_match_string(&ctx->stream, STR("("), UL_TRUE)) {
+			token *openToken = &ctx->stream.tokens->items[ctx->stream.index - 1];
 			if (!parse_expression(ctx, value, NULL) || ctx->error->is_set) return UL_FALSE;
 			if (!token_stream_expect_string(&ctx->stream, STR(")"), "to close parenthesized expression", ctx->error)) return UL_FALSE;
+			// A resolved sub-expression dropped its ops, it takes part as a plain value
+			if (!value->unresolved) add_expression_op(ctx, EO_VALUE, openToken, value);
 			return UL_TRUE;
 		} else {
 			token *literal = token_stream_consume(&ctx->stream);
 			if (!literal) {
-				literal = &ctx->stream.tokens->items[ctx->stream.tokens->size - 1];
-				ulang_error_init(ctx->error, ctx->stream.file, &literal->span, "Expected an integer, a float, a constant, or a label.");
+				ulang_span span = token_span(ctx->stream.file, &ctx->stream.tokens->items[ctx->stream.end - 1]);
+				ulang_error_init(ctx->error, ctx->stream.file, &span, "Expected an integer, a float, a constant, or a label.");
 				return UL_FALSE;
 			}
 			switch (literal->type) {
 				case TOKEN_INTEGER:
 					value->type = UL_INTEGER;
-					value->i = token_to_int(literal);
+					value->i = token_to_int(ctx->stream.file, literal);
 					value->f = (float) value->i;
+					add_expression_op(ctx, EO_VALUE, literal, value);
 					return UL_TRUE;
 				case TOKEN_FLOAT:
 					value->type = UL_FLOAT;
-					value->f = token_to_float(literal);
+					value->f = token_to_float(ctx->stream.file, literal);
+					add_expression_op(ctx, EO_VALUE, literal, value);
 					return UL_TRUE;
-				case TOKEN_IDENTIFIER:
+				case TOKEN_IDENTIFIER: {
 					// Registers aren't allowed in expressions
-					if (token_matches_register(literal)) {
-						ulang_error_init(ctx->error, ctx->stream.file, &literal->span, "Registers are not allowed in expressions.");
+					if (token_matches_register(ctx->stream.file, literal)) {
+						ulang_span span = token_span(ctx->stream.file, literal);
+						ulang_error_init(ctx->error, ctx->stream.file, &span, "Registers are not allowed in expressions.");
 						return UL_FALSE;
 					}
 
 					// Check if we have a constant by that name
-					for (size_t i = 0; i < ctx->constants.size; i++) {
-						ulang_constant *cnst = &ctx->constants.items[i];
-						if (ulang_string_equals(&literal->span.data, &cnst->name.data)) {
-							value->type = cnst->type;
-							if (value->type == UL_INTEGER) {
-								value->i = cnst->i;
-								value->f = (float) cnst->i;
-							} else {
-								value->i = (int)cnst->f;
-								value->f = cnst->f;
-							}
-							return UL_TRUE;
+					ulang_string name = token_text(ctx->stream.file, literal);
+					int32_t constantIndex = symbol_table_find(ctx->constantTable.slots, ctx->constantTable.numSlots, ctx->constants.items, constant_name, &name);
+					if (ctx->cache) compile_unit_add_import(ctx->unit, &name, constantIndex);
+					// The second pass of a streaming compile knows all constants, it only sees those defined so far
+					if (constantIndex >= 0 && ctx->output && (uint32_t) constantIndex >= ctx->output->visibleConstants) constantIndex = -1;
+					if (constantIndex >= 0) {
+						ulang_constant *cnst = &ctx->constants.items[constantIndex];
+						value->type = cnst->type;
+						if (value->type == UL_INTEGER) {
+							value->i = cnst->i;
+							value->f = (float) cnst->i;
+						} else {
+							value->i = (int)cnst->f;
+							value->f = cnst->f;
 						}
-					}
-					// Otherwise, we assume it's a label. Depending on the resolution setting in the context,
-					// we either postpone resolution, or try to resolve on the spot. The latter happens
-					// in ulang_compile when patches and their expressions are resolved.
-					if (!ctx->resolveLabelsInExpressions) {
-						value->unresolved = UL_TRUE;
-						value->type = UL_INTEGER;
-						value->i = 0;
-						value->f = 0;
-						return UL_TRUE;
-					} else {
-						ulang_label *label = NULL;
-						for (size_t j = 0; j < ctx->labels.size; j++) {
-							if (ulang_string_equals(&ctx->labels.items[j].label.data, &literal->span.data)) {
-								label = &ctx->labels.items[j];
-								break;
-							}
-						}
-						if (!label) {
-							ulang_error_init(ctx->error, ctx->stream.file, &literal->span, "Unknown label.");
-							return UL_FALSE;
-						}
-
-						uint32_t labelAddress = (uint32_t) label->address;
-						switch (label->target) {
-							case UL_LT_UNINITIALIZED:
-								ulang_error_init(ctx->error, ctx->stream.file, &literal->span, "Internal error: Uninitialized label target.");
-								return UL_FALSE;
-							case UL_LT_CODE:
-								break;
-							case UL_LT_DATA:
-								labelAddress += ctx->code.size;
-								break;
-							case UL_LT_RESERVED_DATA:
-								labelAddress += ctx->code.size + ctx->data.size;
-								break;
-						}
-						value->unresolved = UL_FALSE;
-						value->type = UL_INTEGER;
-						value->i = (int)labelAddress; // BOZO we aren't going above 2^31 for label addresses.
-						value->f = (float)labelAddress;
+						add_expression_op(ctx, EO_VALUE, literal, value);
 						return UL_TRUE;
 					}
-				default:
-					ulang_error_init(ctx->error, ctx->stream.file, &literal->span, "Expected an integer, a float, a constant, or a label.");
+					// Otherwise, we assume it's a label. Resolution is postponed until all labels
+					// are known, see evaluate_expression.
+					value->unresolved = UL_TRUE;
+					value->type = UL_INTEGER;
+					value->i = 0;
+					value->f = 0;
+					add_expression_op(ctx, EO_SYMBOL, literal, NULL);
+					return UL_TRUE;
+				}
+				default: {
+					ulang_span span = token_span(ctx->stream.file, literal);
+					ulang_error_init(ctx->error, ctx->stream.file, &span, "Expected an integer, a float, a constant, or a label.");
 					return UL_FALSE;
+				}
 			}
 		}
 	}
@@ -1139,82 +2099,8 @@ static ulang_bool parse_binary_operator(compiler_context *ctx, expression_value
 
 		value->unresolved |= right.unresolved;
 
-		switch (opToken->span.data.data[0]) {
-			case '|':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					ulang_error_init(ctx->error, ctx->stream.file, &opToken->span, "Operator | can not be used with float values.");
-					return UL_FALSE;
-				}
-				value->type = UL_INTEGER;
-				value->i = left.i | right.i;
-				break;
-			case '&':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					ulang_error_init(ctx->error, ctx->stream.file, &opToken->span, "Operator & can not be used with float values.");
-					return UL_FALSE;
-				}
-				value->type = UL_INTEGER;
-				value->i = left.i & right.i;
-				break;
-			case '^':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					ulang_error_init(ctx->error, ctx->stream.file, &opToken->span, "Operator ^ can not be used with float values.");
-					return UL_FALSE;
-				}
-				value->type = UL_INTEGER;
-				value->i = left.i ^ right.i;
-				break;
-			case '+':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					value->type = UL_FLOAT;
-					value->f = left.f + right.f;
-				} else {
-					value->type = UL_INTEGER;
-					value->i = left.i + right.i;
-					value->f = (float) value->i;
-				}
-				break;
-			case '-':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					value->type = UL_FLOAT;
-					value->f = left.f - right.f;
-				} else {
-					value->type = UL_INTEGER;
-					value->i = left.i - right.i;
-					value->f = (float) value->i;
-				}
-				break;
-			case '*':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					value->type = UL_FLOAT;
-					value->f = left.f * right.f;
-				} else {
-					value->type = UL_INTEGER;
-					value->i = left.i * right.i;
-					value->f = (float) value->i;
-				}
-				break;
-			case '/':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					value->type = UL_FLOAT;
-					value->f = left.f / right.f;
-				} else {
-					value->type = UL_INTEGER;
-					value->i = left.i / right.i;
-					value->f = (float) value->i;
-				}
-				break;
-			case '%':
-				if (left.type == UL_FLOAT || right.type == UL_FLOAT) {
-					ulang_error_init(ctx->error, ctx->stream.file, &opToken->span, "Operator % can not be used with float values.");
-					return UL_FALSE;
-				} else {
-					value->type = UL_INTEGER;
-					value->i = left.i % right.i;
-					value->f = (float) value->i;
-				}
-				break;
-		}
+		if (!apply_binary_operator(ctx, ctx->stream.file, opToken, &left, &right, value)) return UL_FALSE;
+		add_expression_op(ctx, EO_BINARY, opToken, NULL);
 
 		left = *value;
 	}
@@ -1224,33 +2110,116 @@ static ulang_bool parse_binary_operator(compiler_context *ctx, expression_value
 	return UL_TRUE;
 }
 
-static ulang_bool parse_expression(compiler_context *ctx, expression_value *value, ulang_span *span) {
-	value->startToken = ctx->stream.index;
+// Parses and evaluates an expression in the first pass. Expressions referencing labels
+// are marked unresolved and keep their ops in the current unit for evaluate_expression.
+static ulang_bool parse_expression(compiler_context *ctx, expression_value *value, token *source) {
 	value->unresolved = UL_FALSE;
-	ulang_span *startSpan = &ctx->stream.tokens->items[ctx->stream.index].span;
+	uint32_t firstOp = ctx->unit ? (uint32_t) ctx->unit->ops.size : 0;
+	token *startToken = &ctx->stream.tokens->items[ctx->stream.index];
 	ulang_bool result = parse_binary_operator(ctx, value, 0);
-	if (span) {
-		ulang_span *endSpan = &ctx->stream.tokens->items[ctx->stream.index - 1].span;
-		span->data = startSpan->data;
-		span->data.length = endSpan->data.data == startSpan->data.data ? startSpan->data.length : endSpan->data.data - startSpan->data.data;
-		span->startLine = startSpan->startLine;
-		span->endLine = endSpan->endLine;
+	if (ctx->unit) {
+		if (!value->unresolved) ctx->unit->ops.size = firstOp;
+		value->firstOp = firstOp;
+		value->numOps = (uint32_t) ctx->unit->ops.size - firstOp;
+	}
+	if (source) {
+		token *endToken = &ctx->stream.tokens->items[ctx->stream.index - 1];
+		source->offset = startToken->offset;
+		source->length = endToken->offset == startToken->offset ? startToken->length : endToken->offset - startToken->offset;
+		source->type = value->type == UL_FLOAT ? TOKEN_FLOAT : TOKEN_INTEGER;
 	}
 	return result;
 }
 
+static ulang_bool resolve_symbol(compiler_context *ctx, ulang_file *file, token *symbol, expression_value *value) {
+	ulang_string name = token_text(file, symbol);
+	int32_t constantIndex = symbol_table_find(ctx->constantTable.slots, ctx->constantTable.numSlots, ctx->constants.items, constant_name, &name);
+	if (constantIndex >= 0) {
+		ulang_constant *cnst = &ctx->constants.items[constantIndex];
+		value->type = cnst->type;
+		if (value->type == UL_INTEGER) {
+			value->i = cnst->i;
+			value->f = (float) cnst->i;
+		} else {
+			value->i = (int)cnst->f;
+			value->f = cnst->f;
+		}
+		return UL_TRUE;
+	}
+
+	int32_t labelIndex = symbol_table_find(ctx->labelTable.slots, ctx->labelTable.numSlots, ctx->labels.items, label_name, &name);
+	if (labelIndex < 0) {
+		ulang_span span = token_span(file, symbol);
+		ulang_error_init(ctx->error, file, &span, "Unknown label.");
+		return UL_FALSE;
+	}
+	ulang_label *label = &ctx->labels.items[labelIndex];
+
+	uint32_t labelAddress = (uint32_t) label->address;
+	switch (label->target) {
+		case UL_LT_UNINITIALIZED: {
+			ulang_span span = token_span(file, symbol);
+			ulang_error_init(ctx->error, file, &span, "Internal error: Uninitialized label target.");
+			return UL_FALSE;
+		}
+		case UL_LT_CODE:
+			break;
+		case UL_LT_DATA:
+			labelAddress += ctx->code.size;
+			break;
+		case UL_LT_RESERVED_DATA:
+			labelAddress += ctx->code.size + ctx->data.size;
+			break;
+	}
+	value->type = UL_INTEGER;
+	value->i = (int)labelAddress; // BOZO we aren't going above 2^31 for label addresses.
+	value->f = (float)labelAddress;
+	return UL_TRUE;
+}
+
+// Evaluates the ops of an expression left unresolved by the first pass, once all
+// labels and constants are known.
+static ulang_bool evaluate_expression(compiler_context *ctx, ulang_file *file, expression_op *ops, expression_value *expr, expression_value *value) {
+	value_array *stack = &ctx->stack;
+	stack->size = 0;
+	for (uint32_t i = expr->firstOp; i < expr->firstOp + expr->numOps; i++) {
+		expression_op *op = &ops[i];
+		expression_value result = {0};
+		switch (op->type) {
+			case EO_VALUE:
+				result.type = op->valueType;
+				result.i = op->i;
+				result.f = op->f;
+				break;
+			case EO_SYMBOL:
+				if (!resolve_symbol(ctx, file, &op->source, &result)) return UL_FALSE;
+				break;
+			case EO_UNARY:
+				if (!apply_unary_operator(ctx, file, &op->source, &stack->items[--stack->size], &result)) return UL_FALSE;
+				break;
+			case EO_BINARY:
+				stack->size -= 2;
+				if (!apply_binary_operator(ctx, file, &op->source, &stack->items[stack->size], &stack->items[stack->size + 1], &result)) return UL_FALSE;
+				break;
+		}
+		value_array_add(stack, result);
+	}
+	*value = stack->items[0];
+	return UL_TRUE;
+}
+
 static void parse_repeat(compiler_context *ctx, int *numRepeat) {
 	if (!token_stream_match_string(&ctx->stream, STR("x"), UL_TRUE)) return;
-	ulang_span span;
+	token source;
 	expression_value value;
-	if (!parse_expression(ctx, &value, &span)) return;
+	if (!parse_expression(ctx, &value, &source)) return;
 	if (value.type != UL_INTEGER) {
-		ulang_error_init(ctx->error, ctx->stream.file, &span, "Expected an integer value after 'x'.");
+		token_error(ctx->error, ctx->stream.file, &source, "Expected an integer value after 'x'.");
 		return;
 	}
 	*numRepeat = value.i;
 	if (*numRepeat < 0) {
-		ulang_error_init(ctx->error, ctx->stream.file, &span, "Number of repetitions can not be negative.");
+		token_error(ctx->error, ctx->stream.file, &source, "Number of repetitions can not be negative.");
 		return;
 	}
 }
@@ -1291,12 +2260,14 @@ static void emit_float(byte_array *code, expression_value *value, int repeat) {
 	}
 }
 
-static void emit_string(byte_array *code, token *value, int repeat) {
-	ulang_string str = value->span.data;
+static void emit_string(byte_array *code, ulang_file *file, token *value, int repeat) {
+	ulang_string str = token_text(file, value);
 	str.data++;
 	str.length -= 2;
 
-	char *cString = ulang_alloc(str.length);
+	// Unescape into the array directly, then replicate for each repeat.
+	byte_array_ensure(code, str.length);
+	char *cString = (char *) &code->items[code->size];
 	size_t i, j;
 	for (i = 0, j = 0; i < str.length; i++, j++) {
 		char c = str.data[i];
@@ -1323,22 +2294,68 @@ static void emit_string(byte_array *code, token *value, int repeat) {
 		}
 	}
 
-	byte_array_ensure(code, j * repeat);
-	for (i = 0; i < (size_t) repeat; i++) {
-		memcpy(&code->items[code->size], cString, j);
+	if (repeat == 0) return;
+	code->size += j;
+	byte_array_ensure(code, j * (repeat - 1));
+	for (i = 1; i < (size_t) repeat; i++) {
+		memcpy(&code->items[code->size], &code->items[code->size - j], j);
 		code->size += j;
 	}
-	ulang_free(cString);
 }
 
 #define ENCODE_OP(word, op) word |= op
 #define ENCODE_REG(word, reg, index) word |= (((reg) & 0xf) << (7 + 4 * (index)))
-#define ENCODE_OFF(word, offset) word |= (((offset) & 0x1fff) << 19)
+#define ENCODE_OFF(word, offset) word |= (((uint32_t) (offset) & 0x1fff) << 19)
+#define DECODE_OP(word) ((word) & 0x7f)
+#define DECODE_REG(word, index) (((word) >> (7 + 4 * (index))) & 0xf)
+#define DECODE_OFF(word) (((word) >> 19) & 0x1fff)
+#define DECODE_IMM(word) (((int32_t) (word)) >> 19)
+#define IMM_MIN -4096
+#define IMM_MAX 4095
+#define DECODE_BRANCH_IMM(word) (((int32_t) ((word) << 9)) >> 24)
+#define DECODE_BRANCH_OFFSET(word) (((int32_t) (word)) >> 23)
+#define ENCODE_MASK(word, mask) word |= (((uint32_t) (mask) & 0x3fff) << 11)
+#define DECODE_MASK(word) (((word) >> 11) & 0x3fff)
+#define INDEX_OFF_MIN -512
+#define INDEX_OFF_MAX 511
+
+// What follows a register in the address of a load or store: a scale, an offset, or
+// a + incrementing the base register after the access.
+typedef struct address_suffix {
+	ulang_bool scaled;
+	ulang_bool hasOffset;
+	ulang_bool increment;
+	uint32_t shift;
+	int32_t offset;
+} address_suffix;
+
+static ulang_opcode indexed_opcode(ulang_opcode code) {
+	switch (code) {
+		case LOAD_REG: return LOAD_INDEXED;
+		case LOAD_BYTE_REG: return LOAD_BYTE_INDEXED;
+		case LOAD_SHORT_REG: return LOAD_SHORT_INDEXED;
+		case STORE_REG: return STORE_INDEXED;
+		case STORE_BYTE_REG: return STORE_BYTE_INDEXED;
+		case STORE_SHORT_REG: return STORE_SHORT_INDEXED;
+		default: return HALT;
+	}
+}
+
+// The overload tried after op for an instruction starting with first. Indexed loads and
+// stores come after the other forms of their mnemonic.
+static opcode *next_overload(opcode *first, opcode *op) {
+	if (op->index + 1 < opcodeLength && ulang_string_equals(&op->name, &opcodes[op->index + 1].name)) return &opcodes[op->index + 1];
+	ulang_opcode indexed = indexed_opcode(first->code);
+	return indexed != HALT && op->code != indexed ? &opcodes[indexed] : NULL;
+}
 
 static ulang_bool
-emit_op(ulang_file *file, opcode *op, token operands[3], expression_value operandValues[3], patch_array *patches, byte_array *code, ulang_error *error) {
+emit_op(ulang_file *file, opcode *op, token operands[3], reg *operandRegisters[3], expression_value operandValues[3], address_suffix suffixes[3], patch_array *patches,
+		byte_array *code, ulang_error *error) {
 	uint32_t word1 = 0;
 	uint32_t word2 = 0;
+	uint32_t addressMode = 0;
+	ulang_bool indexed = UL_FALSE;
 
 	ENCODE_OP(word1, op->code);
 
@@ -1349,20 +2366,64 @@ emit_op(ulang_file *file, opcode *op, token operands[3], expression_value operan
 		operand_type operandType = op->operands[i];
 		switch (operandType) {
 			case UL_REG:
-				ENCODE_REG(word1, token_matches_register(operandToken)->index, numEmittedRegs);
+				ENCODE_REG(word1, operandRegisters[i]->index, numEmittedRegs);
 				numEmittedRegs++;
 				break;
+			case UL_VREG:
+				ENCODE_REG(word1, operandRegisters[i]->index - FIRST_VECTOR_REGISTER, numEmittedRegs);
+				numEmittedRegs++;
+				break;
+			case UL_BASE:
+				ENCODE_REG(word1, operandRegisters[i]->index, numEmittedRegs);
+				numEmittedRegs++;
+				if (suffixes[i].increment) addressMode |= 4;
+				break;
+			case UL_INDEX: {
+				// Without an index register its slot stays 0
+				int32_t offset = operandValue->i;
+				if (operandRegisters[i]) {
+					ENCODE_REG(word1, operandRegisters[i]->index, numEmittedRegs);
+					addressMode |= suffixes[i].shift;
+					offset = suffixes[i].offset;
+				} else {
+					addressMode |= 3;
+				}
+				numEmittedRegs++;
+				if (offset < INDEX_OFF_MIN || offset > INDEX_OFF_MAX) {
+					token_error(error, file, operandToken, "Offsets of indexed addresses must be between -512 and 511.");
+					return UL_FALSE;
+				}
+				addressMode |= (uint32_t) offset << 3;
+				indexed = UL_TRUE;
+				break;
+			}
 			case UL_OFF:
 				if (operandValue->unresolved) {
 					patch p;
 					p.type = PT_OFFSET;
 					p.expr = *operandValue;
+					p.source = *operandToken;
 					p.patchAddress = code->size;
 					patch_array_add(patches, p);
 					break;
 				}
 				ENCODE_OFF(word1, operandValue->i);
 				break;
+			case UL_MASK:
+				ENCODE_MASK(word1, operandValue->i);
+				break;
+			case UL_IMM: {
+				// Compared by a branch, float conditions convert it when run
+				ulang_bool isFloat = operandToken->type == TOKEN_FLOAT;
+				float value = isFloat ? operandValue->f : (float) operandValue->i;
+				if (operandValue->unresolved || (isFloat && op->function < BC_EQUAL_FLOAT) || !(value >= IMM_MIN && value <= IMM_MAX) || value != (float) (int32_t) value) {
+					token_error(error, file, operandToken, op->function < BC_EQUAL_FLOAT ? "Expected an int between -4096 and 4095, compare to a register otherwise." :
+															"Expected a whole number between -4096 and 4095, compare to a register otherwise.");
+					return UL_FALSE;
+				}
+				ENCODE_OFF(word1, (int32_t) value);
+				break;
+			}
 			case UL_INT:
 			case UL_FLT:
 			case UL_LBL_INT:
@@ -1371,6 +2432,7 @@ emit_op(ulang_file *file, opcode *op, token operands[3], expression_value operan
 					patch p;
 					p.type = PT_VALUE;
 					p.expr = *operandValue;
+					p.source = *operandToken;
 					p.patchAddress = code->size + 4;
 					patch_array_add(patches, p);
 					word2 = 0xdeadbeef;
@@ -1389,23 +2451,41 @@ emit_op(ulang_file *file, opcode *op, token operands[3], expression_value operan
 						break;
 					}
 					default:
-						ulang_error_init(error, file, &operandToken->span,
-										 "Internal error, unexpected token type for value operand.");
+						token_error(error, file, operandToken, "Internal error, unexpected token type for value operand.");
 						return UL_FALSE;
 				}
 				break;
 			}
 			default:
-				ulang_error_init(error, file, &operandToken->span,
-								 "Internal error, unknown operand type.");
+				token_error(error, file, operandToken, "Internal error, unknown operand type.");
 				return UL_FALSE;
 		}
 	}
 
-	byte_array_ensure(code, 4 + (op->hasValueOperand ? 4 : 0));
+	if (indexed) ENCODE_OFF(word1, addressMode);
+	if (op->code == BRANCH || op->code == BRANCH_IMM || op->code == FRAME || op->code == PUSH_MASK) ENCODE_REG(word1, op->function, numEmittedRegs);
+	else if (op->function) ENCODE_OFF(word1, op->function);
+
+	// Integers known at this point that fit the offset field don't need a value word,
+	// the registers stay where they are.
+	ulang_bool hasValueWord = op->hasValueOperand;
+	int valueIndex = op->code == MOVE_VAL || op->code == PUSH_VAL ? 0 : 1;
+	ulang_opcode shortOp = op->code == ADD_VAL || op->code == SUB_VAL ? ADD_IMM : op->code == CMP_REG_VAL ? CMP_IMM : op->code == MOVE_VAL ? MOVE_IMM :
+						   op->code == PUSH_VAL ? PUSH_IMM : HALT;
+	if (shortOp != HALT && !operandValues[valueIndex].unresolved && operands[valueIndex].type == TOKEN_INTEGER) {
+		int64_t value = op->code == SUB_VAL ? -(int64_t) operandValues[valueIndex].i : operandValues[valueIndex].i;
+		if (value >= IMM_MIN && value <= IMM_MAX) {
+			word1 &= ~(uint32_t) 0x7f;
+			ENCODE_OP(word1, shortOp);
+			ENCODE_OFF(word1, (int32_t) value);
+			hasValueWord = UL_FALSE;
+		}
+	}
+
+	byte_array_ensure(code, 4 + (hasValueWord ? 4 : 0));
 	memcpy(&code->items[code->size], &word1, 4);
 	code->size += 4;
-	if (op->hasValueOperand) {
+	if (hasValueWord) {
 		memcpy(&code->items[code->size], &word2, 4);
 		code->size += 4;
 	}
@@ -1413,36 +2493,648 @@ emit_op(ulang_file *file, opcode *op, token operands[3], expression_value operan
 	return UL_TRUE;
 }
 
-static void set_label_targets(label_array *labels, ulang_label_target target, size_t address) {
-	for (int i = (int) labels->size - 1; i >= 0; i--) {
+static ulang_bool apply_patch(compiler_context *ctx, ulang_file *file, expression_op *ops, patch *p, uint8_t *code) {
+	expression_value expr;
+	if (!evaluate_expression(ctx, file, ops, &p->expr, &expr)) return UL_FALSE;
+
+	if (p->type == PT_VALUE) {
+		if (p->expr.type == UL_INTEGER) memcpy(&code[p->patchAddress], &expr.i, 4);
+		else memcpy(&code[p->patchAddress], &expr.f, 4);
+	} else {
+		if (expr.type != UL_INTEGER) {
+			token_error(ctx->error, file, &p->source, "Offsets must be integers.");
+			return UL_FALSE;
+		}
+
+		uint32_t op;
+		memcpy(&op, &code[p->patchAddress], 4);
+		ENCODE_OFF(op, expr.i);
+		memcpy(&code[p->patchAddress], &op, 4);
+	}
+	return UL_TRUE;
+}
+
+static size_t label_section_base(ulang_label_target target, size_t code, size_t data, size_t reserved) {
+	return target == UL_LT_CODE ? code : target == UL_LT_DATA ? data : reserved;
+}
+
+static void set_label_targets(label_array *labels, size_t first, ulang_label_target target, size_t address) {
+	for (int i = (int) labels->size - 1; i >= (int) first; i--) {
 		if (labels->items[i].target != UL_LT_UNINITIALIZED) break;
 		labels->items[i].target = target;
 		labels->items[i].address = address;
 	}
 }
 
-EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_file *file, ulang_file_read_function fileReadFunction, ulang_error *error) {
+// Labels defined before the last include are left to the linker, the included unit
+// might emit something before this unit does.
+static void set_unit_label_targets(compile_unit *unit, ulang_label_target target, size_t address) {
+	unit_piece *piece = &unit->pieces.items[unit->pieces.size - 1];
+	if (piece->firstEmission == UL_LT_UNINITIALIZED) piece->firstEmission = target;
+	set_label_targets(&unit->labels, piece->labels, target, address + label_section_base(target, unit->codeBase, unit->dataBase, 0));
+}
+
+static void compile_unit_add_piece(compile_unit *unit) {
+	unit_piece piece = {unit->code.size, unit->data.size, unit->numReservedBytes, unit->labels.size, unit->constants.size, UL_LT_UNINITIALIZED, NULL};
+	piece_array_add(&unit->pieces, piece);
+}
+
+static compile_unit *compile_unit_new(compiler_context *ctx, ulang_file *file) {
+	compile_unit *unit = arena_alloc(&ctx->arena, sizeof(compile_unit));
+	memset(unit, 0, sizeof(compile_unit));
+	unit->file = file;
+	// The unit's file is the last one added to the compile
+	unit->fileIndex = (uint32_t) ctx->files.size - 1;
+	byte_array_init_arena(&unit->code, &ctx->arena, 16);
+	byte_array_init_arena(&unit->data, &ctx->arena, 16);
+	label_array_init_arena(&unit->labels, &ctx->arena, 16);
+	unit->labelTable.arena = &ctx->arena;
+	patch_array_init_arena(&unit->patches, &ctx->arena, 16);
+	expression_op_array_init_arena(&unit->ops, &ctx->arena, 16);
+	int_array_init_arena(&unit->addressToLine, &ctx->arena, 16);
+	piece_array_init_arena(&unit->pieces, &ctx->arena, 4);
+	int_array_init_arena(&unit->constants, &ctx->arena, 4);
+	import_array_init_arena(&unit->imports, &ctx->arena, 4);
+	unit->importTable.arena = &ctx->arena;
+	int_array_init_arena(&unit->externalIncludes, &ctx->arena, 4);
+	unit->constantsStart = (uint32_t) ctx->constants.size;
+	unit->filesStart = (uint32_t) ctx->files.size;
+	compile_unit_add_piece(unit);
+	return unit;
+}
+
+// Takes over the dependencies of an included unit that lie outside of the unit.
+static void compile_unit_merge(compile_unit *unit, compile_unit *included) {
+	for (size_t i = 0; i < included->imports.size; i++)
+		compile_unit_add_import(unit, &included->imports.items[i].name, included->imports.items[i].index);
+	for (size_t i = 0; i < included->externalIncludes.size; i++) {
+		if (included->externalIncludes.items[i] < unit->filesStart) int_array_add(&unit->externalIncludes, included->externalIncludes.items[i]);
+	}
+}
+
+static void *copy_out(ulang_allocator *allocator, void *items, size_t numBytes) {
+	if (numBytes == 0) return NULL;
+	void *result = ulang_allocator_alloc(allocator, numBytes);
+	memcpy(result, items, numBytes);
+	return result;
+}
+
+static int32_t cache_find_file(ulang_compile_cache *cache, const char *fileName) {
+	for (size_t i = 0; i < cache->numFiles; i++)
+		if (!strcmp(cache->files[i].fileName, fileName)) return (int32_t) i;
+	return -1;
+}
+
+static ulang_bool cached_file_matches(cached_file *entry, ulang_file *file) {
+	return entry->length == file->length && entry->hash == hash_string(file->data, file->length) && !memcmp(entry->data, file->data, file->length);
+}
+
+static void unit_object_free(ulang_compile_cache *cache, unit_object *object) {
+	if (!object) return;
+	ulang_allocator *allocator = cache->allocator;
+	ulang_allocator_free(allocator, object->code);
+	ulang_allocator_free(allocator, object->data);
+	ulang_allocator_free(allocator, object->addressToLine);
+	ulang_allocator_free(allocator, object->labels);
+	ulang_allocator_free(allocator, object->patches);
+	ulang_allocator_free(allocator, object->ops);
+	ulang_allocator_free(allocator, object->constants);
+	ulang_allocator_free(allocator, object->pieces);
+	ulang_allocator_free(allocator, object->pieceIncludes);
+	for (size_t i = 0; i < object->numImports; i++)
+		ulang_allocator_free(allocator, object->imports[i].name.data.data);
+	ulang_allocator_free(allocator, object->imports);
+	ulang_allocator_free(allocator, object->importsFound);
+	for (size_t i = 0; i < object->numExternalIncludes; i++)
+		ulang_allocator_free(allocator, object->externalIncludes[i]);
+	ulang_allocator_free(allocator, object->externalIncludes);
+	for (size_t i = 0; i < object->numIncludes; i++)
+		ulang_allocator_free(allocator, object->includes[i]);
+	ulang_allocator_free(allocator, object->includes);
+	ulang_allocator_free(allocator, object->includeVersions);
+	ulang_allocator_free(allocator, object);
+}
+
+static void cached_file_free(ulang_compile_cache *cache, cached_file *entry) {
+	ulang_allocator_free(cache->allocator, entry->fileName);
+	ulang_allocator_free(cache->allocator, entry->data);
+	ulang_allocator_free(cache->allocator, entry->tokens);
+	unit_object_free(cache, entry->object);
+}
+
+static ulang_bool cache_tokenize(ulang_compile_cache *cache, ulang_file *file, token_array *tokens, ulang_error *error) {
+	int32_t index = cache_find_file(cache, file->fileName.data);
+	cached_file *entry = index < 0 ? NULL : &cache->files[index];
+	if (entry && cached_file_matches(entry, file)) {
+		token_array_ensure(tokens, entry->numTokens);
+		memcpy(tokens->items + tokens->size, entry->tokens, sizeof(token) * entry->numTokens);
+		tokens->size += entry->numTokens;
+		entry->generation = cache->generation;
+		cache->stats.tokenHits++;
+		return UL_TRUE;
+	}
+
+	size_t start = tokens->size;
+	if (!tokenize(file, tokens, error)) return UL_FALSE;
+	cache->stats.tokenMisses++;
+
+	if (!entry) {
+		cache->files = ulang_allocator_realloc(cache->allocator, cache->files, sizeof(cached_file) * (cache->numFiles + 1));
+		entry = &cache->files[cache->numFiles++];
+		memset(entry, 0, sizeof(cached_file));
+		entry->fileName = ulang_allocator_alloc(cache->allocator, file->fileName.length + 1);
+		memcpy(entry->fileName, file->fileName.data, file->fileName.length + 1);
+	}
+	ulang_allocator_free(cache->allocator, entry->data);
+	ulang_allocator_free(cache->allocator, entry->tokens);
+	unit_object_free(cache, entry->object);
+	entry->object = NULL;
+	entry->hash = hash_string(file->data, file->length);
+	entry->length = file->length;
+	entry->data = ulang_allocator_alloc(cache->allocator, MAX(file->length, 1));
+	memcpy(entry->data, file->data, file->length);
+	entry->numTokens = tokens->size - start;
+	entry->tokens = ulang_allocator_alloc(cache->allocator, sizeof(token) * MAX(entry->numTokens, 1));
+	memcpy(entry->tokens, tokens->items + start, sizeof(token) * entry->numTokens);
+	entry->generation = cache->generation;
+	return UL_TRUE;
+}
+
+static uint64_t profile_now(compiler_context *ctx) {
+	return ctx->profile ? ctx->profile->now() : 0;
+}
+
+static int32_t context_find_file(compiler_context *ctx, const char *fileName) {
+	for (int32_t i = 0; i < (int32_t) ctx->files.size; i++) {
+		if (strcmp(ctx->files.items[i]->fileName.data, fileName) == 0) return i;
+	}
+	return -1;
+}
+
+static char *copy_string(ulang_allocator *allocator, const char *data, size_t length) {
+	char *result = ulang_allocator_alloc(allocator, length + 1);
+	memcpy(result, data, length);
+	result[length] = 0;
+	return result;
+}
+
+static ulang_bool unit_object_imports_match(compiler_context *ctx, unit_object *object) {
+	for (size_t i = 0; i < object->numImports; i++) {
+		ulang_constant *import = &object->imports[i];
+		int32_t index = symbol_table_find(ctx->constantTable.slots, ctx->constantTable.numSlots, ctx->constants.items, constant_name, &import->name.data);
+		if ((index >= 0) != (object->importsFound[i] != 0)) return UL_FALSE;
+		if (index < 0) continue;
+		ulang_constant *constant = &ctx->constants.items[index];
+		if (constant->type != import->type || constant->i != import->i) return UL_FALSE;
+	}
+	for (size_t i = 0; i < object->numExternalIncludes; i++) {
+		if (context_find_file(ctx, object->externalIncludes[i]) < 0) return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+// Rebuilds a unit and the units it included from their cached objects, adding
+// their files and constants to the compile as assembling them would.
+static compile_unit *cache_replay_unit(compiler_context *ctx, ulang_file *file, ulang_file **includedFiles, size_t *nextFile) {
+	ulang_compile_cache *cache = ctx->cache;
+	cached_file *entry = &cache->files[cache_find_file(cache, file->fileName.data)];
+	unit_object *object = entry->object;
+	compile_unit *unit = compile_unit_new(ctx, file);
+	unit->reused = UL_TRUE;
+	entry->generation = cache->generation;
+	cache->stats.unitHits++;
+
+	byte_array_ensure(&unit->code, object->codeLength);
+	if (object->codeLength) memcpy(unit->code.items, object->code, object->codeLength);
+	unit->code.size = object->codeLength;
+	byte_array_ensure(&unit->data, object->dataLength);
+	if (object->dataLength) memcpy(unit->data.items, object->data, object->dataLength);
+	unit->data.size = object->dataLength;
+	unit->numReservedBytes = object->numReservedBytes;
+	int_array_ensure(&unit->addressToLine, object->codeLength >> 2);
+	if (object->codeLength) memcpy(unit->addressToLine.items, object->addressToLine, object->codeLength);
+	unit->addressToLine.size = object->codeLength >> 2;
+	for (size_t i = 0; i < object->numLabels; i++) {
+		ulang_label label = object->labels[i];
+		label.label.data.data = file->data + (label.label.data.data - entry->data);
+		label_array_add(&unit->labels, label);
+	}
+	for (size_t i = 0; i < object->numPatches; i++)
+		patch_array_add(&unit->patches, object->patches[i]);
+	expression_op_array_ensure(&unit->ops, object->numOps);
+	if (object->numOps) memcpy(unit->ops.items, object->ops, sizeof(expression_op) * object->numOps);
+	unit->ops.size = object->numOps;
+	for (size_t i = 0; i < object->numImports; i++) {
+		ulang_string *name = &object->imports[i].name.data;
+		compile_unit_add_import(unit, name, symbol_table_find(ctx->constantTable.slots, ctx->constantTable.numSlots, ctx->constants.items, constant_name, name));
+	}
+	for (size_t i = 0; i < object->numExternalIncludes; i++)
+		int_array_add(&unit->externalIncludes, (uint32_t) context_find_file(ctx, object->externalIncludes[i]));
+
+	unit->pieces.size = 0;
+	for (size_t i = 0; i < object->numPieces; i++) {
+		unit_piece piece = object->pieces[i];
+		size_t constantsEnd = i + 1 < object->numPieces ? object->pieces[i + 1].constants : object->numConstants;
+		piece.constants = unit->constants.size;
+		for (size_t j = object->pieces[i].constants; j < constantsEnd; j++) {
+			ulang_constant constant = object->constants[j];
+			constant.name.data.data = file->data + (constant.name.data.data - entry->data);
+			constant_array_add(&ctx->constants, constant);
+			int_array_add(&unit->constants, (uint32_t) ctx->constants.size - 1);
+			if (symbol_table_find(ctx->constantTable.slots, ctx->constantTable.numSlots, ctx->constants.items, constant_name, &constant.name.data) < 0)
+				symbol_table_insert(&ctx->constantTable, ctx->constants.items, constant_name, (uint32_t) ctx->constants.size - 1);
+		}
+		piece_array_add(&unit->pieces, piece);
+		if (object->pieceIncludes[i]) {
+			ulang_file *includedFile = includedFiles[(*nextFile)++];
+			file_array_add(&ctx->files, includedFile);
+			compile_unit *includedUnit = cache_replay_unit(ctx, includedFile, includedFiles, nextFile);
+			unit->pieces.items[i].include = includedUnit;
+		}
+	}
+	return unit;
+}
+
+// Returns the unit of the file replayed from the cache, or NULL if it has to be assembled.
+static compile_unit *cache_reuse_unit(compiler_context *ctx, ulang_file *file, ulang_file_read_function fileReadFunction) {
+	ulang_compile_cache *cache = ctx->cache;
+	ulang_allocator *allocator = ctx->arena.allocator;
+	int32_t index = cache_find_file(cache, file->fileName.data);
+	unit_object *object = index < 0 ? NULL : cache->files[index].object;
+	if (!object || !cached_file_matches(&cache->files[index], file) || !unit_object_imports_match(ctx, object)) {
+		cache->stats.unitMisses++;
+		return NULL;
+	}
+
+	ulang_file **includedFiles = arena_alloc(&ctx->arena, sizeof(ulang_file *) * MAX(object->numIncludes, 1));
+	size_t numIncludedFiles = 0;
+	ulang_bool matches = UL_TRUE;
+	for (size_t i = 0; i < object->numIncludes && matches; i++) {
+		int32_t includeIndex = cache_find_file(cache, object->includes[i]);
+		cached_file *entry = includeIndex < 0 ? NULL : &cache->files[includeIndex];
+		if (!entry || !entry->object || entry->object->version != object->includeVersions[i] || context_find_file(ctx, object->includes[i]) >= 0) {
+			matches = UL_FALSE;
+			break;
+		}
+		ulang_file *includedFile = allocator_calloc(allocator, sizeof(ulang_file));
+		includedFiles[numIncludedFiles++] = includedFile;
+		matches = fileReadFunction(object->includes[i], includedFile) && cached_file_matches(entry, includedFile);
+	}
+	if (!matches) {
+		for (size_t i = 0; i < numIncludedFiles; i++) {
+			if (includedFiles[i]->data) ulang_file_free(includedFiles[i]);
+			ulang_allocator_free(allocator, includedFiles[i]);
+		}
+		cache->stats.unitMisses++;
+		return NULL;
+	}
+
+	size_t nextFile = 0;
+	return cache_replay_unit(ctx, file, includedFiles, &nextFile);
+}
+
+// Keeps the objects of the units assembled by a successful compile, included units
+// first so the including unit can record their versions.
+static void cache_store_unit(compiler_context *ctx, compile_unit *unit) {
+	ulang_compile_cache *cache = ctx->cache;
+	ulang_allocator *allocator = cache->allocator;
+	size_t numIncludes = 0;
+	for (size_t i = 0; i < unit->pieces.size; i++) {
+		compile_unit *included = unit->pieces.items[i].include;
+		if (!included) continue;
+		cache_store_unit(ctx, included);
+		numIncludes += 1 + cache->files[cache_find_file(cache, included->file->fileName.data)].object->numIncludes;
+	}
+	if (unit->reused) return;
+
+	cached_file *entry = &cache->files[cache_find_file(cache, unit->file->fileName.data)];
+	char *fileData = unit->file->data;
+	unit_object *object = allocator_calloc(allocator, sizeof(unit_object));
+	object->version = ++cache->objectVersion;
+	object->code = copy_out(allocator, unit->code.items, unit->code.size);
+	object->codeLength = unit->code.size;
+	object->data = copy_out(allocator, unit->data.items, unit->data.size);
+	object->dataLength = unit->data.size;
+	object->numReservedBytes = unit->numReservedBytes;
+	object->addressToLine = copy_out(allocator, unit->addressToLine.items, sizeof(uint32_t) * unit->addressToLine.size);
+	object->labels = copy_out(allocator, unit->labels.items, sizeof(ulang_label) * unit->labels.size);
+	object->numLabels = unit->labels.size;
+	for (size_t i = 0; i < object->numLabels; i++)
+		object->labels[i].label.data.data = entry->data + (object->labels[i].label.data.data - fileData);
+	object->patches = copy_out(allocator, unit->patches.items, sizeof(patch) * unit->patches.size);
+	object->numPatches = unit->patches.size;
+	for (size_t i = 0; i < object->numPatches; i++)
+		object->patches[i].file = NULL;
+	object->ops = copy_out(allocator, unit->ops.items, sizeof(expression_op) * unit->ops.size);
+	object->numOps = unit->ops.size;
+	object->numConstants = unit->constants.size;
+	object->constants = object->numConstants ? ulang_allocator_alloc(allocator, sizeof(ulang_constant) * object->numConstants) : NULL;
+	for (size_t i = 0; i < object->numConstants; i++) {
+		object->constants[i] = ctx->constants.items[unit->constants.items[i]];
+		object->constants[i].name.data.data = entry->data + (object->constants[i].name.data.data - fileData);
+	}
+	object->numPieces = unit->pieces.size;
+	object->pieces = copy_out(allocator, unit->pieces.items, sizeof(unit_piece) * unit->pieces.size);
+	object->pieceIncludes = ulang_allocator_alloc(allocator, object->numPieces);
+	for (size_t i = 0; i < object->numPieces; i++) {
+		object->pieceIncludes[i] = object->pieces[i].include != NULL;
+		object->pieces[i].include = NULL;
+	}
+	object->numImports = unit->imports.size;
+	object->imports = allocator_calloc(allocator, sizeof(ulang_constant) * MAX(object->numImports, 1));
+	object->importsFound = allocator_calloc(allocator, MAX(object->numImports, 1));
+	for (size_t i = 0; i < object->numImports; i++) {
+		unit_import *import = &unit->imports.items[i];
+		if (import->index >= 0) object->imports[i] = ctx->constants.items[import->index];
+		object->imports[i].name.data.data = copy_string(allocator, import->name.data, import->name.length);
+		object->imports[i].name.data.length = import->name.length;
+		object->importsFound[i] = import->index >= 0;
+	}
+	object->numExternalIncludes = unit->externalIncludes.size;
+	object->externalIncludes = ulang_allocator_alloc(allocator, sizeof(char *) * MAX(object->numExternalIncludes, 1));
+	for (size_t i = 0; i < object->numExternalIncludes; i++) {
+		ulang_string *fileName = &ctx->files.items[unit->externalIncludes.items[i]]->fileName;
+		object->externalIncludes[i] = copy_string(allocator, fileName->data, fileName->length);
+	}
+	object->numIncludes = numIncludes;
+	object->includes = ulang_allocator_alloc(allocator, sizeof(char *) * MAX(numIncludes, 1));
+	object->includeVersions = ulang_allocator_alloc(allocator, sizeof(uint32_t) * MAX(numIncludes, 1));
+	numIncludes = 0;
+	for (size_t i = 0; i < unit->pieces.size; i++) {
+		compile_unit *included = unit->pieces.items[i].include;
+		if (!included) continue;
+		unit_object *includedObject = cache->files[cache_find_file(cache, included->file->fileName.data)].object;
+		object->includes[numIncludes] = copy_string(allocator, included->file->fileName.data, included->file->fileName.length);
+		object->includeVersions[numIncludes++] = includedObject->version;
+		for (size_t j = 0; j < includedObject->numIncludes; j++) {
+			object->includes[numIncludes] = copy_string(allocator, includedObject->includes[j], strlen(includedObject->includes[j]));
+			object->includeVersions[numIncludes++] = includedObject->includeVersions[j];
+		}
+	}
+	unit_object_free(cache, entry->object);
+	entry->object = object;
+}
+
+#define STREAM_WINDOW_SIZE (256 * 1024)
+#define STREAM_MAX_OUTPUT (256 * 1024)
+
+// Moves the text from offset on to the start of the window and reads on, cutting
+// after the last complete line. Tokens never span lines, so a window tokenizes on
+// its own. A line that doesn't fit grows the window.
+static ulang_bool source_window_fill(source_window *window, uint32_t offset, uint32_t firstLine) {
+	ulang_file *file = window->file;
+	size_t complete = file->length - offset, size = complete + window->buffered, length = size;
+	if (size) memmove(file->data, file->data + offset, size);
+	while (!window->eof) {
+		if (size + 1 >= window->capacity) {
+			window->capacity *= 2;
+			file->data = ulang_allocator_realloc(window->allocator, file->data, window->capacity);
+		}
+		size_t numRead = fread(file->data + size, 1, window->capacity - 1 - size, window->source);
+		if (numRead == 0) {
+			if (ferror(window->source)) return UL_FALSE;
+			window->eof = UL_TRUE;
+			break;
+		}
+		size += numRead;
+		if (size + 1 < window->capacity) continue;
+		for (length = size; length > complete && file->data[length - 1] != '\n'; length--);
+		if (length > complete) break;
+	}
+	if (window->eof) length = size;
+	file->length = length;
+	window->buffered = size - length;
+	window->firstLine = firstLine;
+
+	ulang_free(file->lines);
+	file->lines = NULL;
+	ulang_file_get_lines(file);
+	for (size_t i = 1; i <= file->numLines; i++) file->lines[i].lineNumber += firstLine - 1;
+	return UL_TRUE;
+}
+
+// Labels and constants point into the window, their names are moved to the arena
+// before the window moves on and their lines become line numbers in the file.
+static void stream_relocate_span(compiler_context *ctx, ulang_span *span) {
+	ulang_file *file = ctx->window->file;
+	char *data = arena_alloc(&ctx->arena, span->data.length);
+	memcpy(data, span->data.data, span->data.length);
+	span->data.data = data;
+	span->startLine = file->lines[span->startLine].lineNumber;
+	span->endLine = file->lines[span->endLine].lineNumber;
+}
+
+static void stream_relocate_symbols(compiler_context *ctx, compile_unit *unit) {
+	stream_output *output = ctx->output;
+	for (; output->relocatedLabels < unit->labels.size; output->relocatedLabels++)
+		stream_relocate_span(ctx, &unit->labels.items[output->relocatedLabels].label);
+	for (; output->relocatedConstants < ctx->constants.size; output->relocatedConstants++)
+		stream_relocate_span(ctx, &ctx->constants.items[output->relocatedConstants].name);
+}
+
+// Writes the code and data assembled since the last flush to the image. The first
+// pass only keeps count.
+static ulang_bool stream_flush(compiler_context *ctx, compile_unit *unit) {
+	stream_output *output = ctx->output;
+	if (output->pass == 2) {
+		ulang_bool written = fseek(output->image, (long) (output->codeOffset + unit->codeBase), SEEK_SET) == 0 &&
+							 fwrite(unit->code.items, 1, unit->code.size, output->image) == unit->code.size &&
+							 fseek(output->image, (long) (output->dataOffset + unit->dataBase), SEEK_SET) == 0 &&
+							 fwrite(unit->data.items, 1, unit->data.size, output->image) == unit->data.size;
+		if (!written) {
+			ulang_error_init(ctx->error, NULL, NULL, "Couldn't write file %s", output->imageFileName);
+			return UL_FALSE;
+		}
+	}
+	unit->codeBase += unit->code.size;
+	unit->dataBase += unit->data.size;
+	unit->code.size = 0;
+	unit->data.size = 0;
+	unit->addressToLine.size = 0;
+	return UL_TRUE;
+}
+
+// Patches of a streamed instruction are applied right away, all labels are known by
+// the second pass. The first pass only needs the size of the instruction.
+static ulang_bool stream_apply_patches(compiler_context *ctx, compile_unit *unit, ulang_file *file) {
+	if (ctx->output->pass == 2) {
+		for (size_t i = 0; i < unit->patches.size; i++) {
+			if (!apply_patch(ctx, file, unit->ops.items, &unit->patches.items[i], unit->code.items)) return UL_FALSE;
+		}
+	}
+	unit->patches.size = 0;
+	unit->ops.size = 0;
+	return UL_TRUE;
+}
+
+// Called between statements and list elements. Flushes the assembled output once it
+// grows, and moves the window on to the line of the next token once less than half
+// of the window is left, so a statement or list element must fit half a window.
+static ulang_bool stream_advance(compiler_context *ctx, compile_unit *unit, size_t start) {
+	source_window *window = ctx->window;
+	token_stream *stream = &ctx->stream;
+	ulang_file *file = window->file;
+	uint32_t offset = stream->index < stream->end ? stream->tokens->items[stream->index].offset : (uint32_t) file->length;
+	if (window->eof || file->length - offset >= window->capacity / 2) {
+		return unit->code.size + unit->data.size < STREAM_MAX_OUTPUT || stream_flush(ctx, unit);
+	}
+
+	uint32_t lineStart = 0, firstLine = window->firstLine;
+	if (file->length) {
+		uint32_t line = file_line(file, offset, stream->line);
+		lineStart = file_line_start(file, line);
+		firstLine = file->lines[line].lineNumber;
+	}
+	stream_relocate_symbols(ctx, unit);
+	if (!stream_flush(ctx, unit)) return UL_FALSE;
+	if (!source_window_fill(window, lineStart, firstLine)) {
+		ulang_error_init(ctx->error, NULL, NULL, "Couldn't read file %.*s", (int) file->fileName.length, file->fileName.data);
+		return UL_FALSE;
+	}
+	ctx->tokens.size = start;
+	if (!tokenize(file, &ctx->tokens, ctx->error)) return UL_FALSE;
+	// Tokens of the line before the next one were already parsed
+	size_t index = start;
+	while (index < ctx->tokens.size && ctx->tokens.items[index].offset < offset - lineStart) index++;
+	ctx->stream = (token_stream){file, &ctx->tokens, index, ctx->tokens.size};
+	return UL_TRUE;
+}
+
+// Parses what follows a register operand of a load or store, like the * 4 + 8 of
+// r2 * 4 + 8 or the + of r1+. Offsets must be known when they are parsed.
+static ulang_bool parse_address_suffix(compiler_context *ctx, address_suffix *suffix) {
+	ulang_file *file = ctx->stream.file;
+	if (token_stream_match_string(&ctx->stream, STR("*"), UL_TRUE)) {
+		token *scale = token_stream_match(&ctx->stream, TOKEN_INTEGER, UL_TRUE);
+		int value = scale ? token_to_int(file, scale) : 0;
+		if (value != 1 && value != 2 && value != 4) {
+			token_error(ctx->error, file, &ctx->stream.tokens->items[ctx->stream.index - 1], "Expected a scale of 1, 2, or 4.");
+			return UL_FALSE;
+		}
+		suffix->scaled = UL_TRUE;
+		suffix->shift = (uint32_t) value >> 1;
+	}
+	token *sign = token_stream_match_string(&ctx->stream, STR("+"), UL_FALSE);
+	if (!sign) sign = token_stream_match_string(&ctx->stream, STR("-"), UL_FALSE);
+	if (!sign) return UL_TRUE;
+	// A - stays in the expression, 2 - 1 + 1 is an offset of 0
+	if (token_matches(file, sign, STR("+"))) {
+		ctx->stream.index++;
+		if (!suffix->scaled && token_stream_match_string(&ctx->stream, STR(","), UL_FALSE)) {
+			suffix->increment = UL_TRUE;
+			return UL_TRUE;
+		}
+	}
+	expression_value value;
+	token source;
+	if (!parse_expression(ctx, &value, &source)) return UL_FALSE;
+	if (value.unresolved || value.type != UL_INTEGER) {
+		token_error(ctx->error, file, &source, "Offsets of indexed addresses must be integers known at this point.");
+		return UL_FALSE;
+	}
+	suffix->hasOffset = UL_TRUE;
+	suffix->offset = value.i;
+	return UL_TRUE;
+}
+
+// Parses the rest of a register mask starting with the register first into the value's int
+static ulang_bool parse_register_mask(compiler_context *ctx, reg *first, expression_value *value) {
+	ulang_file *file = ctx->stream.file;
+	uint32_t mask = 0;
+	for (reg *from = first; from;) {
+		reg *to = from;
+		if (token_stream_match_string(&ctx->stream, STR("-"), UL_TRUE)) {
+			token *last = token_stream_match(&ctx->stream, TOKEN_IDENTIFIER, UL_TRUE);
+			to = last ? token_matches_register(file, last) : NULL;
+		}
+		if (!to || from->index > 13 || to->index > 13 || to->index < from->index) {
+			token_error(ctx->error, file, &ctx->stream.tokens->items[ctx->stream.index - 1], "Expected registers r1 to r14, ranges going up.");
+			return UL_FALSE;
+		}
+		for (int i = from->index; i <= to->index; i++) mask |= 1 << i;
+		from = NULL;
+		if (token_stream_match_string(&ctx->stream, STR("|"), UL_TRUE)) {
+			token *next = token_stream_match(&ctx->stream, TOKEN_IDENTIFIER, UL_TRUE);
+			if (!next || !(from = token_matches_register(file, next))) {
+				token_error(ctx->error, file, &ctx->stream.tokens->items[ctx->stream.index - 1], "Expected a register.");
+				return UL_FALSE;
+			}
+		}
+	}
+	value->i = (int32_t) mask;
+	return UL_TRUE;
+}
+
+static ulang_bool stream_compile_file(compiler_context *ctx, compile_unit *unit, const char *fileName);
+
+// Embeds the bytes of a file in the data section, labels waiting for an emission point
+// to them. Streaming compiles copy the file to the image in chunks, their first pass
+// only needs its size. Returns false without setting an error if the file can't be read.
+static ulang_bool compile_raw_include(compiler_context *ctx, compile_unit *unit, const char *fileName, ulang_file_read_function fileReadFunction) {
+	ctx->rawIncludes = UL_TRUE;
+	if (!ctx->window) {
+		ulang_file file = {0};
+		if (!fileReadFunction(fileName, &file)) return UL_FALSE;
+		if (file.length) set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+		byte_array_ensure(&unit->data, file.length);
+		if (file.length) memcpy(unit->data.items + unit->data.size, file.data, file.length);
+		unit->data.size += file.length;
+		ulang_file_free(&file);
+		return UL_TRUE;
+	}
+
+	FILE *source = fopen(fileName, "rb");
+	if (!source) return UL_FALSE;
+	ulang_bool result = stream_flush(ctx, unit);
+	if (result && ctx->output->pass == 1) {
+		long length = fseek(source, 0, SEEK_END) == 0 ? ftell(source) : -1;
+		if (length > 0) {
+			set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+			unit->dataBase += (size_t) length;
+		}
+		result = length >= 0;
+	}
+	while (result && ctx->output->pass == 2) {
+		byte_array_ensure(&unit->data, STREAM_MAX_OUTPUT);
+		size_t numRead = fread(unit->data.items + unit->data.size, 1, STREAM_MAX_OUTPUT, source);
+		if (!numRead) break;
+		unit->data.size += numRead;
+		result = stream_flush(ctx, unit);
+	}
+	result = result && !ferror(source);
+	fclose(source);
+	return result;
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, compile_unit *unit, ulang_file_read_function fileReadFunction, ulang_error *error) {
+	ulang_file *file = ctx->window ? ctx->window->file : unit->file;
+	ctx->unit = unit;
+
 	// tokenize
 	int start = (int)ctx->tokens.size;
-	if (!tokenize(file, &ctx->tokens, error)) {
+	uint64_t tokenizeStart = profile_now(ctx);
+	if (!(ctx->cache ? cache_tokenize(ctx->cache, file, &ctx->tokens, error) : tokenize(file, &ctx->tokens, error))) {
 		return UL_FALSE;
 	}
+	if (ctx->profile) ctx->profile->tokenize += profile_now(ctx) - tokenizeStart;
 	ctx->stream = (token_stream){file, &ctx->tokens, start, ctx->tokens.size};
 
-	while (token_stream_has_more(&ctx->stream)) {
+	while (-1) {
+		if (ctx->window && !stream_advance(ctx, unit, start)) return UL_FALSE;
+		if (!token_stream_has_more(&ctx->stream)) break;
 		token *tok = token_stream_consume(&ctx->stream);
-		opcode *op = token_matches_opcode(tok);
+		opcode *op = token_matches_opcode(file, tok);
 		if (!op) {
 			if (tok->type != TOKEN_IDENTIFIER) {
-				ulang_error_init(error, file, &tok->span, "Expected a label, data, include, or an instruction.");
+				token_error(error, file, tok, "Expected a label, data, include, or an instruction.");
 				return UL_FALSE;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("include"))) {
+			if (token_matches(file, tok, STR("include"))) {
 				ulang_bool raw = token_stream_match_string(&ctx->stream, STR("raw"), UL_TRUE) != NULL;
 				token *includedFileToken = token_stream_expect(&ctx->stream, TOKEN_STRING, error);
 				if (!includedFileToken) return UL_FALSE;
-				ulang_string filename = includedFileToken->span.data;
+				ulang_string filename = token_text(file, includedFileToken);
 				filename.data[filename.length - 1] = 0;
 				filename.data++;
 				filename.length -= 2;
@@ -1455,143 +3147,181 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_
 				}
 				char *resolvedFile = NULL;
 				if (idx > -1) {
-					resolvedFile = ulang_calloc(idx + 1 + filename.length + 1);
+					resolvedFile = arena_alloc(&ctx->arena, idx + 1 + filename.length + 1);
 					memcpy(resolvedFile, file->fileName.data, idx + 1);
 					memcpy(resolvedFile + idx + 1, filename.data, filename.length);
+					resolvedFile[idx + 1 + filename.length] = 0;
 				} else {
-					resolvedFile = ulang_calloc(filename.length + 1);
+					resolvedFile = arena_alloc(&ctx->arena, filename.length + 1);
 					memcpy(resolvedFile, filename.data, filename.length + 1);
 				}
 
-				ulang_bool alreadyCompiled = UL_FALSE;
-				for  (int i = 0; i < (int)ctx->files.size; i++) {
-					if (strcmp(ctx->files.items[i]->fileName.data, resolvedFile) == 0) {
-						alreadyCompiled = UL_TRUE;
+				if (raw) {
+					if (!compile_raw_include(ctx, unit, resolvedFile, fileReadFunction)) {
+						if (!error->is_set) {
+							ulang_span span = token_span(file, includedFileToken);
+							ulang_error_init(error, file, &span, "Couldn't read file %s\n", filename.data);
+						}
+						return UL_FALSE;
 					}
+					filename.data[filename.length] = '"';
+					continue;
+				}
+
+				int32_t compiledIndex = context_find_file(ctx, resolvedFile);
+				if (compiledIndex >= 0) {
+					if (ctx->cache && compiledIndex < (int32_t) unit->filesStart) int_array_add(&unit->externalIncludes, (uint32_t) compiledIndex);
+					continue;
 				}
-				if (alreadyCompiled) {
-					ulang_free(resolvedFile);
+
+				// Streamed files are assembled into the including unit as they are read
+				if (ctx->window) {
+					if (!stream_compile_file(ctx, unit, resolvedFile)) {
+						if (!error->is_set) {
+							ulang_span span = token_span(file, includedFileToken);
+							ulang_error_init(error, file, &span, "Couldn't read file %s\n", filename.data);
+						}
+						return UL_FALSE;
+					}
+					// The line might be tokenized again when the window moves on
+					filename.data[filename.length] = '"';
 					continue;
 				}
 
-				ulang_file *includedFile = ulang_calloc(sizeof(ulang_file));
-				if (!fileReadFunction(resolvedFile, includedFile)) {
-					ulang_free(resolvedFile);
-					ulang_free(includedFile);
-					ulang_error_init(error, file, &includedFileToken->span, "Couldn't read file %s\n", filename.data);
+				ulang_file *includedFile = allocator_calloc(ctx->arena.allocator, sizeof(ulang_file));
+				uint64_t readStart = profile_now(ctx);
+				ulang_bool read = fileReadFunction(resolvedFile, includedFile);
+				if (ctx->profile) ctx->profile->fileRead += profile_now(ctx) - readStart;
+				if (!read) {
+					ulang_allocator_free(ctx->arena.allocator, includedFile);
+					ulang_span span = token_span(file, includedFileToken);
+					ulang_error_init(error, file, &span, "Couldn't read file %s\n", filename.data);
 					return UL_FALSE;
 				}
-				ulang_free(resolvedFile);
-				file_array_add(&ctx->files, includedFile); //
+				file_array_add(&ctx->files, includedFile);
+
+				compile_unit *includedUnit = ctx->cache ? cache_reuse_unit(ctx, includedFile, fileReadFunction) : NULL;
+				if (!includedUnit) {
+					includedUnit = compile_unit_new(ctx, includedFile);
+					token_stream oldStream = ctx->stream;
+					if (!ulang_compile_file(ctx, includedUnit, fileReadFunction, error)) return UL_FALSE;
+					ctx->stream = oldStream;
+					ctx->unit = unit;
+				}
+				if (ctx->cache) compile_unit_merge(unit, includedUnit);
 
-				token_stream oldStream = ctx->stream;
-				if (!ulang_compile_file(ctx, includedFile, fileReadFunction, error)) return UL_FALSE;
-				ctx->stream = oldStream;
+				// The linker places the included unit between the current piece and the next
+				unit->pieces.items[unit->pieces.size - 1].include = includedUnit;
+				compile_unit_add_piece(unit);
 				continue;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("byte"))) {
+			if (token_matches(file, tok, STR("byte"))) {
 				while (-1) {
+					if (ctx->window && !stream_advance(ctx, unit, start)) return UL_FALSE;
 					token *value;
 					if ((value = token_stream_match(&ctx->stream, TOKEN_STRING, UL_TRUE))) {
 						int numRepeat = 1;
 						parse_repeat(ctx, &numRepeat);
 						if (error->is_set) return UL_FALSE;
-						set_label_targets(&ctx->labels, UL_LT_DATA, ctx->data.size);
-						emit_string(&ctx->data, value, numRepeat);
+						set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+						emit_string(&unit->data, file, value, numRepeat);
 					} else {
 						expression_value exprValue;
-						ulang_span span = {0};
-						if (!parse_expression(ctx, &exprValue, &span)) return UL_FALSE;
+						token source = {0};
+						if (!parse_expression(ctx, &exprValue, &source)) return UL_FALSE;
 						if (exprValue.type != UL_INTEGER) {
-							ulang_error_init(error, file, &span, "Expression must evaluate to an integer value.");
+							token_error(error, file, &source, "Expression must evaluate to an integer value.");
 							return UL_FALSE;
 						}
 						if (exprValue.unresolved) {
-							ulang_error_init(error, file, &span, "Constant expression must not contain undefined constant, or label.");
+							token_error(error, file, &source, "Constant expression must not contain undefined constant, or label.");
 							return UL_FALSE;
 						}
 						int numRepeat = 1;
 						parse_repeat(ctx, &numRepeat);
 						if (error->is_set) return UL_FALSE;
-						set_label_targets(&ctx->labels, UL_LT_DATA, ctx->data.size);
-						emit_byte(&ctx->data, &exprValue, numRepeat);
+						set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+						emit_byte(&unit->data, &exprValue, numRepeat);
 					}
 					if (!token_stream_match_string(&ctx->stream, STR(","), UL_TRUE)) break;
 				}
 				continue;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("short"))) {
+			if (token_matches(file, tok, STR("short"))) {
 				while (-1) {
+					if (ctx->window && !stream_advance(ctx, unit, start)) return UL_FALSE;
 					expression_value exprValue;
-					ulang_span span = {0};
-					if (!parse_expression(ctx, &exprValue, &span)) return UL_FALSE;
+					token source = {0};
+					if (!parse_expression(ctx, &exprValue, &source)) return UL_FALSE;
 					if (exprValue.type != UL_INTEGER) {
-						ulang_error_init(error, file, &span, "Expression must evaluate to an integer value.");
+						token_error(error, file, &source, "Expression must evaluate to an integer value.");
 						return UL_FALSE;
 					}
 					if (exprValue.unresolved) {
-						ulang_error_init(error, file, &span, "Expression either contains an undefined constant, or a label.");
+						token_error(error, file, &source, "Expression either contains an undefined constant, or a label.");
 						return UL_FALSE;
 					}
 					int numRepeat = 1;
 					parse_repeat(ctx, &numRepeat);
 					if (error->is_set) return UL_FALSE;
-					set_label_targets(&ctx->labels, UL_LT_DATA, ctx->data.size);
-					emit_short(&ctx->data, &exprValue, numRepeat);
+					set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+					emit_short(&unit->data, &exprValue, numRepeat);
 					if (!token_stream_match_string(&ctx->stream, STR(","), UL_TRUE)) break;
 				}
 				continue;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("int"))) {
+			if (token_matches(file, tok, STR("int"))) {
 				while (-1) {
+					if (ctx->window && !stream_advance(ctx, unit, start)) return UL_FALSE;
 					expression_value exprValue;
-					ulang_span span = {0};
-					if (!parse_expression(ctx, &exprValue, &span)) return UL_FALSE;
+					token source = {0};
+					if (!parse_expression(ctx, &exprValue, &source)) return UL_FALSE;
 					if (exprValue.type != UL_INTEGER) {
-						ulang_error_init(error, file, &span, "Expression must evaluate to an integer value.");
+						token_error(error, file, &source, "Expression must evaluate to an integer value.");
 						return UL_FALSE;
 					}
 					if (exprValue.unresolved) {
-						ulang_error_init(error, file, &span, "Expression either contains an undefined constant, or a label.");
+						token_error(error, file, &source, "Expression either contains an undefined constant, or a label.");
 						return UL_FALSE;
 					}
 					int numRepeat = 1;
 					parse_repeat(ctx, &numRepeat);
 					if (error->is_set) return UL_FALSE;
-					set_label_targets(&ctx->labels, UL_LT_DATA, ctx->data.size);
-					emit_int(&ctx->data, &exprValue, numRepeat);
+					set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+					emit_int(&unit->data, &exprValue, numRepeat);
 					if (!token_stream_match_string(&ctx->stream, STR(","), UL_TRUE)) break;
 				}
 				continue;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("float"))) {
+			if (token_matches(file, tok, STR("float"))) {
 				while (-1) {
+					if (ctx->window && !stream_advance(ctx, unit, start)) return UL_FALSE;
 					expression_value exprValue;
-					ulang_span span = {0};
-					if (!parse_expression(ctx, &exprValue, &span)) return UL_FALSE;
+					token source = {0};
+					if (!parse_expression(ctx, &exprValue, &source)) return UL_FALSE;
 					if (exprValue.type != UL_FLOAT) {
-						ulang_error_init(error, file, &span, "Expression must evaluate to a float value.");
+						token_error(error, file, &source, "Expression must evaluate to a float value.");
 						return UL_FALSE;
 					}
 					if (exprValue.unresolved) {
-						ulang_error_init(error, file, &span, "Expression either contains an undefined constant, or a label.");
+						token_error(error, file, &source, "Expression either contains an undefined constant, or a label.");
 						return UL_FALSE;
 					}
 					int numRepeat = 1;
 					parse_repeat(ctx, &numRepeat);
 					if (error->is_set) return UL_FALSE;
-					set_label_targets(&ctx->labels, UL_LT_DATA, ctx->data.size);
-					emit_float(&ctx->data, &exprValue, numRepeat);
+					set_unit_label_targets(unit, UL_LT_DATA, unit->data.size);
+					emit_float(&unit->data, &exprValue, numRepeat);
 					if (!token_stream_match_string(&ctx->stream, STR(","), UL_TRUE)) break;
 				}
 				continue;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("reserve"))) {
+			if (token_matches(file, tok, STR("reserve"))) {
 				size_t typeSize = 0;
 				if (token_stream_match_string(&ctx->stream, STR("byte"), UL_TRUE)) typeSize = 1;
 				else if (token_stream_match_string(&ctx->stream, STR("short"), UL_TRUE)) typeSize = 2;
@@ -1600,67 +3330,86 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_
 				else {
 					token *token = token_stream_consume(&ctx->stream);
 					if (!token) token = &ctx->stream.tokens->items[ctx->stream.index - 1];
-					ulang_error_init(error, file, &token->span, "Expected byte, short, int, or float.");
+					token_error(error, file, token, "Expected byte, short, int, or float.");
 					return UL_FALSE;
 				}
 
 				if (!token_stream_expect_string(&ctx->stream, STR("x"), "after 'reserve <type>'", error)) return UL_FALSE;;
 				expression_value exprValue;
-				ulang_span span = {0};
-				if (!parse_expression(ctx, &exprValue, &span)) return UL_FALSE;
+				token source = {0};
+				if (!parse_expression(ctx, &exprValue, &source)) return UL_FALSE;
 				if (exprValue.type != UL_INTEGER) {
-					ulang_error_init(error, file, &span, "Expression must evaluate to an integer value.");
+					token_error(error, file, &source, "Expression must evaluate to an integer value.");
 					return UL_FALSE;
 				}
 				if (exprValue.unresolved) {
-					ulang_error_init(error, file, &span, "Expression either contains an undefined constant, or a label.");
+					token_error(error, file, &source, "Expression either contains an undefined constant, or a label.");
 					return UL_FALSE;
 				}
 
 				size_t numBytes = typeSize * exprValue.i;
 				if (numBytes <= 0) {
-					ulang_error_init(error, file, &span, "Number of reserved bytes must be > 0.");
+					token_error(error, file, &source, "Number of reserved bytes must be > 0.");
 					return UL_FALSE;
 				}
-				set_label_targets(&ctx->labels, UL_LT_RESERVED_DATA, ctx->numReservedBytes);
-				ctx->numReservedBytes += numBytes;
+				set_unit_label_targets(unit, UL_LT_RESERVED_DATA, unit->numReservedBytes);
+				unit->numReservedBytes += numBytes;
 				continue;
 			}
 
-			if (ulang_span_matches(&tok->span, STR("const"))) {
+			if (token_matches(file, tok, STR("const"))) {
 				token *name = token_stream_expect(&ctx->stream, TOKEN_IDENTIFIER, ctx->error);
 				if (!name) return UL_FALSE;
 				expression_value exprValue;
-				ulang_span span = {0};
-				if (!parse_expression(ctx, &exprValue, &span)) return UL_FALSE;
+				token source = {0};
+				if (!parse_expression(ctx, &exprValue, &source)) return UL_FALSE;
 				if (exprValue.unresolved) {
-					ulang_error_init(error, file, &span, "Expression either contains an undefined constant, or a label.");
+					token_error(error, file, &source, "Expression either contains an undefined constant, or a label.");
 					return UL_FALSE;
 				}
+				if (ctx->output && ctx->output->pass == 2) {
+					ctx->output->visibleConstants++;
+					continue;
+				}
 				ulang_constant constant = { exprValue.type };
-				constant.name = name->span;
+				constant.name = token_stream_span(&ctx->stream, name);
 				if (exprValue.type == UL_INTEGER) constant.i = exprValue.i;
 				else constant.f = exprValue.f;
 				constant_array_add(&ctx->constants, constant);
+				int_array_add(&unit->constants, (uint32_t) ctx->constants.size - 1);
+				// The first definition of a constant wins, as it always has.
+				if (symbol_table_find(ctx->constantTable.slots, ctx->constantTable.numSlots, ctx->constants.items, constant_name, &constant.name.data) < 0)
+					symbol_table_insert(&ctx->constantTable, ctx->constants.items, constant_name, (uint32_t) ctx->constants.size - 1);
 				continue;
 			}
 
-			// Otherwise, we must have a label
+			// Otherwise, we must have a label. The second pass of a streaming compile knows them all.
 			if (!token_stream_expect_string(&ctx->stream, STR(":"), "after label", error)) return UL_FALSE;
-			ulang_label label = {tok->span, UL_LT_UNINITIALIZED, 0};
-			label_array_add(&ctx->labels, label);
+			if (ctx->output && ctx->output->pass == 2) continue;
+			ulang_span labelSpan = token_stream_span(&ctx->stream, tok);
+			if (symbol_table_find(unit->labelTable.slots, unit->labelTable.numSlots, unit->labels.items, label_name, &labelSpan.data) >= 0) {
+				ulang_error_init(error, file, &labelSpan, "Label '%.*s' is already defined.", labelSpan.data.length, labelSpan.data.data);
+				return UL_FALSE;
+			}
+			ulang_label label = {labelSpan, UL_LT_UNINITIALIZED, 0};
+			label_array_add(&unit->labels, label);
+			symbol_table_insert(&unit->labelTable, unit->labels.items, label_name, (uint32_t) unit->labels.size - 1);
 		} else {
 			token operands[3];
+			reg *operandRegisters[3] = {0};
 			expression_value operandExpressions[3];
+			address_suffix suffixes[3] = {{0}};
 			for (int i = 0; i < op->numOperands; i++) {
 				token *operand = token_stream_match(&ctx->stream, TOKEN_IDENTIFIER, UL_TRUE);
-				if (operand && token_matches_register(operand)) {
+				if (operand && (operandRegisters[i] = token_matches_register(file, operand))) {
 					operands[i] = *operand;
 					operandExpressions[i] = (expression_value) {0};
+					ulang_bool addressed = indexed_opcode(op->code) != HALT || op->operands[0] == UL_BASE || op->operands[1] == UL_BASE;
+					if (addressed && !parse_address_suffix(ctx, &suffixes[i])) return UL_FALSE;
+					if (op->operands[i] == UL_MASK && !parse_register_mask(ctx, operandRegisters[i], &operandExpressions[i])) return UL_FALSE;
 				} else {
 					if (operand) ctx->stream.index--;
-					if (!parse_expression(ctx, &operandExpressions[i], &operands[i].span)) return UL_FALSE;
-					operands[i].type = operandExpressions[i].type == UL_FLOAT ? TOKEN_FLOAT : TOKEN_INTEGER;
+					if (!parse_expression(ctx, &operandExpressions[i], &operands[i])) return UL_FALSE;
 				}
 
 				if (i < op->numOperands - 1) {
@@ -1668,17 +3417,47 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_
 				}
 			}
 
+			// Find the first overload the operands fit. The error for the first mismatch is only
+			// created if no overload fits, as ulang_error_init copies the whole source file.
 			opcode *firstOp = op;
 			opcode *fittingOp = NULL;
+			const char *mismatch = NULL;
+			token *mismatchOperand = NULL;
 			while (-1) {
 				fittingOp = op;
 				for (int i = 0; i < op->numOperands; i++) {
 					token *operand = &operands[i];
 					operand_type operandType = op->operands[i];
-					reg *r = token_matches_register(operand);
+					reg *r = operandRegisters[i];
+					address_suffix *suffix = &suffixes[i];
+					ulang_bool vector = r && r->index >= FIRST_VECTOR_REGISTER;
 					if (operandType == UL_REG) {
-						if (!r) {
-							if (!error->is_set) ulang_error_init(error, file, &operand->span, "Expected a register");
+						if (!r || vector || suffix->scaled || suffix->hasOffset || suffix->increment) {
+							if (!mismatch) mismatch = "Expected a register", mismatchOperand = operand;
+							fittingOp = NULL;
+							break;
+						}
+					} else if (operandType == UL_VREG) {
+						if (!vector || suffix->scaled || suffix->hasOffset || suffix->increment) {
+							if (!mismatch) mismatch = "Expected a vector register", mismatchOperand = operand;
+							fittingOp = NULL;
+							break;
+						}
+					} else if (operandType == UL_MASK) {
+						if (!r || vector) {
+							if (!mismatch) mismatch = "Expected registers", mismatchOperand = operand;
+							fittingOp = NULL;
+							break;
+						}
+					} else if (operandType == UL_BASE) {
+						if (!r || vector || suffix->scaled || suffix->hasOffset) {
+							if (!mismatch) mismatch = "Expected a register", mismatchOperand = operand;
+							fittingOp = NULL;
+							break;
+						}
+					} else if (operandType == UL_INDEX) {
+						if (r ? vector || suffix->increment : (operand->type != TOKEN_INTEGER || operandExpressions[i].unresolved)) {
+							if (!mismatch) mismatch = "Expected an index register or an int", mismatchOperand = operand;
 							fittingOp = NULL;
 							break;
 						}
@@ -1686,22 +3465,26 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_
 						if (!(operand->type == TOKEN_INTEGER ||
 							  operand->type == TOKEN_FLOAT ||
 							  operand->type == TOKEN_IDENTIFIER) || r) {
-							if (!error->is_set)
-								ulang_error_init(error, file, &operand->span, "Expected an int, float, or a label");
+							if (!mismatch) mismatch = "Expected an int, float, or a label", mismatchOperand = operand;
 							fittingOp = NULL;
 							break;
 						}
 					} else if (operandType == UL_LBL_INT) {
 						if (!(operand->type == TOKEN_INTEGER ||
 							  operand->type == TOKEN_IDENTIFIER) || r) {
-							if (!error->is_set)
-								ulang_error_init(error, file, &operand->span, "Expected an int or a label");
+							if (!mismatch) mismatch = "Expected an int or a label", mismatchOperand = operand;
+							fittingOp = NULL;
+							break;
+						}
+					} else if (operandType == UL_IMM) {
+						if (!(operand->type == TOKEN_INTEGER || operand->type == TOKEN_FLOAT) || r) {
+							if (!mismatch) mismatch = "Expected an int or a float", mismatchOperand = operand;
 							fittingOp = NULL;
 							break;
 						}
 					} else if (operandType == UL_OFF || operandType == UL_INT) {
 						if (operand->type != TOKEN_INTEGER) {
-							if (!error->is_set) ulang_error_init(error, file, &operand->span, "Expected an int");
+							if (!mismatch) mismatch = "Expected an int", mismatchOperand = operand;
 							fittingOp = NULL;
 							break;
 						}
@@ -1711,29 +3494,31 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_
 							if (operand->type == TOKEN_INTEGER) {
 								operand->type = TOKEN_FLOAT;
 							} else {
-								if (!error->is_set) ulang_error_init(error, file, &operand->span, "Expected a float");
+								if (!mismatch) mismatch = "Expected a float", mismatchOperand = operand;
 								fittingOp = NULL;
 							}
 							break;
 						}
 					} else {
-						if (!error->is_set)
-							ulang_error_init(error, file, &operand->span, "Internal error, unknown operand type.");
+						if (!mismatch) mismatch = "Internal error, unknown operand type.", mismatchOperand = operand;
+						fittingOp = NULL;
+						break;
 					}
 				}
 				if (fittingOp) break;
-				if (op->index + 1 == opcodeLength) break;
-				if (!ulang_string_equals(&op->name, &opcodes[op->index + 1].name)) break;
-				op = &opcodes[op->index + 1];
+				opcode *next = next_overload(firstOp, op);
+				if (!next) break;
+				op = next;
+			}
+			if (!fittingOp && firstOp == op) {
+				token_error(error, file, mismatchOperand, mismatch);
+				return UL_FALSE;
 			}
-			if (!fittingOp && firstOp != op) {
+			if (!fittingOp) {
 				token *lastToken = &ctx->tokens.items[ctx->stream.index - 1];
-				ulang_span span = {0};
-				span.startLine = tok->span.startLine;
-				span.endLine = lastToken->span.endLine;
-				span.data.data = tok->span.data.data;
-				span.data.length = lastToken->span.data.data - tok->span.data.data + tok->span.data.length + 1;
-				if (error->is_set) ulang_error_free(error);
+				ulang_span span = token_span(file, tok);
+				span.endLine = token_span(file, lastToken).endLine;
+				span.data.length = lastToken->offset - tok->offset + tok->length + 1;
 				char *alternatives = NULL;
 				size_t len = 0;
 				op = firstOp;
@@ -1760,138 +3545,1523 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_file(compiler_context *ctx, ulang_
 								alternatives = string_concat(alternatives, len, STR("<float>"), &len);
 								break;
 							case UL_OFF:
+							case UL_IMM:
 								alternatives = string_concat(alternatives, len, STR("<offset>"), &len);
 								break;
+							case UL_VREG:
+								alternatives = string_concat(alternatives, len, STR("<vector register>"), &len);
+								break;
+							case UL_BASE:
+								alternatives = string_concat(alternatives, len, STR("<register>[+]"), &len);
+								break;
+							case UL_MASK:
+								alternatives = string_concat(alternatives, len, STR("<register>[-<register>] [| ...]"), &len);
+								break;
+							case UL_INDEX:
+								alternatives = string_concat(alternatives, len, STR("<register> [* <scale>] [+ <offset>]"), &len);
+								break;
 						}
 						if (i < op->numOperands - 1) alternatives = string_concat(alternatives, len, STR(", "), &len);
 					}
 					alternatives = string_concat(alternatives, len, STR("\n"), &len);
-					if (!ulang_string_equals(&op->name, &opcodes[op->index + 1].name)) break;
-					op = &opcodes[op->index + 1];
+					if (!(op = next_overload(firstOp, op))) break;
 				}
 				ulang_error_init(ctx->error, ctx->stream.file, &span, "No matching instructions for the given argument types. Possible alternatives:\n%s", alternatives);
 				ulang_free(alternatives);
 				return UL_FALSE;
 			}
-			if (error->is_set) ulang_error_free(error);
-
-			set_label_targets(&ctx->labels, UL_LT_CODE, ctx->code.size);
-			int_array_add(&ctx->addressToLine, tok->span.startLine);
-			file_array_add(&ctx->addressToFile, file);
-			if (fittingOp->hasValueOperand) {
-				int_array_add(&ctx->addressToLine, tok->span.startLine);
-				file_array_add(&ctx->addressToFile, file);
+
+			set_unit_label_targets(unit, UL_LT_CODE, unit->code.size);
+			uint32_t line = token_stream_span(&ctx->stream, tok).startLine;
+			size_t codeSize = unit->code.size;
+			if (!emit_op(file, fittingOp, operands, operandRegisters, operandExpressions, suffixes, &unit->patches, &unit->code, error)) return UL_FALSE;
+			for (; codeSize < unit->code.size; codeSize += 4) int_array_add(&unit->addressToLine, line);
+			if (ctx->window && !stream_apply_patches(ctx, unit, file)) return UL_FALSE;
+		}
+	}
+
+	// Patches carry their expressions as ops, the tokens of the file are no longer needed
+	ctx->tokens.size = start;
+	return UL_TRUE;
+}
+
+// Assembles a file into the unit a window at a time. Returns false without setting
+// an error if the file can't be opened.
+static ulang_bool stream_compile_file(compiler_context *ctx, compile_unit *unit, const char *fileName) {
+	FILE *source = fopen(fileName, "rb");
+	if (!source) return UL_FALSE;
+	if (ctx->window) stream_relocate_symbols(ctx, unit);
+
+	ulang_file *file = arena_alloc(&ctx->arena, sizeof(ulang_file));
+	memset(file, 0, sizeof(ulang_file));
+	file->fileName.length = (uint32_t) strlen(fileName);
+	file->fileName.data = arena_alloc(&ctx->arena, file->fileName.length + 1);
+	memcpy(file->fileName.data, fileName, file->fileName.length + 1);
+	file->data = ulang_allocator_alloc(ctx->arena.allocator, STREAM_WINDOW_SIZE);
+	file_array_add(&ctx->files, file);
+
+	source_window window = {source, file, ctx->arena.allocator, STREAM_WINDOW_SIZE, 0, 1, UL_FALSE};
+	source_window *parent = ctx->window;
+	token_stream parentStream = ctx->stream;
+	ctx->window = &window;
+	ulang_bool result = source_window_fill(&window, 0, 1);
+	if (!result) ulang_error_init(ctx->error, NULL, NULL, "Couldn't read file %s", fileName);
+	else result = ulang_compile_file(ctx, unit, NULL, ctx->error);
+	if (result) stream_relocate_symbols(ctx, unit);
+	ctx->window = parent;
+	ctx->stream = parentStream;
+	ctx->unit = unit;
+
+	fclose(source);
+	ulang_allocator_free(ctx->arena.allocator, file->data);
+	ulang_free(file->lines);
+	file->data = NULL;
+	file->lines = NULL;
+	file->length = 0;
+	return result;
+}
+
+// Appends the pieces of a unit and the units it includes to the program sections in
+// source order. Labels and patches are moved from unit to program addresses, labels
+// still waiting for an emission are bound to the first one of a following piece.
+static ulang_bool link_unit(compiler_context *ctx, compile_unit *unit, int_array *pendingLabels) {
+	size_t patchIndex = 0;
+	uint32_t opsBase = (uint32_t) ctx->ops.size;
+	expression_op_array_ensure(&ctx->ops, unit->ops.size);
+	if (unit->ops.size) memcpy(ctx->ops.items + opsBase, unit->ops.items, sizeof(expression_op) * unit->ops.size);
+	ctx->ops.size += unit->ops.size;
+	for (size_t i = 0; i < unit->pieces.size; i++) {
+		unit_piece *piece = &unit->pieces.items[i];
+		unit_piece *next = i + 1 < unit->pieces.size ? piece + 1 : NULL;
+		size_t codeEnd = next ? next->code : unit->code.size;
+		size_t dataEnd = next ? next->data : unit->data.size;
+		size_t reservedEnd = next ? next->reserved : unit->numReservedBytes;
+		size_t labelsEnd = next ? next->labels : unit->labels.size;
+		size_t codeBase = ctx->code.size, dataBase = ctx->data.size, reservedBase = ctx->numReservedBytes;
+
+		if (piece->firstEmission != UL_LT_UNINITIALIZED) {
+			for (size_t j = 0; j < pendingLabels->size; j++) {
+				ulang_label *label = &ctx->labels.items[pendingLabels->items[j]];
+				label->target = piece->firstEmission;
+				label->address = label_section_base(piece->firstEmission, codeBase, dataBase, reservedBase);
+			}
+			pendingLabels->size = 0;
+		}
+
+		byte_array_ensure(&ctx->code, codeEnd - piece->code);
+		if (codeEnd > piece->code) memcpy(ctx->code.items + codeBase, unit->code.items + piece->code, codeEnd - piece->code);
+		ctx->code.size += codeEnd - piece->code;
+		byte_array_ensure(&ctx->data, dataEnd - piece->data);
+		if (dataEnd > piece->data) memcpy(ctx->data.items + dataBase, unit->data.items + piece->data, dataEnd - piece->data);
+		ctx->data.size += dataEnd - piece->data;
+		ctx->numReservedBytes += reservedEnd - piece->reserved;
+		for (size_t j = piece->code >> 2; j < codeEnd >> 2; j++) {
+			uint32_t line = unit->addressToLine.items[j];
+			ulang_line_range *last = ctx->lineRanges.size ? &ctx->lineRanges.items[ctx->lineRanges.size - 1] : NULL;
+			if (last && last->file == unit->fileIndex && last->line == line) continue;
+			ulang_line_range range = {(uint32_t) ((codeBase >> 2) + j - (piece->code >> 2)), unit->fileIndex, line};
+			line_range_array_add(&ctx->lineRanges, range);
+		}
+
+		for (; patchIndex < unit->patches.size && unit->patches.items[patchIndex].patchAddress < codeEnd; patchIndex++) {
+			patch p = unit->patches.items[patchIndex];
+			p.patchAddress = p.patchAddress - piece->code + codeBase;
+			p.expr.firstOp += opsBase;
+			p.file = unit->file;
+			patch_array_add(&ctx->patches, p);
+		}
+
+		for (size_t j = piece->labels; j < labelsEnd; j++) {
+			ulang_label label = unit->labels.items[j];
+			if (symbol_table_find(ctx->labelTable.slots, ctx->labelTable.numSlots, ctx->labels.items, label_name, &label.label.data) >= 0) {
+				ulang_error_init(ctx->error, unit->file, &label.label, "Label '%.*s' is already defined.", label.label.data.length, label.label.data.data);
+				return UL_FALSE;
+			}
+			if (label.target == UL_LT_UNINITIALIZED) int_array_add(pendingLabels, (uint32_t) ctx->labels.size);
+			else label.address += label_section_base(label.target, codeBase - piece->code, dataBase - piece->data, reservedBase - piece->reserved);
+			label_array_add(&ctx->labels, label);
+			symbol_table_insert(&ctx->labelTable, ctx->labels.items, label_name, (uint32_t) ctx->labels.size - 1);
+		}
+
+		if (piece->include && !link_unit(ctx, piece->include, pendingLabels)) return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+static uint32_t code_word(compiler_context *ctx, size_t index) {
+	uint32_t word;
+	memcpy(&word, ctx->code.items + (index << 2), 4);
+	return word;
+}
+
+static void set_code_word(compiler_context *ctx, size_t index, uint32_t word) {
+	memcpy(ctx->code.items + (index << 2), &word, 4);
+}
+
+// Whether the instruction reads or writes pc. Moving code around changes what it sees.
+static ulang_bool instruction_uses_pc(opcode *op, uint32_t word) {
+	int numRegs = 0;
+	for (int i = 0; i < op->numOperands; i++) {
+		if (op->operands[i] != UL_REG && op->operands[i] != UL_BASE && op->operands[i] != UL_INDEX) continue;
+		if (DECODE_REG(word, numRegs++) == 15) return UL_TRUE;
+	}
+	return UL_FALSE;
+}
+
+// Rewrites instructions into cheaper equivalents once patches are applied. Moves to the
+// same register, nops and arithmetic with an identity value are removed or turned into
+// moves, multiplications and unsigned divisions by a power of two into shifts, and a
+// push followed by a pop into a move. Instructions using pc or a patched operand are
+// left alone. The code is compacted afterwards, labels, line ranges and patches are
+// moved to the new addresses and the patches applied again, data addresses depend on
+// the size of the code. Code computing addresses from pc can't be relocated.
+static ulang_bool optimize_code(compiler_context *ctx, size_t *numRemoved) {
+	size_t numWords = ctx->code.size >> 2;
+	*numRemoved = 0;
+	for (size_t i = 0; i < numWords;) {
+		uint32_t op = DECODE_OP(code_word(ctx, i));
+		if (op >= NUM_OPCODES) return UL_TRUE;
+		i += opcodes[op].hasValueOperand ? 2 : 1;
+	}
+
+	uint8_t *patched = arena_alloc(&ctx->arena, numWords + 1);
+	uint8_t *targeted = arena_alloc(&ctx->arena, numWords + 1);
+	uint8_t *keep = arena_alloc(&ctx->arena, numWords + 1);
+	uint32_t *newAddress = arena_alloc(&ctx->arena, sizeof(uint32_t) * (numWords + 1));
+	memset(patched, 0, numWords + 1);
+	memset(targeted, 0, numWords + 1);
+	memset(keep, 1, numWords + 1);
+	for (size_t i = 0; i < ctx->patches.size; i++) patched[ctx->patches.items[i].patchAddress >> 2] = UL_TRUE;
+	for (size_t i = 0; i < ctx->labels.size; i++) {
+		ulang_label *label = &ctx->labels.items[i];
+		if (label->target == UL_LT_CODE && label->address < ctx->code.size) targeted[label->address >> 2] = UL_TRUE;
+	}
+
+	for (size_t i = 0, length; i < numWords; i += length) {
+		uint32_t word = code_word(ctx, i);
+		opcode *op = &opcodes[DECODE_OP(word)];
+		length = op->hasValueOperand ? 2 : 1;
+		if (patched[i] || (length == 2 && patched[i + 1]) || instruction_uses_pc(op, word)) continue;
+		int32_t value = 0;
+		if (length == 2) memcpy(&value, ctx->code.items + ((i + 1) << 2), 4);
+		uint32_t src = DECODE_REG(word, 0), dst = DECODE_REG(word, 1);
+
+		ulang_bool identity = UL_FALSE;
+		switch (op->code) {
+			case NOP:
+				keep[i] = UL_FALSE;
+				(*numRemoved)++;
+				break;
+			case MOVE_REG:
+				identity = UL_TRUE;
+				break;
+			case ADD_VAL:
+			case SUB_VAL:
+			case OR_VAL:
+			case XOR_VAL:
+				identity = value == 0;
+				break;
+			case AND_VAL:
+				identity = value == -1;
+				break;
+			case MUL_VAL:
+			case DIV_VAL:
+			case DIV_UNSIGNED_VAL:
+				identity = value == 1;
+				if (!identity && op->code != DIV_VAL && value > 1 && !(value & (value - 1))) {
+					uint32_t shift = 0;
+					while ((1 << shift) != value) shift++;
+					word &= ~(uint32_t) 0x7f;
+					ENCODE_OP(word, op->code == MUL_VAL ? SHL_VAL : SHRU_VAL);
+					ENCODE_OFF(word, shift);
+					set_code_word(ctx, i, word);
+					keep[i + 1] = UL_FALSE;
+				}
+				break;
+			case ADD_IMM:
+			case SHL_VAL:
+			case SHR_VAL:
+			case SHRU_VAL:
+				identity = DECODE_OFF(word) == 0;
+				break;
+			case PUSH_IMM: {
+				if (i + 1 >= numWords || patched[i + 1] || targeted[i + 1]) break;
+				uint32_t next = code_word(ctx, i + 1);
+				if (DECODE_OP(next) != POP_REG || DECODE_REG(next, 0) >= 14) break;
+				word = (word & ~(uint32_t) 0x7f) | MOVE_IMM;
+				ENCODE_REG(word, DECODE_REG(next, 0), 0);
+				set_code_word(ctx, i, word);
+				keep[i + 1] = UL_FALSE;
+				(*numRemoved)++;
+				length = 2;
+				break;
+			}
+			case PUSH_REG: {
+				if (i + 1 >= numWords || patched[i + 1] || targeted[i + 1]) break;
+				uint32_t next = code_word(ctx, i + 1);
+				if (DECODE_OP(next) != POP_REG || src >= 14 || DECODE_REG(next, 0) >= 14) break;
+				keep[i + 1] = UL_FALSE;
+				(*numRemoved)++;
+				if (src == DECODE_REG(next, 0)) {
+					keep[i] = UL_FALSE;
+					(*numRemoved)++;
+				} else {
+					uint32_t move = 0;
+					ENCODE_OP(move, MOVE_REG);
+					ENCODE_REG(move, src, 0);
+					ENCODE_REG(move, DECODE_REG(next, 0), 1);
+					set_code_word(ctx, i, move);
+				}
+				length = 2;
+				break;
+			}
+			default:
+				break;
+		}
+		if (!identity) continue;
+		// The remaining operations have a source and a destination register, like mov
+		if (src == dst) {
+			keep[i] = UL_FALSE;
+			(*numRemoved)++;
+		} else if (op->code != MOVE_REG) {
+			word &= ~(uint32_t) 0x7f & ~((uint32_t) 0x1fff << 19);
+			ENCODE_OP(word, MOVE_REG);
+			set_code_word(ctx, i, word);
+		}
+		if (length == 2) keep[i + 1] = UL_FALSE;
+	}
+
+	size_t size = 0;
+	for (size_t i = 0; i < numWords; i++) {
+		newAddress[i] = (uint32_t) size;
+		if (keep[i]) set_code_word(ctx, size++, code_word(ctx, i));
+	}
+	newAddress[numWords] = (uint32_t) size;
+	if (size == numWords) return UL_TRUE;
+	ctx->code.size = size << 2;
+
+	for (size_t i = 0; i < ctx->labels.size; i++) {
+		ulang_label *label = &ctx->labels.items[i];
+		if (label->target == UL_LT_CODE) label->address = (size_t) newAddress[label->address >> 2] << 2;
+	}
+	size_t numRanges = 0;
+	for (size_t i = 0; i < ctx->lineRanges.size; i++) {
+		ulang_line_range range = ctx->lineRanges.items[i];
+		range.address = newAddress[range.address];
+		uint32_t end = i + 1 < ctx->lineRanges.size ? newAddress[ctx->lineRanges.items[i + 1].address] : (uint32_t) size;
+		if (range.address == end) continue;
+		ulang_line_range *last = numRanges ? &ctx->lineRanges.items[numRanges - 1] : NULL;
+		if (last && last->file == range.file && last->line == range.line) continue;
+		ctx->lineRanges.items[numRanges++] = range;
+	}
+	ctx->lineRanges.size = numRanges;
+
+	for (size_t i = 0; i < ctx->patches.size; i++) {
+		patch *p = &ctx->patches.items[i];
+		p->patchAddress = (size_t) newAddress[p->patchAddress >> 2] << 2;
+		// Offsets are or'ed into the instruction, clear the one applied before
+		if (p->type == PT_OFFSET) set_code_word(ctx, p->patchAddress >> 2, code_word(ctx, p->patchAddress >> 2) & ~((uint32_t) 0x1fff << 19));
+		if (!apply_patch(ctx, p->file, ctx->ops.items, p, ctx->code.items)) return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+// A run of instructions only entered at its start, see layout_code.
+typedef struct code_block {
+	uint32_t start;
+	uint32_t end;
+	uint32_t last;
+	uint32_t count;
+	int32_t fallthrough;
+	int32_t target;
+	uint32_t newStart;
+	uint32_t newEnd;
+	ulang_bool placed;
+	ulang_bool dropJump;
+	ulang_bool invertJump;
+	int32_t appendJump;
+} code_block;
+
+static ulang_bool is_conditional_jump(uint32_t op) {
+	return (op >= JUMP_EQUAL && op <= JUMP_GREATER_EQUAL) || op == BRANCH || op == BRANCH_IMM;
+}
+
+static uint32_t invert_conditional_jump(uint32_t op) {
+	switch (op) {
+		case JUMP_EQUAL: return JUMP_NOT_EQUAL;
+		case JUMP_NOT_EQUAL: return JUMP_EQUAL;
+		case JUMP_LESS: return JUMP_GREATER_EQUAL;
+		case JUMP_GREATER_EQUAL: return JUMP_LESS;
+		case JUMP_GREATER: return JUMP_LESS_EQUAL;
+		default: return JUMP_GREATER;
+	}
+}
+
+// The first condition of the kind of compare the branch condition belongs to, less 2
+// for the unsigned ones, so condition - base + JUMP_EQUAL is its jump.
+static uint32_t branch_condition_base(uint32_t condition) {
+	return condition >= BC_EQUAL_FLOAT ? BC_EQUAL_FLOAT : condition >= BC_LESS_UNSIGNED ? BC_LESS_UNSIGNED - 2 : BC_EQUAL;
+}
+
+// The register slot holding the condition of a branch
+static int branch_condition_slot(uint32_t op) {
+	return op == BRANCH || op == BRANCH_NEAR ? 2 : 1;
+}
+
+static uint32_t invert_jump(uint32_t word) {
+	uint32_t op = DECODE_OP(word);
+	if (op != BRANCH && op != BRANCH_IMM) return (word & ~(uint32_t) 0x7f) | invert_conditional_jump(op);
+	int slot = branch_condition_slot(op);
+	uint32_t condition = DECODE_REG(word, slot), base = branch_condition_base(condition);
+	word &= ~((uint32_t) 0xf << (7 + 4 * slot));
+	ENCODE_REG(word, base + invert_conditional_jump(JUMP_EQUAL + condition - base) - JUMP_EQUAL, slot);
+	return word;
+}
+
+// Whether the instruction is a jump or call with an address in its value word.
+static ulang_bool has_target_value(uint32_t op) {
+	return op == JUMP || is_conditional_jump(op) || op == CALL_VAL || op == TAIL_CALL;
+}
+
+// Whether execution can go on with the next instruction
+static ulang_bool falls_through(uint32_t op) {
+	return op != JUMP && op != RET && op != RETN && op != HALT && op != TAIL_CALL;
+}
+
+static ulang_bool is_near_jump(uint32_t op) {
+	return op == JUMP_NEAR || op == BRANCH_NEAR || op == BRANCH_IMM_NEAR;
+}
+
+// Offset in words from a near jump to its target
+static int32_t near_jump_offset(uint32_t word) {
+	return DECODE_OP(word) == BRANCH_IMM_NEAR ? DECODE_BRANCH_OFFSET(word) : DECODE_IMM(word);
+}
+
+static uint32_t set_near_jump_offset(uint32_t word, int32_t offset) {
+	if (DECODE_OP(word) == BRANCH_IMM_NEAR) return (word & ~((uint32_t) 0x1ff << 23)) | ((uint32_t) offset & 0x1ff) << 23;
+	word &= ~((uint32_t) 0x1fff << 19);
+	ENCODE_OFF(word, offset);
+	return word;
+}
+
+// The near form of a jump or branch with the value word holding its target, or 0 if
+// the distance in words or the immediate of the branch don't fit.
+static uint32_t shorten_jump(uint32_t word, int64_t distance) {
+	uint32_t op = DECODE_OP(word), near = 0;
+	if (op == BRANCH_IMM) {
+		int32_t value = DECODE_IMM(word);
+		if (value < -128 || value > 127 || distance < -256 || distance > 255) return 0;
+		ENCODE_OP(near, BRANCH_IMM_NEAR);
+		ENCODE_REG(near, DECODE_REG(word, 0), 0);
+		ENCODE_REG(near, DECODE_REG(word, 1), 1);
+		near |= ((uint32_t) value & 0xff) << 15;
+		return set_near_jump_offset(near, (int32_t) distance);
+	}
+	if (op == CALL_VAL || op == TAIL_CALL || distance < IMM_MIN || distance > IMM_MAX) return 0;
+	if (op == BRANCH) return set_near_jump_offset((word & ~(uint32_t) 0x7f) | BRANCH_NEAR, (int32_t) distance);
+	ENCODE_OP(near, JUMP_NEAR);
+	if (op != JUMP) ENCODE_REG(near, DECODE_REG(word, 0), 0);
+	ENCODE_REG(near, op - JUMP, 1);
+	return set_near_jump_offset(near, (int32_t) distance);
+}
+
+// The two word form of a near jump, going to the word at target
+static void expand_jump(uint32_t word, uint32_t target, uint32_t jump[2]) {
+	uint32_t op = DECODE_OP(word);
+	jump[1] = target << 2;
+	if (op == BRANCH_IMM_NEAR) {
+		jump[0] = word & ~((uint32_t) 0x1ffff << 15) & ~(uint32_t) 0x7f;
+		ENCODE_OP(jump[0], BRANCH_IMM);
+		ENCODE_OFF(jump[0], DECODE_BRANCH_IMM(word));
+	} else if (op == BRANCH_NEAR) {
+		jump[0] = (word & ~((uint32_t) 0x1fff << 19) & ~(uint32_t) 0x7f) | BRANCH;
+	} else {
+		jump[0] = JUMP + DECODE_REG(word, 1);
+		if (jump[0] != JUMP) ENCODE_REG(jump[0], DECODE_REG(word, 0), 0);
+	}
+}
+
+// Turns jumps and branches to code with a distance fitting the offset field into their
+// near forms. With expand set, near forms turn back into the two word ones. newAddresses maps old to new
+// word indices. Patches of shortened jumps are dropped, near jumps and jumps with a
+// literal address are moved along with their targets, other patches, labels and line
+// ranges as in optimize_code. Literal addresses not pointing to an instruction and code
+// using pc keep the code as is.
+static ulang_bool resize_jumps(compiler_context *ctx, ulang_bool expand, uint32_t **newAddresses, size_t *numResized) {
+	size_t numWords = ctx->code.size >> 2;
+	*numResized = 0;
+	if (newAddresses) *newAddresses = NULL;
+
+	int32_t *patchOf = arena_alloc(&ctx->arena, sizeof(int32_t) * (numWords + 1));
+	uint8_t *isInstruction = arena_alloc(&ctx->arena, numWords + 1);
+	uint8_t *resize = arena_alloc(&ctx->arena, numWords + 1);
+	for (size_t i = 0; i <= numWords; i++) patchOf[i] = -1;
+	memset(isInstruction, 0, numWords + 1);
+	memset(resize, 0, numWords + 1);
+	for (size_t i = 0; i < ctx->patches.size; i++) patchOf[ctx->patches.items[i].patchAddress >> 2] = (int32_t) i;
+	for (size_t i = 0; i < numWords;) {
+		uint32_t word = code_word(ctx, i);
+		uint32_t op = DECODE_OP(word);
+		if (op >= NUM_OPCODES || (opcodes[op].hasValueOperand && i + 1 >= numWords)) return UL_TRUE;
+		if (instruction_uses_pc(&opcodes[op], word)) return UL_TRUE;
+		isInstruction[i] = UL_TRUE;
+		i += opcodes[op].hasValueOperand ? 2 : 1;
+	}
+	for (size_t i = 0; i < numWords; i++) {
+		if (!isInstruction[i]) continue;
+		uint32_t word = code_word(ctx, i);
+		uint32_t op = DECODE_OP(word);
+		if (is_near_jump(op)) {
+			int64_t target = (int64_t) i + near_jump_offset(word);
+			if (target < 0 || target >= (int64_t) numWords || !isInstruction[target]) return UL_TRUE;
+			resize[i] = expand;
+		} else if (has_target_value(op)) {
+			uint32_t target = code_word(ctx, i + 1);
+			ulang_bool toInstruction = !(target & 3) && target < ctx->code.size && isInstruction[target >> 2];
+			if (patchOf[i + 1] < 0 && !toInstruction) return UL_TRUE;
+			int64_t distance = (int64_t) (target >> 2) - (int64_t) i;
+			resize[i] = !expand && toInstruction && shorten_jump(word, distance);
+		}
+	}
+	for (size_t i = 0; i < numWords; i++) *numResized += resize[i] != 0;
+	if (!*numResized) return UL_TRUE;
+
+	uint32_t *newAddress = arena_alloc(&ctx->arena, sizeof(uint32_t) * (numWords + 1));
+	uint32_t size = 0;
+	for (size_t i = 0; i < numWords; i++) {
+		newAddress[i] = size;
+		if (resize[i] && !expand) newAddress[++i] = ++size;
+		else size += resize[i] ? 2 : 1;
+	}
+	newAddress[numWords] = size;
+	if (newAddresses) *newAddresses = newAddress;
+
+	uint8_t *code = arena_alloc(&ctx->arena, (size_t) size << 2);
+	for (size_t i = 0; i < numWords; i++) {
+		uint32_t word = code_word(ctx, i);
+		uint32_t op = DECODE_OP(word);
+		uint8_t *to = code + ((size_t) newAddress[i] << 2);
+		if (!isInstruction[i]) {
+			// Value words of jumps with literal addresses follow their targets
+			if (has_target_value(DECODE_OP(code_word(ctx, i - 1))) && patchOf[i] < 0) word = newAddress[word >> 2] << 2;
+			memcpy(to, &word, 4);
+		} else if (is_near_jump(op)) {
+			uint32_t target = newAddress[i + near_jump_offset(word)];
+			if (resize[i]) {
+				uint32_t jump[2];
+				expand_jump(word, target, jump);
+				memcpy(to, jump, 8);
+			} else {
+				word = set_near_jump_offset(word, (int32_t) (target - newAddress[i]));
+				memcpy(to, &word, 4);
+			}
+		} else if (resize[i]) {
+			uint32_t near = shorten_jump(word, (int64_t) newAddress[code_word(ctx, i + 1) >> 2] - newAddress[i]);
+			memcpy(to, &near, 4);
+			i++;
+		} else {
+			memcpy(to, &word, 4);
+		}
+	}
+
+	size_t numPatches = 0;
+	for (size_t i = 0; i < ctx->patches.size; i++) {
+		patch p = ctx->patches.items[i];
+		size_t index = p.patchAddress >> 2;
+		if (!expand && index && resize[index - 1]) continue;
+		p.patchAddress = (size_t) newAddress[index] << 2;
+		// Offsets are or'ed into the instruction, clear the one applied before
+		if (p.type == PT_OFFSET) {
+			uint32_t word;
+			memcpy(&word, code + p.patchAddress, 4);
+			word &= ~((uint32_t) 0x1fff << 19);
+			memcpy(code + p.patchAddress, &word, 4);
+		}
+		ctx->patches.items[numPatches++] = p;
+	}
+	ctx->patches.size = numPatches;
+
+	for (size_t i = 0; i < ctx->labels.size; i++) {
+		ulang_label *label = &ctx->labels.items[i];
+		if (label->target == UL_LT_CODE) label->address = (size_t) newAddress[label->address >> 2] << 2;
+	}
+	for (size_t i = 0; i < ctx->lineRanges.size; i++) ctx->lineRanges.items[i].address = newAddress[ctx->lineRanges.items[i].address];
+
+	ctx->code.size = 0;
+	byte_array_ensure(&ctx->code, (size_t) size << 2);
+	memcpy(ctx->code.items, code, (size_t) size << 2);
+	ctx->code.size = (size_t) size << 2;
+	for (size_t i = 0; i < ctx->patches.size; i++) {
+		patch *p = &ctx->patches.items[i];
+		if (!apply_patch(ctx, p->file, ctx->ops.items, p, ctx->code.items)) return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+// Jumps get shorter until none is left in reach, distances only shrink as they do.
+static ulang_bool shorten_jumps(compiler_context *ctx) {
+	size_t numResized;
+	do {
+		if (!resize_jumps(ctx, UL_FALSE, NULL, &numResized)) return UL_FALSE;
+	} while (numResized);
+	return UL_TRUE;
+}
+
+static int32_t hottest_successor(code_block *blocks, code_block *block) {
+	int32_t best = -1;
+	int32_t successors[] = {block->fallthrough, block->target};
+	for (int i = 0; i < 2; i++) {
+		int32_t successor = successors[i];
+		if (successor < 0 || blocks[successor].placed || !blocks[successor].count) continue;
+		if (best < 0 || blocks[successor].count > blocks[best].count) best = successor;
+	}
+	return best;
+}
+
+// Reorders the basic blocks of the code by the execution counts of a profile. Starting
+// with the entry block, the hottest successor of the last placed block follows it, or
+// the hottest block left if there is none. Blocks that never ran go to the end in
+// source order. A block not followed by its fall through successor anymore inverts its
+// conditional jump if that makes the next block its target, or gets a jump appended.
+// Jumps to the next block are dropped. Patches, labels and line ranges are moved along,
+// as in optimize_code, literal jump addresses follow their targets. Jumps into an
+// instruction keep the code as is. Near jumps are expanded first and have to be
+// shortened again after.
+static ulang_bool layout_code(compiler_context *ctx, ulang_profile *profile, size_t *numMoved) {
+	size_t numWords = ctx->code.size >> 2;
+	*numMoved = 0;
+	if (!numWords || profile->numWords != numWords || profile->codeHash != hash_string((const char *) ctx->code.items, ctx->code.size)) return UL_TRUE;
+
+	uint32_t *counts = profile->counts, *expandedAddress;
+	size_t numExpanded;
+	if (!resize_jumps(ctx, UL_TRUE, &expandedAddress, &numExpanded)) return UL_FALSE;
+	if (numExpanded) {
+		counts = arena_alloc(&ctx->arena, ctx->code.size);
+		memset(counts, 0, ctx->code.size);
+		for (size_t i = 0; i < numWords; i++) counts[expandedAddress[i]] = profile->counts[i];
+		numWords = ctx->code.size >> 2;
+	}
+
+	uint8_t *isInstruction = arena_alloc(&ctx->arena, numWords + 1);
+	uint8_t *isStart = arena_alloc(&ctx->arena, numWords + 1);
+	int32_t *patchOf = arena_alloc(&ctx->arena, sizeof(int32_t) * (numWords + 1));
+	memset(isInstruction, 0, numWords + 1);
+	memset(isStart, 0, numWords + 1);
+	for (size_t i = 0; i <= numWords; i++) patchOf[i] = -1;
+	for (size_t i = 0; i < ctx->patches.size; i++) patchOf[ctx->patches.items[i].patchAddress >> 2] = (int32_t) i;
+
+	isStart[0] = UL_TRUE;
+	for (size_t i = 0; i < ctx->labels.size; i++) {
+		ulang_label *label = &ctx->labels.items[i];
+		if (label->target == UL_LT_CODE) isStart[label->address >> 2] = UL_TRUE;
+	}
+	for (size_t i = 0; i < numWords;) {
+		uint32_t op = DECODE_OP(code_word(ctx, i));
+		if (op >= NUM_OPCODES || (opcodes[op].hasValueOperand && i + 1 >= numWords)) return UL_TRUE;
+		isInstruction[i] = UL_TRUE;
+		size_t length = opcodes[op].hasValueOperand ? 2 : 1;
+		if (has_target_value(op)) {
+			uint32_t target = code_word(ctx, i + 1);
+			if ((target & 3) || (patchOf[i + 1] < 0 && (target >> 2) >= numWords)) return UL_TRUE;
+			// Literal call targets start a block too, so they are known to be instructions
+			if ((target >> 2) < numWords && ((op != CALL_VAL && op != TAIL_CALL) || patchOf[i + 1] < 0)) isStart[target >> 2] = UL_TRUE;
+		}
+		if (is_conditional_jump(op) || !falls_through(op)) isStart[i + length] = UL_TRUE;
+		i += length;
+	}
+	for (size_t i = 0; i < numWords; i++) {
+		if (isStart[i] && !isInstruction[i]) return UL_TRUE;
+	}
+
+	size_t numBlocks = 0;
+	for (size_t i = 0; i < numWords; i++) numBlocks += isStart[i] != 0;
+	if (numBlocks < 2) return UL_TRUE;
+	code_block *blocks = arena_alloc(&ctx->arena, sizeof(code_block) * numBlocks);
+	int32_t *blockOf = arena_alloc(&ctx->arena, sizeof(int32_t) * (numWords + 1));
+	memset(blocks, 0, sizeof(code_block) * numBlocks);
+	for (size_t i = 0, block = 0; i < numWords; i++) {
+		if (isStart[i] && i) block++;
+		if (isStart[i]) blocks[block].start = (uint32_t) i;
+		if (isInstruction[i]) blocks[block].last = (uint32_t) i;
+		blocks[block].end = (uint32_t) i + 1;
+		blockOf[i] = (int32_t) block;
+	}
+	blockOf[numWords] = -1;
+	for (size_t i = 0; i < numBlocks; i++) {
+		code_block *block = &blocks[i];
+		uint32_t op = DECODE_OP(code_word(ctx, block->last));
+		block->count = counts[block->start];
+		block->fallthrough = !falls_through(op) || i + 1 == numBlocks ? -1 : (int32_t) i + 1;
+		block->target = -1;
+		block->appendJump = -1;
+		if (op == JUMP || is_conditional_jump(op)) {
+			uint32_t target = code_word(ctx, block->last + 1) >> 2;
+			block->target = target < numWords ? blockOf[target] : -1;
+		}
+	}
+	// A last block running off the end of the code has to stay last
+	code_block *lastBlock = &blocks[numBlocks - 1];
+	uint32_t lastOp = DECODE_OP(code_word(ctx, lastBlock->last));
+	ulang_bool pinLast = falls_through(lastOp);
+
+	int32_t *order = arena_alloc(&ctx->arena, sizeof(int32_t) * numBlocks);
+	size_t numPlaced = 0;
+	lastBlock->placed = pinLast;
+	for (int32_t current = 0; current >= 0;) {
+		blocks[current].placed = UL_TRUE;
+		order[numPlaced++] = current;
+		int32_t next = hottest_successor(blocks, &blocks[current]);
+		if (next < 0) {
+			for (size_t i = 0; i < numBlocks; i++) {
+				if (blocks[i].placed || !blocks[i].count) continue;
+				if (next < 0 || blocks[i].count > blocks[next].count) next = (int32_t) i;
 			}
-			if (!emit_op(file, fittingOp, operands, operandExpressions, &ctx->patches, &ctx->code, error)) return UL_FALSE;
 		}
+		current = next;
+	}
+	for (size_t i = 0; i < numBlocks; i++) {
+		if (!blocks[i].placed) order[numPlaced++] = (int32_t) i;
+	}
+	if (pinLast) order[numPlaced++] = (int32_t) numBlocks - 1;
+	for (size_t i = 0; i < numBlocks; i++) *numMoved += order[i] != (int32_t) i;
+	if (!*numMoved) return UL_TRUE;
+
+	uint32_t size = 0;
+	for (size_t i = 0; i < numBlocks; i++) {
+		code_block *block = &blocks[order[i]];
+		int32_t next = i + 1 < numBlocks ? order[i + 1] : -1;
+		uint32_t op = DECODE_OP(code_word(ctx, block->last));
+		if (op == JUMP && block->target >= 0 && block->target == next && code_word(ctx, block->last + 1) == blocks[next].start << 2) {
+			block->dropJump = UL_TRUE;
+		} else if (block->fallthrough >= 0 && block->fallthrough != next) {
+			if (is_conditional_jump(op) && block->target == next && code_word(ctx, block->last + 1) == blocks[next].start << 2) block->invertJump = UL_TRUE;
+			else block->appendJump = block->fallthrough;
+		}
+		block->newStart = size;
+		size += block->end - block->start - (block->dropJump ? 2 : 0) + (block->appendJump >= 0 ? 2 : 0);
+		block->newEnd = size;
+	}
+
+	uint32_t *newAddress = arena_alloc(&ctx->arena, sizeof(uint32_t) * (numWords + 1));
+	uint32_t *source = arena_alloc(&ctx->arena, sizeof(uint32_t) * (size + 1));
+	uint8_t *code = arena_alloc(&ctx->arena, (size_t) size << 2);
+	for (size_t i = 0; i < numBlocks; i++) {
+		code_block *block = &blocks[i];
+		uint32_t length = block->end - block->start - (block->dropJump ? 2 : 0);
+		memcpy(code + ((size_t) block->newStart << 2), ctx->code.items + ((size_t) block->start << 2), (size_t) length << 2);
+		for (uint32_t j = 0; j < block->end - block->start; j++) newAddress[block->start + j] = block->newStart + MIN(j, length);
+		for (uint32_t j = 0; j < block->newEnd - block->newStart; j++) source[block->newStart + j] = block->start + MIN(j, length ? length - 1 : 0);
+		uint32_t last = block->newStart + (block->last - block->start);
+		if (block->invertJump) {
+			uint32_t word;
+			memcpy(&word, code + ((size_t) last << 2), 4);
+			word = invert_jump(word);
+			memcpy(code + ((size_t) last << 2), &word, 4);
+			uint32_t target = blocks[block->fallthrough].newStart << 2;
+			memcpy(code + (((size_t) last + 1) << 2), &target, 4);
+		}
+		if (block->appendJump >= 0) {
+			uint32_t jump[2] = {JUMP, blocks[block->appendJump].newStart << 2};
+			memcpy(code + (((size_t) block->newEnd - 2) << 2), jump, 8);
+			source[block->newEnd - 2] = source[block->newEnd - 1] = block->last;
+		}
+	}
+	newAddress[numWords] = size;
+
+	// Literal addresses follow the instructions they point to
+	for (size_t i = 0; i < numWords; i++) {
+		if (!isInstruction[i] || !has_target_value(DECODE_OP(code_word(ctx, i))) || patchOf[i + 1] >= 0) continue;
+		code_block *block = &blocks[blockOf[i]];
+		if ((block->dropJump || block->invertJump) && i == block->last) continue;
+		uint32_t target = newAddress[code_word(ctx, i + 1) >> 2] << 2;
+		memcpy(code + ((size_t) newAddress[i + 1] << 2), &target, 4);
+	}
+
+	// Jumps dropped or inverted don't go where their patches say anymore
+	size_t numPatches = 0;
+	for (size_t i = 0; i < ctx->patches.size; i++) {
+		patch p = ctx->patches.items[i];
+		code_block *block = &blocks[blockOf[p.patchAddress >> 2]];
+		if ((block->dropJump || block->invertJump) && (p.patchAddress >> 2) == block->last + 1) continue;
+		p.patchAddress = (size_t) newAddress[p.patchAddress >> 2] << 2;
+		if (p.type == PT_OFFSET) {
+			uint32_t word;
+			memcpy(&word, code + p.patchAddress, 4);
+			word &= ~((uint32_t) 0x1fff << 19);
+			memcpy(code + p.patchAddress, &word, 4);
+		}
+		ctx->patches.items[numPatches++] = p;
+	}
+	ctx->patches.size = numPatches;
+
+	for (size_t i = 0; i < ctx->labels.size; i++) {
+		ulang_label *label = &ctx->labels.items[i];
+		if (label->target == UL_LT_CODE) label->address = (size_t) newAddress[label->address >> 2] << 2;
+	}
+
+	if (ctx->lineRanges.size) {
+		ulang_line_range *lines = arena_alloc(&ctx->arena, sizeof(ulang_line_range) * numWords);
+		for (size_t i = 0, range = 0; i < numWords; i++) {
+			while (range + 1 < ctx->lineRanges.size && ctx->lineRanges.items[range + 1].address <= i) range++;
+			lines[i] = ctx->lineRanges.items[range];
+		}
+		ctx->lineRanges.size = 0;
+		for (uint32_t i = 0; i < size; i++) {
+			ulang_line_range range = lines[source[i]];
+			range.address = i;
+			ulang_line_range *last = ctx->lineRanges.size ? &ctx->lineRanges.items[ctx->lineRanges.size - 1] : NULL;
+			if (last && last->file == range.file && last->line == range.line) continue;
+			line_range_array_add(&ctx->lineRanges, range);
+		}
+	}
+
+	ctx->code.size = 0;
+	byte_array_ensure(&ctx->code, (size_t) size << 2);
+	memcpy(ctx->code.items, code, (size_t) size << 2);
+	ctx->code.size = (size_t) size << 2;
+	for (size_t i = 0; i < ctx->patches.size; i++) {
+		patch *p = &ctx->patches.items[i];
+		if (!apply_patch(ctx, p->file, ctx->ops.items, p, ctx->code.items)) return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+static ulang_bool compile(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator, ulang_compile_cache *cache, ulang_compile_profile *profile, ulang_compile_options *options) {
+	if (!allocator) allocator = &defaultAllocator;
+	compiler_context ctx = { .error = error, .cache = cache, .profile = profile };
+	ulang_file *file = allocator_calloc(allocator, sizeof(ulang_file));
+	uint64_t start = profile_now(&ctx);
+	ulang_bool read = fileReadFunction(filename, file);
+	if (profile) profile->fileRead += profile_now(&ctx) - start;
+	if (!read) {
+		ulang_allocator_free(allocator, file);
+		ulang_error_init(error, NULL, NULL, "Couldn't read file %s\n", filename);
+		return UL_FALSE;
+	}
+
+	error->is_set = UL_FALSE;
+	init_opcodes_and_registers();
+
+	ctx.arena.allocator = allocator;
+
+	// All transient compiler state lives in the arena, only the final
+	// program buffers are copied out of it.
+	file_array_init_arena(&ctx.files, &ctx.arena, 16);
+	token_array_init_arena(&ctx.tokens, &ctx.arena, 200);
+	patch_array_init_arena(&ctx.patches, &ctx.arena, 16);
+	expression_op_array_init_arena(&ctx.ops, &ctx.arena, 16);
+	label_array_init_arena(&ctx.labels, &ctx.arena, 16);
+	constant_array_init_arena(&ctx.constants, &ctx.arena, 16);
+	byte_array_init_arena(&ctx.code, &ctx.arena, 16);
+	byte_array_init_arena(&ctx.data, &ctx.arena, 16);
+	line_range_array_init_arena(&ctx.lineRanges, &ctx.arena, 16);
+	ctx.labelTable.arena = &ctx.arena;
+	ctx.constantTable.arena = &ctx.arena;
+
+	file_array_add(&ctx.files, file);
+
+	// Assemble each file into its own unit, then link them into the program
+	compile_unit *unit = ctx.cache ? cache_reuse_unit(&ctx, file, fileReadFunction) : NULL;
+	if (!unit) {
+		unit = compile_unit_new(&ctx, file);
+		start = profile_now(&ctx);
+		uint64_t nested = profile ? profile->fileRead + profile->tokenize : 0;
+		if (!ulang_compile_file(&ctx, unit, fileReadFunction, error)) goto _compilation_error;
+		if (profile) profile->assemble += profile_now(&ctx) - start - (profile->fileRead + profile->tokenize - nested);
+	}
+	start = profile_now(&ctx);
+	int_array pendingLabels;
+	int_array_init_arena(&pendingLabels, &ctx.arena, 16);
+	if (!link_unit(&ctx, unit, &pendingLabels)) goto _compilation_error;
+
+	value_array_init_arena(&ctx.stack, &ctx.arena, 16);
+	for (size_t i = 0; i < ctx.patches.size; i++) {
+		patch *p = &ctx.patches.items[i];
+		if (!apply_patch(&ctx, p->file, ctx.ops.items, p, ctx.code.items)) goto _compilation_error;
+	}
+	if (profile) profile->link += profile_now(&ctx) - start;
+	if (options && options->optimize && !optimize_code(&ctx, &options->numRemovedInstructions)) goto _compilation_error;
+	ulang_bool longJumps = options && options->longJumps;
+	if (!longJumps && !shorten_jumps(&ctx)) goto _compilation_error;
+	if (options && options->layoutProfile) {
+		ulang_profile layoutProfile;
+		if (!ulang_profile_load(&layoutProfile, options->layoutProfile, error)) goto _compilation_error;
+		ulang_bool laidOut = layout_code(&ctx, &layoutProfile, &options->numMovedBlocks) && (longJumps || shorten_jumps(&ctx));
+		ulang_profile_free(&layoutProfile);
+		if (!laidOut) goto _compilation_error;
+	}
+
+	program->code = copy_out(ctx.arena.allocator, ctx.code.items, ctx.code.size);
+	program->codeLength = ctx.code.size;
+	program->data = copy_out(ctx.arena.allocator, ctx.data.items, ctx.data.size);
+	program->dataLength = ctx.data.size;
+	program->reservedBytes = ctx.numReservedBytes;
+	program->labels = copy_out(ctx.arena.allocator, ctx.labels.items, sizeof(ulang_label) * ctx.labels.size);
+	program->labelsLength = ctx.labels.size;
+	program->labelTable = copy_out(ctx.arena.allocator, ctx.labelTable.slots, sizeof(uint32_t) * ctx.labelTable.numSlots);
+	program->labelTableLength = ctx.labelTable.numSlots;
+	program->constants = copy_out(ctx.arena.allocator, ctx.constants.items, sizeof(ulang_constant) * ctx.constants.size);
+	program->constantsLength = ctx.constants.size;
+	program->files = copy_out(ctx.arena.allocator, ctx.files.items, sizeof(ulang_file *) * ctx.files.size);
+	program->filesLength = ctx.files.size;
+	program->lineRanges = copy_out(ctx.arena.allocator, ctx.lineRanges.items, sizeof(ulang_line_range) * ctx.lineRanges.size);
+	program->lineRangesLength = ctx.lineRanges.size;
+	program->allocator = allocator;
+	if (ctx.cache) ctx.cache->rawIncludes = ctx.rawIncludes;
+	if (ctx.cache && !ctx.rawIncludes) cache_store_unit(&ctx, unit);
+	arena_free(&ctx.arena);
+	return UL_TRUE;
+
+	_compilation_error:
+	for (int i = 0; i < (int)ctx.files.size; i++) {
+		ulang_file_free(ctx.files.items[i]);
+		ulang_allocator_free(allocator, ctx.files.items[i]);
+	}
+	arena_free(&ctx.arena);
+	return UL_FALSE;
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile(const char* filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator) {
+	return compile(filename, fileReadFunction, program, error, allocator, NULL, NULL, NULL);
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_with_options(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator, ulang_compile_options *options) {
+	return compile(filename, fileReadFunction, program, error, allocator, NULL, NULL, options);
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_profiled(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator, ulang_compile_profile *profile) {
+	return compile(filename, fileReadFunction, program, error, allocator, NULL, profile, NULL);
+}
+
+static void *copy_out_to(ulang_allocator *allocator, void *items, size_t numBytes) {
+	return items ? copy_out(allocator, items, numBytes) : NULL;
+}
+
+// Moves the pointer into the file contents in from[i] to the same offset in to[i].
+static char *rebase_span_data(char *data, char **from, size_t *fromLengths, char **to, size_t numFiles) {
+	for (size_t i = 0; i < numFiles; i++) {
+		if (data >= from[i] && data < from[i] + fromLengths[i]) return to[i] + (data - from[i]);
+	}
+	return data;
+}
+
+static void rebase_symbols(ulang_program *program, char **from, size_t *fromLengths, char **to, size_t numFiles) {
+	for (size_t i = 0; i < program->labelsLength; i++) {
+		ulang_string *name = &program->labels[i].label.data;
+		name->data = rebase_span_data(name->data, from, fromLengths, to, numFiles);
+	}
+	for (size_t i = 0; i < program->constantsLength; i++) {
+		ulang_string *name = &program->constants[i].name.data;
+		name->data = rebase_span_data(name->data, from, fromLengths, to, numFiles);
+	}
+}
+
+static void copy_program_tables(ulang_program *program, ulang_program *source, ulang_allocator *allocator) {
+	program->code = copy_out_to(allocator, source->code, source->codeLength);
+	program->codeLength = source->codeLength;
+	program->data = copy_out_to(allocator, source->data, source->dataLength);
+	program->dataLength = source->dataLength;
+	program->reservedBytes = source->reservedBytes;
+	program->labels = copy_out_to(allocator, source->labels, sizeof(ulang_label) * source->labelsLength);
+	program->labelsLength = source->labelsLength;
+	program->labelTable = copy_out_to(allocator, source->labelTable, sizeof(uint32_t) * source->labelTableLength);
+	program->labelTableLength = source->labelTableLength;
+	program->constants = copy_out_to(allocator, source->constants, sizeof(ulang_constant) * source->constantsLength);
+	program->constantsLength = source->constantsLength;
+	program->lineRanges = copy_out_to(allocator, source->lineRanges, sizeof(ulang_line_range) * source->lineRangesLength);
+	program->lineRangesLength = source->lineRangesLength;
+	program->allocator = allocator;
+}
+
+static void cache_drop_program(ulang_compile_cache *cache) {
+	if (!cache->hasProgram) return;
+	ulang_allocator *allocator = cache->allocator;
+	ulang_allocator_free(allocator, cache->program.code);
+	ulang_allocator_free(allocator, cache->program.data);
+	ulang_allocator_free(allocator, cache->program.labels);
+	ulang_allocator_free(allocator, cache->program.labelTable);
+	ulang_allocator_free(allocator, cache->program.constants);
+	ulang_allocator_free(allocator, cache->program.lineRanges);
+	ulang_allocator_free(allocator, cache->programFiles);
+	memset(&cache->program, 0, sizeof(ulang_program));
+	cache->programFiles = NULL;
+	cache->hasProgram = UL_FALSE;
+}
+
+// Rereads all files of the cached program and hands out a copy of it if none
+// of them changed. Reading the same files in the same order also means the
+// include graph is unchanged.
+static ulang_bool cache_reuse_program(ulang_compile_cache *cache, const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program) {
+	ulang_allocator *allocator = cache->allocator;
+	size_t numFiles = cache->program.filesLength;
+	if (strcmp(cache->files[cache->programFiles[0]].fileName, filename) != 0) return UL_FALSE;
+
+	ulang_file **files = allocator_calloc(allocator, sizeof(ulang_file *) * numFiles);
+	char **from = ulang_allocator_alloc(allocator, sizeof(char *) * numFiles);
+	size_t *fromLengths = ulang_allocator_alloc(allocator, sizeof(size_t) * numFiles);
+	char **to = ulang_allocator_alloc(allocator, sizeof(char *) * numFiles);
+	ulang_bool matches = UL_TRUE;
+	for (size_t i = 0; i < numFiles && matches; i++) {
+		cached_file *entry = &cache->files[cache->programFiles[i]];
+		files[i] = allocator_calloc(allocator, sizeof(ulang_file));
+		matches = fileReadFunction(entry->fileName, files[i]) && cached_file_matches(entry, files[i]);
+		from[i] = entry->data;
+		fromLengths[i] = entry->length;
+		to[i] = files[i]->data;
+		entry->generation = cache->generation;
+	}
+
+	if (matches) {
+		copy_program_tables(program, &cache->program, allocator);
+		rebase_symbols(program, from, fromLengths, to, numFiles);
+		program->files = files;
+		program->filesLength = numFiles;
+	} else {
+		for (size_t i = 0; i < numFiles; i++) {
+			if (!files[i]) continue;
+			if (files[i]->data) ulang_file_free(files[i]);
+			ulang_allocator_free(allocator, files[i]);
+		}
+		ulang_allocator_free(allocator, files);
 	}
-	return UL_TRUE;
+	ulang_allocator_free(allocator, from);
+	ulang_allocator_free(allocator, fromLengths);
+	ulang_allocator_free(allocator, to);
+	return matches;
 }
 
-EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile(const char* filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error) {
-	ulang_file *file = ulang_calloc(sizeof(ulang_file));
-	if (!fileReadFunction(filename, file)) {
-		ulang_free(file);
-		ulang_error_init(error, NULL, NULL, "Couldn't read file %s\n", filename);
+static void cache_store_program(ulang_compile_cache *cache, ulang_program *program) {
+	ulang_allocator *allocator = cache->allocator;
+	size_t numFiles = program->filesLength;
+	char **from = ulang_allocator_alloc(allocator, sizeof(char *) * numFiles);
+	size_t *fromLengths = ulang_allocator_alloc(allocator, sizeof(size_t) * numFiles);
+	char **to = ulang_allocator_alloc(allocator, sizeof(char *) * numFiles);
+	cache->programFiles = ulang_allocator_alloc(allocator, sizeof(uint32_t) * numFiles);
+	for (size_t i = 0; i < numFiles; i++) {
+		cache->programFiles[i] = (uint32_t) cache_find_file(cache, program->files[i]->fileName.data);
+		from[i] = program->files[i]->data;
+		fromLengths[i] = program->files[i]->length;
+		to[i] = cache->files[cache->programFiles[i]].data;
+	}
+
+	copy_program_tables(&cache->program, program, allocator);
+	cache->program.filesLength = numFiles;
+	rebase_symbols(&cache->program, from, fromLengths, to, numFiles);
+	cache->hasProgram = UL_TRUE;
+	ulang_allocator_free(allocator, from);
+	ulang_allocator_free(allocator, fromLengths);
+	ulang_allocator_free(allocator, to);
+}
+
+// Removes files that weren't part of the last compile.
+static void cache_evict_files(ulang_compile_cache *cache) {
+	size_t numFiles = 0;
+	for (size_t i = 0; i < cache->numFiles; i++) {
+		if (cache->files[i].generation != cache->generation) cached_file_free(cache, &cache->files[i]);
+		else cache->files[numFiles++] = cache->files[i];
+	}
+	cache->numFiles = numFiles;
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_compile_cache *ulang_compile_cache_new(ulang_allocator *allocator) {
+	if (!allocator) allocator = &defaultAllocator;
+	ulang_compile_cache *cache = allocator_calloc(allocator, sizeof(ulang_compile_cache));
+	cache->allocator = allocator;
+	return cache;
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_cached(ulang_compile_cache *cache, const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error) {
+	cache->generation++;
+	if (cache->hasProgram && cache_reuse_program(cache, filename, fileReadFunction, program)) {
+		error->is_set = UL_FALSE;
+		cache->stats.programHits++;
+		return UL_TRUE;
+	}
+	cache->stats.programMisses++;
+
+	// Files of the cached program are about to be replaced, drop it first
+	cache_drop_program(cache);
+	ulang_bool result = compile(filename, fileReadFunction, program, error, cache->allocator, cache, NULL, NULL);
+	if (result) {
+		cache_evict_files(cache);
+		if (!cache->rawIncludes) cache_store_program(cache, program);
+	}
+	return result;
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_compile_cache_get_stats(ulang_compile_cache *cache, ulang_compile_cache_stats *stats) {
+	*stats = cache->stats;
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_compile_cache_free(ulang_compile_cache *cache) {
+	cache_drop_program(cache);
+	for (size_t i = 0; i < cache->numFiles; i++)
+		cached_file_free(cache, &cache->files[i]);
+	ulang_allocator_free(cache->allocator, cache->files);
+	ulang_allocator_free(cache->allocator, cache);
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_label *ulang_program_get_label(ulang_program *program, const char *name, size_t length) {
+	ulang_string needle = {(char *) name, (uint32_t) length};
+	int32_t index = symbol_table_find(program->labelTable, program->labelTableLength, program->labels, label_name, &needle);
+	return index < 0 ? NULL : &program->labels[index];
+}
+
+EMSCRIPTEN_KEEPALIVE uint32_t ulang_program_get_line(ulang_program *program, uint32_t address, ulang_file **file) {
+	if (file) *file = NULL;
+	if (!program->lineRangesLength || address < program->lineRanges[0].address || address >= program->codeLength >> 2) return 0;
+	size_t low = 0, high = program->lineRangesLength;
+	while (high - low > 1) {
+		size_t mid = low + (high - low) / 2;
+		if (program->lineRanges[mid].address <= address) low = mid;
+		else high = mid;
+	}
+	ulang_line_range *range = &program->lineRanges[low];
+	if (range->file >= program->filesLength) return 0;
+	if (file) *file = program->files[range->file];
+	return range->line;
+}
+
+// Files of loaded images are copied out with the program's allocator, files of compiled
+// programs are read with ulang_alloc.
+static void program_files_free(ulang_program *program, ulang_allocator *allocator) {
+	for (size_t i = 0; i < program->filesLength; i++) {
+		ulang_file *file = program->files[i];
+		if (program->image) {
+			ulang_allocator_free(allocator, file->fileName.data);
+			ulang_allocator_free(allocator, file->data);
+			file->fileName.data = NULL;
+			file->data = NULL;
+		}
+		ulang_file_free(file);
+		ulang_allocator_free(allocator, file);
+	}
+	ulang_allocator_free(allocator, program->files);
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_program_strip(ulang_program *program) {
+	ulang_allocator *allocator = program->allocator ? program->allocator : &defaultAllocator;
+	// Names of compiled programs point into the files, they move to a block of their own
+	if (!program->image && !program->symbolNames) {
+		size_t length = 0;
+		for (size_t i = 0; i < program->labelsLength; i++) length += program->labels[i].label.data.length;
+		for (size_t i = 0; i < program->constantsLength; i++) length += program->constants[i].name.data.length;
+		char *names = program->symbolNames = ulang_allocator_alloc(allocator, length + 1);
+		for (size_t i = 0; i < program->labelsLength; i++) {
+			ulang_string *name = &program->labels[i].label.data;
+			memcpy(names, name->data, name->length);
+			name->data = names;
+			names += name->length;
+		}
+		for (size_t i = 0; i < program->constantsLength; i++) {
+			ulang_string *name = &program->constants[i].name.data;
+			memcpy(names, name->data, name->length);
+			name->data = names;
+			names += name->length;
+		}
+	}
+	program_files_free(program, allocator);
+	program->files = NULL;
+	program->filesLength = 0;
+	if (!program->image) ulang_allocator_free(allocator, program->lineRanges);
+	program->lineRanges = NULL;
+	program->lineRangesLength = 0;
+}
+
+#define ULB_MAGIC 0x00424c55
+#define ULB_VERSION 2
+#define ULB_PAD(numBytes) (((numBytes) + 3) & ~(uint64_t) 3)
+
+// Binary program image (.ulb). The header is followed by the code, data, label table,
+// line ranges, label, constant and file records and the string table,
+// each padded to 4 bytes. Code, data and the tables are used in place when the
+// image is loaded, labels, constants and files are rebuilt from their records.
+typedef struct ulb_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t codeLength;
+	uint32_t dataLength;
+	uint32_t reservedBytes;
+	uint32_t labelsLength;
+	uint32_t constantsLength;
+	uint32_t labelTableLength;
+	uint32_t filesLength;
+	uint32_t lineRangesLength;
+	uint32_t stringsLength;
+} ulb_header;
+
+typedef struct ulb_symbol {
+	uint32_t name;
+	uint32_t nameLength;
+	uint32_t startLine;
+	uint32_t endLine;
+	uint32_t type;
+	uint32_t value;
+} ulb_symbol;
+
+typedef struct ulb_file {
+	uint32_t name;
+	uint32_t nameLength;
+	uint32_t data;
+	uint32_t dataLength;
+} ulb_file;
+
+static void ulb_add(byte_array *image, const void *data, size_t numBytes) {
+	size_t padded = ULB_PAD(numBytes);
+	byte_array_ensure(image, padded);
+	if (numBytes) memcpy(image->items + image->size, data, numBytes);
+	memset(image->items + image->size + numBytes, 0, padded - numBytes);
+	image->size += padded;
+}
+
+static uint32_t ulb_add_string(byte_array *strings, const char *str, size_t length) {
+	uint32_t offset = (uint32_t) strings->size;
+	byte_array_ensure(strings, length + 1);
+	if (length) memcpy(strings->items + strings->size, str, length);
+	strings->items[strings->size + length] = 0;
+	strings->size += length + 1;
+	return offset;
+}
+
+static void ulb_add_symbols(byte_array *image, byte_array *strings, ulang_label *labels, size_t numLabels, ulang_constant *constants, size_t numConstants) {
+	for (size_t i = 0; i < numLabels; i++) {
+		ulang_label *label = &labels[i];
+		ulb_symbol symbol = {ulb_add_string(strings, label->label.data.data, label->label.data.length), label->label.data.length,
+							 label->label.startLine, label->label.endLine, label->target, (uint32_t) label->address};
+		ulb_add(image, &symbol, sizeof(ulb_symbol));
+	}
+	for (size_t i = 0; i < numConstants; i++) {
+		ulang_constant *constant = &constants[i];
+		ulb_symbol symbol = {ulb_add_string(strings, constant->name.data.data, constant->name.data.length), constant->name.data.length,
+							 constant->name.startLine, constant->name.endLine, constant->type, 0};
+		memcpy(&symbol.value, &constant->i, sizeof(uint32_t));
+		ulb_add(image, &symbol, sizeof(ulb_symbol));
+	}
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_program_save(ulang_program *program, const char *fileName, ulang_bool debugInfo, ulang_error *error) {
+	size_t numFiles = debugInfo ? program->filesLength : 0;
+	size_t numLineRanges = debugInfo ? program->lineRangesLength : 0;
+	ulb_header header = {ULB_MAGIC, ULB_VERSION, (uint32_t) program->codeLength, (uint32_t) program->dataLength,
+						 (uint32_t) program->reservedBytes, (uint32_t) program->labelsLength, (uint32_t) program->constantsLength,
+						 (uint32_t) program->labelTableLength, (uint32_t) numFiles, (uint32_t) numLineRanges, 0};
+	byte_array image, strings;
+	byte_array_init_inplace(&image, 1024);
+	byte_array_init_inplace(&strings, 256);
+
+	ulb_add(&image, &header, sizeof(ulb_header));
+	ulb_add(&image, program->code, program->codeLength);
+	ulb_add(&image, program->data, program->dataLength);
+	ulb_add(&image, program->labelTable, sizeof(uint32_t) * program->labelTableLength);
+	ulb_add(&image, program->lineRanges, sizeof(ulang_line_range) * numLineRanges);
+	ulb_add_symbols(&image, &strings, program->labels, program->labelsLength, program->constants, program->constantsLength);
+	for (size_t i = 0; i < numFiles; i++) {
+		ulang_file *file = program->files[i];
+		ulb_file record = {ulb_add_string(&strings, file->fileName.data, file->fileName.length), file->fileName.length, 0, (uint32_t) file->length};
+		record.data = ulb_add_string(&strings, file->data, file->length);
+		ulb_add(&image, &record, sizeof(ulb_file));
+	}
+	header.stringsLength = (uint32_t) strings.size;
+	ulb_add(&image, strings.items, strings.size);
+	memcpy(image.items, &header, sizeof(ulb_header));
+
+	ulang_bool result = UL_FALSE;
+	FILE *stream = fopen(fileName, "wb");
+	if (stream) {
+		result = fwrite(image.items, 1, image.size, stream) == image.size;
+		result = fclose(stream) == 0 && result ? UL_TRUE : UL_FALSE;
+	}
+	if (!result) ulang_error_init(error, NULL, NULL, "Couldn't write file %s", fileName);
+	byte_array_free_inplace(&image);
+	byte_array_free_inplace(&strings);
+	return result;
+}
+
+static ulang_bool stream_pass(compiler_context *ctx, compile_unit *unit, const char *fileName) {
+	if (!stream_compile_file(ctx, unit, fileName)) {
+		if (!ctx->error->is_set) ulang_error_init(ctx->error, NULL, NULL, "Couldn't read file %s\n", fileName);
 		return UL_FALSE;
 	}
+	return stream_flush(ctx, unit);
+}
 
+// Compiles a program straight to an image without debug info, reading its files from
+// disk a window at a time. Memory stays bounded by the labels and constants plus a
+// window per open file. A first pass lays out the program, the second assembles it
+// again with all labels known and writes code and data to the image as it goes.
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_compile_to_image(const char *filename, const char *imageFileName, ulang_error *error, ulang_allocator *allocator) {
+	if (!allocator) allocator = &defaultAllocator;
 	error->is_set = UL_FALSE;
 	init_opcodes_and_registers();
 
-	compiler_context ctx = { .error = error };
-	ctx.resolveLabelsInExpressions = UL_FALSE;
+	stream_output output = {1, imageFileName};
+	output.visibleConstants = UINT32_MAX;
+	compiler_context ctx = { .error = error, .output = &output };
+	ctx.arena.allocator = allocator;
+	file_array_init_arena(&ctx.files, &ctx.arena, 16);
+	token_array_init_arena(&ctx.tokens, &ctx.arena, 200);
+	label_array_init_arena(&ctx.labels, &ctx.arena, 16);
+	constant_array_init_arena(&ctx.constants, &ctx.arena, 16);
+	value_array_init_arena(&ctx.stack, &ctx.arena, 16);
+	ctx.labelTable.arena = &ctx.arena;
+	ctx.constantTable.arena = &ctx.arena;
+
+	compile_unit *layout = compile_unit_new(&ctx, NULL);
+	if (!stream_pass(&ctx, layout, filename)) goto _compilation_error;
+	size_t codeLength = layout->codeBase, dataLength = layout->dataBase;
+
+	// Expressions of the second pass resolve labels to their address in the program
+	for (size_t i = 0; i < layout->labels.size; i++) {
+		ulang_label label = layout->labels.items[i];
+		if (label.target != UL_LT_UNINITIALIZED) {
+			label.address += label_section_base(label.target, 0, codeLength, codeLength + dataLength);
+			label.target = UL_LT_CODE;
+		}
+		label_array_add(&ctx.labels, label);
+	}
+	ctx.labelTable = layout->labelTable;
 
-	file_array_init_inplace(&ctx.files, 16);
-	token_array_init_inplace(&ctx.tokens, 200);
-	patch_array_init_inplace(&ctx.patches, 16);
-	label_array_init_inplace(&ctx.labels, 16);
-	constant_array_init_inplace(&ctx.constants, 16);
-	byte_array_init_inplace(&ctx.code, 16);
-	byte_array_init_inplace(&ctx.data, 16);
-	int_array_init_inplace(&ctx.addressToLine, 16);
-	file_array_init_inplace(&ctx.addressToFile, 16);
+	output.image = fopen(imageFileName, "wb");
+	if (!output.image) {
+		ulang_error_init(error, NULL, NULL, "Couldn't write file %s", imageFileName);
+		goto _compilation_error;
+	}
+	output.pass = 2;
+	output.visibleConstants = 0;
+	output.codeOffset = ULB_PAD(sizeof(ulb_header));
+	output.dataOffset = output.codeOffset + ULB_PAD(codeLength);
+	ctx.files.size = 0;
+	compile_unit *unit = compile_unit_new(&ctx, NULL);
+	if (!stream_pass(&ctx, unit, filename)) goto _compilation_error;
+	if (unit->codeBase != codeLength || unit->dataBase != dataLength) {
+		ulang_error_init(error, NULL, NULL, "Internal error: Passes of the streaming compile disagree on the layout.");
+		goto _compilation_error;
+	}
 
-	file_array_add(&ctx.files, file);
+	ulb_header header = {ULB_MAGIC, ULB_VERSION, (uint32_t) codeLength, (uint32_t) dataLength, (uint32_t) layout->numReservedBytes,
+						 (uint32_t) layout->labels.size, (uint32_t) ctx.constants.size, (uint32_t) layout->labelTable.numSlots, 0, 0, 0};
+	byte_array tail, strings;
+	byte_array_init_arena(&tail, &ctx.arena, 1024);
+	byte_array_init_arena(&strings, &ctx.arena, 256);
+	byte_array_ensure(&tail, 4);
+	tail.size = ULB_PAD(dataLength) - dataLength;
+	memset(tail.items, 0, tail.size);
+	ulb_add(&tail, layout->labelTable.slots, sizeof(uint32_t) * layout->labelTable.numSlots);
+	ulb_add_symbols(&tail, &strings, layout->labels.items, layout->labels.size, ctx.constants.items, ctx.constants.size);
+	header.stringsLength = (uint32_t) strings.size;
+	ulb_add(&tail, strings.items, strings.size);
+
+	ulang_bool written = fseek(output.image, (long) (output.dataOffset + dataLength), SEEK_SET) == 0 &&
+						 fwrite(tail.items, 1, tail.size, output.image) == tail.size &&
+						 fseek(output.image, 0, SEEK_SET) == 0 &&
+						 fwrite(&header, 1, sizeof(ulb_header), output.image) == sizeof(ulb_header);
+	written = fclose(output.image) == 0 && written;
+	output.image = NULL;
+	if (!written) {
+		ulang_error_init(error, NULL, NULL, "Couldn't write file %s", imageFileName);
+		goto _compilation_error;
+	}
+	arena_free(&ctx.arena);
+	return UL_TRUE;
 
-	if (!ulang_compile_file(&ctx, file, fileReadFunction, error)) goto _compilation_error;
+	_compilation_error:
+	if (output.image) fclose(output.image);
+	arena_free(&ctx.arena);
+	return UL_FALSE;
+}
 
-	ctx.resolveLabelsInExpressions = UL_TRUE;
-	ctx.stream.end = ctx.tokens.size;
-	for (size_t i = 0; i < ctx.patches.size; i++) {
-		patch *p = &ctx.patches.items[i];
-		ctx.stream.index = p->expr.startToken;
-		ulang_span span;
-		expression_value expr;
-		if (!parse_expression(&ctx, &expr, &span)) goto _compilation_error;
-
-		if (p->type == PT_VALUE) {
-			if (p->expr.type == UL_INTEGER) memcpy(&ctx.code.items[p->patchAddress], &expr.i, 4);
-			else memcpy(&ctx.code.items[p->patchAddress], &expr.f, 4);
-		} else {
-			if (p->expr.type != UL_INTEGER) {
-				ulang_error_init(ctx.error, ctx.stream.file, &span, "Offsets must be integers.");
-				break;
-			}
+static uint8_t *ulb_map(const char *fileName, size_t *length, ulang_allocator *allocator) {
+#ifdef UL_MMAP
+	(void) allocator;
+	int fd = open(fileName, O_RDONLY);
+	if (fd < 0) return NULL;
+	struct stat info;
+	if (fstat(fd, &info) < 0 || info.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+	void *image = mmap(NULL, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED) return NULL;
+	*length = (size_t) info.st_size;
+	return (uint8_t *) image;
+#else
+	FILE *stream = fopen(fileName, "rb");
+	if (stream == NULL) return NULL;
+	fseek(stream, 0L, SEEK_END);
+	long fileLength = ftell(stream);
+	fseek(stream, 0L, SEEK_SET);
+	if (fileLength <= 0) {
+		fclose(stream);
+		return NULL;
+	}
+	uint8_t *image = ulang_allocator_alloc(allocator, (size_t) fileLength);
+	size_t numRead = fread(image, 1, (size_t) fileLength, stream);
+	fclose(stream);
+	if (numRead != (size_t) fileLength) {
+		ulang_allocator_free(allocator, image);
+		return NULL;
+	}
+	*length = (size_t) fileLength;
+	return image;
+#endif
+}
+
+static void ulb_unmap(void *image, size_t length, ulang_allocator *allocator) {
+#ifdef UL_MMAP
+	(void) allocator;
+	munmap(image, length);
+#else
+	(void) length;
+	ulang_allocator_free(allocator, image);
+#endif
+}
+
+static ulang_bool ulb_string(ulb_header *header, uint32_t offset, uint32_t length) {
+	return (uint64_t) offset + length < header->stringsLength;
+}
+
+EMSCRIPTEN_KEEPALIVE ulang_bool ulang_program_load(const char *fileName, ulang_program *program, ulang_error *error, ulang_allocator *allocator) {
+	if (!allocator) allocator = &defaultAllocator;
+	memset(program, 0, sizeof(ulang_program));
+	error->is_set = UL_FALSE;
 
-			uint32_t op;
-			memcpy(&op, &ctx.code.items[p->patchAddress], 4);
-			ENCODE_OFF(op, p->expr.i);
-			memcpy(&ctx.code.items[p->patchAddress], &op, 4);
+	size_t length = 0;
+	uint8_t *image = ulb_map(fileName, &length, allocator);
+	if (!image) {
+		ulang_error_init(error, NULL, NULL, "Couldn't read file %s", fileName);
+		return UL_FALSE;
+	}
+	program->allocator = allocator;
+	program->image = image;
+	program->imageLength = length;
+
+	ulb_header header;
+	if (length < sizeof(ulb_header)) goto _invalid;
+	memcpy(&header, image, sizeof(ulb_header));
+	if (header.magic != ULB_MAGIC || header.version != ULB_VERSION) goto _invalid;
+	uint64_t expectedLength = sizeof(ulb_header) + ULB_PAD(header.codeLength) + ULB_PAD(header.dataLength) +
+							  sizeof(uint32_t) * (uint64_t) header.labelTableLength + sizeof(ulang_line_range) * (uint64_t) header.lineRangesLength +
+							  sizeof(ulb_symbol) * ((uint64_t) header.labelsLength + header.constantsLength) +
+							  sizeof(ulb_file) * (uint64_t) header.filesLength + ULB_PAD(header.stringsLength);
+	if (expectedLength != length || (header.codeLength & 3) || (header.lineRangesLength && !header.filesLength)) goto _invalid;
+	// Code and data are copied to the start of the VM's memory, they have to fit
+	if ((uint64_t) header.codeLength + header.dataLength > UL_VM_MEMORY_SIZE) goto _invalid;
+	if (header.labelTableLength && ((header.labelTableLength & (header.labelTableLength - 1)) || header.labelTableLength <= header.labelsLength)) goto _invalid;
+
+	uint8_t *cursor = image + sizeof(ulb_header);
+	program->code = header.codeLength ? cursor : NULL;
+	program->codeLength = header.codeLength;
+	cursor += ULB_PAD(header.codeLength);
+	program->data = header.dataLength ? cursor : NULL;
+	program->dataLength = header.dataLength;
+	cursor += ULB_PAD(header.dataLength);
+	program->reservedBytes = header.reservedBytes;
+	program->labelTable = header.labelTableLength ? (uint32_t *) cursor : NULL;
+	program->labelTableLength = header.labelTableLength;
+	cursor += sizeof(uint32_t) * header.labelTableLength;
+	// Lookups probe until an empty slot, every label has to be in the table exactly once
+	if (header.labelTableLength) {
+		uint8_t *seen = allocator_calloc(allocator, header.labelsLength + 1);
+		size_t numUsed = 0;
+		ulang_bool valid = UL_TRUE;
+		for (size_t i = 0; i < header.labelTableLength && valid; i++) {
+			uint32_t index = program->labelTable[i];
+			if (!index) continue;
+			valid = index <= header.labelsLength && !seen[index];
+			if (valid) seen[index] = 1;
+			numUsed++;
 		}
+		ulang_allocator_free(allocator, seen);
+		if (!valid || numUsed != header.labelsLength) goto _invalid;
+	}
+	program->lineRanges = header.lineRangesLength ? (ulang_line_range *) cursor : NULL;
+	program->lineRangesLength = header.lineRangesLength;
+	cursor += sizeof(ulang_line_range) * header.lineRangesLength;
+	// Lookups binary search the ranges, they have to be sorted
+	for (size_t i = 0; i < header.lineRangesLength; i++) {
+		ulang_line_range *range = &program->lineRanges[i];
+		if (range->file >= header.filesLength || range->address >= header.codeLength >> 2) goto _invalid;
+		if (i > 0 && range->address <= range[-1].address) goto _invalid;
+	}
+	ulb_symbol *labels = (ulb_symbol *) cursor;
+	cursor += sizeof(ulb_symbol) * header.labelsLength;
+	ulb_symbol *constants = (ulb_symbol *) cursor;
+	cursor += sizeof(ulb_symbol) * header.constantsLength;
+	ulb_file *files = (ulb_file *) cursor;
+	cursor += sizeof(ulb_file) * header.filesLength;
+	char *strings = (char *) cursor;
+
+	if (header.labelsLength) program->labels = allocator_calloc(allocator, sizeof(ulang_label) * header.labelsLength);
+	program->labelsLength = header.labelsLength;
+	for (size_t i = 0; i < header.labelsLength; i++) {
+		ulb_symbol *symbol = &labels[i];
+		if (!ulb_string(&header, symbol->name, symbol->nameLength) || symbol->type > UL_LT_RESERVED_DATA) goto _invalid;
+		ulang_label *label = &program->labels[i];
+		label->label.data.data = strings + symbol->name;
+		label->label.data.length = symbol->nameLength;
+		label->label.startLine = symbol->startLine;
+		label->label.endLine = symbol->endLine;
+		label->target = (ulang_label_target) symbol->type;
+		label->address = symbol->value;
 	}
 
-	patch_array_free_inplace(&ctx.patches);
-	token_array_free_inplace(&ctx.tokens);
-	program->code = ctx.code.items;
-	program->codeLength = ctx.code.size;
-	program->data = ctx.data.items;
-	program->dataLength = ctx.data.size;
-	program->reservedBytes = ctx.numReservedBytes;
-	program->labels = ctx.labels.items;
-	program->labelsLength = ctx.labels.size;
-	program->constants = ctx.constants.items;
-	program->constantsLength = ctx.constants.size;
-	program->files = ctx.files.items;
-	program->filesLength = ctx.files.size;
-	program->addressToLine = ctx.addressToLine.items;
-	program->addressToLineLength = ctx.addressToLine.size;
-	program->addressToFile = ctx.addressToFile.items;
-	program->addressToFileLength = ctx.addressToFile.size;
-	return UL_TRUE;
+	if (header.constantsLength) program->constants = allocator_calloc(allocator, sizeof(ulang_constant) * header.constantsLength);
+	program->constantsLength = header.constantsLength;
+	for (size_t i = 0; i < header.constantsLength; i++) {
+		ulb_symbol *symbol = &constants[i];
+		if (!ulb_string(&header, symbol->name, symbol->nameLength) || symbol->type > UL_FLOAT) goto _invalid;
+		ulang_constant *constant = &program->constants[i];
+		constant->name.data.data = strings + symbol->name;
+		constant->name.data.length = symbol->nameLength;
+		constant->name.startLine = symbol->startLine;
+		constant->name.endLine = symbol->endLine;
+		constant->type = (value_type) symbol->type;
+		memcpy(&constant->i, &symbol->value, sizeof(uint32_t));
+	}
 
-	_compilation_error:
-	patch_array_free_inplace(&ctx.patches);
-	token_array_free_inplace(&ctx.tokens);
-	byte_array_free_inplace(&ctx.code);
-	byte_array_free_inplace(&ctx.data);
-	label_array_free_inplace(&ctx.labels);
-	constant_array_free_inplace(&ctx.constants);
-	for (int i = 0; i < (int)ctx.files.size; i++) {
-		ulang_file_free(ctx.files.items[i]);
-		ulang_free(ctx.files.items[i]);
+	// Files own their contents, so they are copied out of the image.
+	if (header.filesLength) program->files = allocator_calloc(allocator, sizeof(ulang_file *) * header.filesLength);
+	for (size_t i = 0; i < header.filesLength; i++) {
+		ulb_file *record = &files[i];
+		if (!ulb_string(&header, record->name, record->nameLength) || !ulb_string(&header, record->data, record->dataLength)) goto _invalid;
+		ulang_file *file = allocator_calloc(allocator, sizeof(ulang_file));
+		file->fileName.data = ulang_allocator_alloc(allocator, record->nameLength + 1);
+		memcpy(file->fileName.data, strings + record->name, record->nameLength + 1);
+		file->fileName.length = record->nameLength;
+		file->data = ulang_allocator_alloc(allocator, record->dataLength + 1);
+		memcpy(file->data, strings + record->data, record->dataLength + 1);
+		file->length = record->dataLength;
+		program->files[program->filesLength++] = file;
 	}
-	file_array_free_inplace(&ctx.files);
-	int_array_free_inplace(&ctx.addressToLine);
-	file_array_free_inplace(&ctx.addressToFile);
+	return UL_TRUE;
+
+	_invalid:
+	ulang_program_free(program);
+	memset(program, 0, sizeof(ulang_program));
+	ulang_error_init(error, NULL, NULL, "Invalid program image %s", fileName);
 	return UL_FALSE;
 }
 
 EMSCRIPTEN_KEEPALIVE void ulang_program_free(ulang_program *program) {
-	for (int i = 0; i < (int)program->filesLength; i++) {
-		ulang_file_free(program->files[i]);
-		ulang_free(program->files[i]);
+	ulang_allocator *allocator = program->allocator ? program->allocator : &defaultAllocator;
+	program_files_free(program, allocator);
+	ulang_allocator_free(allocator, program->labels);
+	ulang_allocator_free(allocator, program->constants);
+	ulang_allocator_free(allocator, program->symbolNames);
+	if (program->image) {
+		// code, data and the label and line tables point into the image
+		ulb_unmap(program->image, program->imageLength, allocator);
+	} else {
+		ulang_allocator_free(allocator, program->code);
+		ulang_allocator_free(allocator, program->data);
+		ulang_allocator_free(allocator, program->labelTable);
+		ulang_allocator_free(allocator, program->lineRanges);
 	}
-	ulang_free(program->files);
-	ulang_free(program->code);
-	ulang_free(program->data);
-	ulang_free(program->labels);
-	ulang_free(program->constants);
-	ulang_free(program->addressToLine);
-	ulang_free(program->addressToFile);
 }
 
 ulang_bool ulang_vm_debug(ulang_vm *vm) {
+	init_opcodes_and_registers();
 	do {
 		ulang_vm_print(vm);
 		prompt:
@@ -1924,7 +5094,7 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 				.tokens = { tokens.size, tokens.capacity, tokens.items },
 		};
 
-		if (ulang_span_matches(&cmd->span, STR("h"))) {
+		if (token_matches(&input, cmd, STR("h"))) {
 			printf("   s                         step one instruction\n");
 			printf("   c                         continue execution\n");
 			printf("   r <addr> <num> <b|i|f>?   read <num> words starting at address <addr>\n");
@@ -1937,7 +5107,7 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 			goto prompt;
 		}
 
-		if (ulang_span_matches(&cmd->span, STR("s"))) {
+		if (token_matches(&input, cmd, STR("s"))) {
 			if (!ulang_vm_step(vm)) {
 				token_array_free_inplace(&tokens);
 				return UL_FALSE;
@@ -1945,20 +5115,20 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 			continue;
 		}
 
-		if (ulang_span_matches(&cmd->span, STR("c"))) {
+		if (token_matches(&input, cmd, STR("c"))) {
 			token_array_free_inplace(&tokens);
 			return UL_TRUE;
 		}
 
-		if (ulang_span_matches(&cmd->span, STR("p"))) {
+		if (token_matches(&input, cmd, STR("p"))) {
 			token_array_free_inplace(&tokens);
 			continue;
 		}
 
-		if (ulang_span_matches(&cmd->span, STR("r"))) {
-			ulang_span span;
+		if (token_matches(&input, cmd, STR("r"))) {
+			token source;
 			expression_value addr;
-			if (!parse_expression(&ctx, &addr, &span)) {
+			if (!parse_expression(&ctx, &addr, &source)) {
 				ulang_error_print(&error);
 				ulang_error_free(&error);
 				token_array_free_inplace(&tokens);
@@ -1970,7 +5140,7 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 				goto prompt;
 			}
 			expression_value numWords;
-			if (!parse_expression(&ctx, &numWords, &span)) {
+			if (!parse_expression(&ctx, &numWords, &source)) {
 				ulang_error_print(&error);
 				ulang_error_free(&error);
 				token_array_free_inplace(&tokens);
@@ -2012,10 +5182,10 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 			goto prompt;
 		}
 
-		if (ulang_span_matches(&cmd->span, STR("w"))) {
-			ulang_span span;
+		if (token_matches(&input, cmd, STR("w"))) {
+			token source;
 			expression_value num;
-			if (!parse_expression(&ctx, &num, &span)) {
+			if (!parse_expression(&ctx, &num, &source)) {
 				ulang_error_print(&error);
 				ulang_error_free(&error);
 				token_array_free_inplace(&tokens);
@@ -2023,7 +5193,7 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 			}
 			if (num.type == UL_FLOAT) memcpy(&num.i, &num.f, 4);
 			expression_value addr;
-			if (!parse_expression(&ctx, &addr, &span)) {
+			if (!parse_expression(&ctx, &addr, &source)) {
 				ulang_error_print(&error);
 				ulang_error_free(&error);
 				token_array_free_inplace(&tokens);
@@ -2053,12 +5223,16 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 			goto prompt;
 		}
 
-		if (ulang_span_matches(&cmd->span, STR("l"))) {
+		if (token_matches(&input, cmd, STR("l"))) {
 			token *label = token_stream_consume(&stream);
 			if (label && label->type != TOKEN_IDENTIFIER) label = NULL;
 			ulang_label *labels = vm->program->labels;
-			for (int i = 0; i < (int) vm->program->labelsLength; i++) {
-				if (label && !ulang_span_matches(&label->span, labels[i].label.data.data, labels[i].label.data.length)) continue;
+			size_t numLabels = vm->program->labelsLength;
+			if (label) {
+				labels = ulang_program_get_label(vm->program, input.data + label->offset, label->length);
+				numLabels = labels ? 1 : 0;
+			}
+			for (int i = 0; i < (int) numLabels; i++) {
 				size_t addr = labels[i].address;
 				switch (labels[i].target) {
 					case UL_LT_UNINITIALIZED:
@@ -2084,21 +5258,22 @@ ulang_bool ulang_vm_debug(ulang_vm *vm) {
 }
 
 // BOZO need to throw an error in case memory sizes are bollocks
-EMSCRIPTEN_KEEPALIVE void ulang_vm_init(ulang_vm *vm, ulang_program *program) {
+EMSCRIPTEN_KEEPALIVE void ulang_vm_init(ulang_vm *vm, ulang_program *program, ulang_allocator *allocator) {
+	vm->allocator = allocator ? allocator : &defaultAllocator;
 	vm->memorySizeBytes = UL_VM_MEMORY_SIZE;
-	vm->memory = ulang_alloc(vm->memorySizeBytes);
+	vm->memory = ulang_allocator_alloc(vm->allocator, vm->memorySizeBytes);
 	memset(vm->registers, 0, sizeof(ulang_value) * 16);
+	memset(vm->vectors, 0, sizeof(vm->vectors));
 	memset(vm->syscalls, 0, sizeof(ulang_syscall) * 256);
 	memset(vm->memory, 0, vm->memorySizeBytes);
-	memcpy(vm->memory, program->code, program->codeLength);
-	memcpy(vm->memory + program->codeLength, program->data, program->dataLength);
+	if (program->codeLength) memcpy(vm->memory, program->code, program->codeLength);
+	if (program->dataLength) memcpy(vm->memory + program->codeLength, program->data, program->dataLength);
 	vm->registers[14].ui = vm->memorySizeBytes;
 	vm->program = program;
+	vm->coverage = NULL;
+	vm->profile = NULL;
 }
 
-#define DECODE_OP(word) ((word) & 0x7f)
-#define DECODE_REG(word, index) (((word) >> (7 + 4 * (index))) & 0xf)
-#define DECODE_OFF(word) (((word) >> 19) & 0x1fff)
 #define REG1 regs[DECODE_REG(word, 0)].i
 #define REG2 regs[DECODE_REG(word, 1)].i
 #define REG3 regs[DECODE_REG(word, 2)].i
@@ -2114,9 +5289,147 @@ EMSCRIPTEN_KEEPALIVE void ulang_vm_init(ulang_vm *vm, ulang_program *program) {
 #define SIGNUM(v) (((v) < 0) ? -1 : (((v) > 0) ? 1 : 0))
 #define SP regs[14].ui
 #define PC regs[15].ui
+#define VREG(index) vm->vectors[DECODE_REG(word, index) & 3]
+
+// Address of an indexed load or store with its base register in slot base. Increments
+// the base by width if asked to.
+static uint32_t indexed_address(ulang_value *regs, uint32_t word, int base, uint32_t width) {
+	uint32_t mode = DECODE_OFF(word);
+	uint32_t addr = regs[DECODE_REG(word, base)].ui + (uint32_t) (DECODE_IMM(word) >> 3);
+	if ((mode & 3) != 3) addr += regs[DECODE_REG(word, base + 1)].ui << (mode & 3);
+	if (mode & 4) regs[DECODE_REG(word, base)].ui += width;
+	return addr;
+}
+
+static inline uint32_t count_bits(uint32_t value) {
+#if defined(_MSC_VER)
+	value = value - ((value >> 1) & 0x55555555);
+	value = (value & 0x33333333) + ((value >> 2) & 0x33333333);
+	return (((value + (value >> 4)) & 0x0f0f0f0f) * 0x01010101) >> 24;
+#else
+	return (uint32_t) __builtin_popcount(value);
+#endif
+}
+
+static inline uint32_t count_leading_zeros(uint32_t value) {
+	if (!value) return 32;
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanReverse(&index, value);
+	return 31 - (uint32_t) index;
+#else
+	return (uint32_t) __builtin_clz(value);
+#endif
+}
+
+static inline uint32_t swap_bytes(uint32_t value) {
+#if defined(_MSC_VER)
+	return _byteswap_ulong(value);
+#else
+	return __builtin_bswap32(value);
+#endif
+}
+
+static inline uint32_t rotate_left(uint32_t value, uint32_t amount) {
+	amount &= 31;
+	return (value << amount) | (value >> ((32 - amount) & 31));
+}
+
+// Whether a flag as set by cmp fulfills the condition of the jump, JUMP always does
+static inline ulang_bool condition_holds(uint32_t jump, int32_t flag) {
+	switch (jump) {
+		case JUMP_EQUAL: return flag == 0;
+		case JUMP_NOT_EQUAL: return flag != 0;
+		case JUMP_LESS: return flag < 0;
+		case JUMP_GREATER: return flag > 0;
+		case JUMP_LESS_EQUAL: return flag <= 0;
+		case JUMP_GREATER_EQUAL: return flag >= 0;
+		default: return UL_TRUE;
+	}
+}
+
+// Whether a branch_condition holds for a compared to b
+static inline ulang_bool branch_taken(uint32_t condition, ulang_value a, ulang_value b) {
+	int32_t flag;
+	if (condition >= BC_EQUAL_FLOAT) flag = a.f < b.f ? -1 : a.f > b.f;
+	else if (condition >= BC_LESS_UNSIGNED) flag = a.ui < b.ui ? -1 : a.ui > b.ui;
+	else flag = a.i < b.i ? -1 : a.i > b.i;
+	return condition_holds(JUMP_EQUAL + condition - branch_condition_base(condition), flag);
+}
+
+// Applies a vector_function to the lanes of a and b. Float min and max return b if a
+// lane is NaN on every path. Returns false for an unknown function.
+static ulang_bool vector_math(uint32_t function, ulang_value *a, ulang_value *b, ulang_value *dst) {
+#if defined(UL_SIMD_SSE2)
+	__m128i ia = _mm_loadu_si128((const __m128i *) a), ib = _mm_loadu_si128((const __m128i *) b);
+	__m128 fa = _mm_loadu_ps(&a->f), fb = _mm_loadu_ps(&b->f);
+	switch (function) {
+		case VF_ADD: _mm_storeu_si128((__m128i *) dst, _mm_add_epi32(ia, ib)); return UL_TRUE;
+		case VF_SUB: _mm_storeu_si128((__m128i *) dst, _mm_sub_epi32(ia, ib)); return UL_TRUE;
+#if defined(UL_SIMD_AVX2)
+		case VF_MUL: _mm_storeu_si128((__m128i *) dst, _mm_mullo_epi32(ia, ib)); return UL_TRUE;
+		case VF_MIN: _mm_storeu_si128((__m128i *) dst, _mm_min_epi32(ia, ib)); return UL_TRUE;
+		case VF_MAX: _mm_storeu_si128((__m128i *) dst, _mm_max_epi32(ia, ib)); return UL_TRUE;
+#endif
+		case VF_ADD_FLOAT: _mm_storeu_ps(&dst->f, _mm_add_ps(fa, fb)); return UL_TRUE;
+		case VF_SUB_FLOAT: _mm_storeu_ps(&dst->f, _mm_sub_ps(fa, fb)); return UL_TRUE;
+		case VF_MUL_FLOAT: _mm_storeu_ps(&dst->f, _mm_mul_ps(fa, fb)); return UL_TRUE;
+		case VF_MIN_FLOAT: _mm_storeu_ps(&dst->f, _mm_min_ps(fa, fb)); return UL_TRUE;
+		case VF_MAX_FLOAT: _mm_storeu_ps(&dst->f, _mm_max_ps(fa, fb)); return UL_TRUE;
+		default: break;
+	}
+#elif defined(UL_SIMD_NEON)
+	int32x4_t ia = vld1q_s32(&a->i), ib = vld1q_s32(&b->i);
+	float32x4_t fa = vld1q_f32(&a->f), fb = vld1q_f32(&b->f);
+	switch (function) {
+		case VF_ADD: vst1q_s32(&dst->i, vaddq_s32(ia, ib)); return UL_TRUE;
+		case VF_SUB: vst1q_s32(&dst->i, vsubq_s32(ia, ib)); return UL_TRUE;
+		case VF_MUL: vst1q_s32(&dst->i, vmulq_s32(ia, ib)); return UL_TRUE;
+		case VF_MIN: vst1q_s32(&dst->i, vminq_s32(ia, ib)); return UL_TRUE;
+		case VF_MAX: vst1q_s32(&dst->i, vmaxq_s32(ia, ib)); return UL_TRUE;
+		case VF_ADD_FLOAT: vst1q_f32(&dst->f, vaddq_f32(fa, fb)); return UL_TRUE;
+		case VF_SUB_FLOAT: vst1q_f32(&dst->f, vsubq_f32(fa, fb)); return UL_TRUE;
+		case VF_MUL_FLOAT: vst1q_f32(&dst->f, vmulq_f32(fa, fb)); return UL_TRUE;
+		case VF_MIN_FLOAT: vst1q_f32(&dst->f, vbslq_f32(vcltq_f32(fa, fb), fa, fb)); return UL_TRUE;
+		case VF_MAX_FLOAT: vst1q_f32(&dst->f, vbslq_f32(vcgtq_f32(fa, fb), fa, fb)); return UL_TRUE;
+		default: break;
+	}
+#endif
+	switch (function) {
+		case VF_ADD: for (int i = 0; i < 4; i++) dst[i].ui = a[i].ui + b[i].ui; break;
+		case VF_SUB: for (int i = 0; i < 4; i++) dst[i].ui = a[i].ui - b[i].ui; break;
+		case VF_MUL: for (int i = 0; i < 4; i++) dst[i].ui = a[i].ui * b[i].ui; break;
+		case VF_MIN: for (int i = 0; i < 4; i++) dst[i].i = a[i].i < b[i].i ? a[i].i : b[i].i; break;
+		case VF_MAX: for (int i = 0; i < 4; i++) dst[i].i = a[i].i > b[i].i ? a[i].i : b[i].i; break;
+		case VF_ADD_FLOAT: for (int i = 0; i < 4; i++) dst[i].f = a[i].f + b[i].f; break;
+		case VF_SUB_FLOAT: for (int i = 0; i < 4; i++) dst[i].f = a[i].f - b[i].f; break;
+		case VF_MUL_FLOAT: for (int i = 0; i < 4; i++) dst[i].f = a[i].f * b[i].f; break;
+		case VF_MIN_FLOAT: for (int i = 0; i < 4; i++) dst[i].f = a[i].f < b[i].f ? a[i].f : b[i].f; break;
+		case VF_MAX_FLOAT: for (int i = 0; i < 4; i++) dst[i].f = a[i].f > b[i].f ? a[i].f : b[i].f; break;
+		default: return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+// Whether numBytes at addr lie in the memory of the vm. Otherwise the vm stops with an
+// error at the instruction.
+static ulang_bool check_block(ulang_vm *vm, uint32_t addr, uint32_t numBytes) {
+	if (numBytes <= vm->memorySizeBytes && addr <= vm->memorySizeBytes - numBytes) return UL_TRUE;
+	vm->registers[15].ui -= 4;
+	ulang_error_init(&vm->error, NULL, NULL, "Block of %u bytes at address %u is out of memory, pc %u.", numBytes, addr, vm->registers[15].ui);
+	return UL_FALSE;
+}
 
 EMSCRIPTEN_KEEPALIVE ulang_bool ulang_vm_step(ulang_vm *vm) {
 	ulang_value *regs = vm->registers;
+	if (vm->coverage) {
+		uint32_t codeWord = PC >> 2;
+		if (codeWord < vm->coverage->numWords) vm->coverage->bits[codeWord >> 5] |= 1u << (codeWord & 31);
+	}
+	if (vm->profile) {
+		uint32_t codeWord = PC >> 2;
+		if (codeWord < vm->profile->numWords && vm->profile->counts[codeWord] != UINT32_MAX) vm->profile->counts[codeWord]++;
+	}
 	uint32_t word;
 	memcpy(&word, &vm->memory[PC], 4);
 	PC += 4;
@@ -2299,10 +5612,10 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_vm_step(ulang_vm *vm) {
 			REG2 = REG1 ^ VAL;
 			break;
 		case SHL:
-			REG3 = REG1 << REG2;
+			REG3_U = REG1_U << REG2;
 			break;
 		case SHL_VAL:
-			REG2 = REG1 << DECODE_OFF(word);
+			REG2_U = REG1_U << DECODE_OFF(word);
 			break;
 		case SHR:
 			REG3 = REG1 >> REG2;
@@ -2493,6 +5806,232 @@ EMSCRIPTEN_KEEPALIVE ulang_bool ulang_vm_step(ulang_vm *vm) {
 			if (!vm->syscalls[intNum](intNum, vm)) return UL_FALSE;
 			break;
 		}
+		case ADD_IMM:
+			REG2 = REG1 + DECODE_IMM(word);
+			break;
+		case CMP_IMM:
+			REG2 = SIGNUM(REG1 - DECODE_IMM(word));
+			break;
+		case MOVE_IMM:
+			REG1 = DECODE_IMM(word);
+			break;
+		case PUSH_IMM: {
+			int32_t val = DECODE_IMM(word);
+			SP -= 4;
+			memcpy(vm->memory + SP, &val, 4);
+			break;
+		}
+		case JUMP_NEAR:
+			// The offset counts words from the jump
+			if (condition_holds(JUMP + DECODE_REG(word, 1), REG1)) PC += (uint32_t) (DECODE_IMM(word) - 1) << 2;
+			break;
+		// Loads write the destination after the base is incremented, stores read the value before
+		case LOAD_INDEXED: {
+			uint32_t addr = indexed_address(regs, word, 0, 4);
+			memcpy(&REG3_U, &vm->memory[addr], 4);
+			break;
+		}
+		case LOAD_BYTE_INDEXED: {
+			uint32_t addr = indexed_address(regs, word, 0, 1);
+			REG3_U = vm->memory[addr];
+			break;
+		}
+		case LOAD_SHORT_INDEXED: {
+			uint32_t addr = indexed_address(regs, word, 0, 2);
+			memcpy(&REG3_U, &vm->memory[addr], 2);
+			break;
+		}
+		case STORE_INDEXED: {
+			uint32_t val = REG1_U;
+			uint32_t addr = indexed_address(regs, word, 1, 4);
+			memcpy(&vm->memory[addr], &val, 4);
+			break;
+		}
+		case STORE_BYTE_INDEXED: {
+			uint32_t val = REG1_U;
+			uint32_t addr = indexed_address(regs, word, 1, 1);
+			vm->memory[addr] = (uint8_t) val;
+			break;
+		}
+		case STORE_SHORT_INDEXED: {
+			uint32_t val = REG1_U;
+			uint32_t addr = indexed_address(regs, word, 1, 2);
+			memcpy(&vm->memory[addr], &val, 2);
+			break;
+		}
+		case MEMSET:
+			if (!check_block(vm, REG2_U, REG3_U)) return UL_FALSE;
+			memset(&vm->memory[REG2_U], (uint8_t) REG1_U, REG3_U);
+			break;
+		case MEMCPY:
+			if (!check_block(vm, REG1_U, REG3_U) || !check_block(vm, REG2_U, REG3_U)) return UL_FALSE;
+			memmove(&vm->memory[REG2_U], &vm->memory[REG1_U], REG3_U);
+			break;
+		case MEMCMP: {
+			if (!check_block(vm, REG1_U, REG3_U) || !check_block(vm, REG2_U, REG3_U)) return UL_FALSE;
+			int result = memcmp(&vm->memory[REG1_U], &vm->memory[REG2_U], REG3_U);
+			REG3 = SIGNUM(result);
+			break;
+		}
+		case VECTOR_LOAD: {
+			uint32_t addr = indexed_address(regs, word, 0, 16);
+			memcpy(VREG(2), &vm->memory[addr], 16);
+			break;
+		}
+		case VECTOR_LOAD_BYTE: {
+			uint32_t addr = indexed_address(regs, word, 0, 4);
+			ulang_value *dst = VREG(2);
+			for (int i = 0; i < 4; i++) dst[i].ui = vm->memory[addr + i];
+			break;
+		}
+		case VECTOR_STORE: {
+			ulang_value val[4];
+			memcpy(val, VREG(0), 16);
+			uint32_t addr = indexed_address(regs, word, 1, 16);
+			memcpy(&vm->memory[addr], val, 16);
+			break;
+		}
+		case VECTOR_STORE_BYTE: {
+			uint8_t val[4];
+			for (int i = 0; i < 4; i++) val[i] = (uint8_t) VREG(0)[i].ui;
+			uint32_t addr = indexed_address(regs, word, 1, 4);
+			memcpy(&vm->memory[addr], val, 4);
+			break;
+		}
+		case VECTOR_MATH:
+			if (!vector_math(DECODE_OFF(word), VREG(0), VREG(1), VREG(2))) {
+				vm->registers[15].ui -= 4;
+				return UL_FALSE;
+			}
+			break;
+		case VECTOR_SHUFFLE: {
+			ulang_value val[4];
+			uint32_t lanes = DECODE_OFF(word);
+			for (int i = 0; i < 4; i++) val[i] = VREG(0)[(lanes >> (i * 2)) & 3];
+			memcpy(VREG(1), val, 16);
+			break;
+		}
+		case VECTOR_SPLAT: {
+			ulang_value val = regs[DECODE_REG(word, 0)];
+			for (int i = 0; i < 4; i++) VREG(1)[i] = val;
+			break;
+		}
+		case VECTOR_GET:
+			REG2 = VREG(0)[DECODE_OFF(word) & 3].i;
+			break;
+		case SELECT:
+			if (condition_holds(JUMP + DECODE_OFF(word), REG1)) REG3 = REG2;
+			break;
+		case MIN_MAX:
+		case MIN_MAX_VAL: {
+			ulang_value a = regs[DECODE_REG(word, 0)], b, *dst;
+			if (op == MIN_MAX) {
+				b = regs[DECODE_REG(word, 1)];
+				dst = &regs[DECODE_REG(word, 2)];
+			} else {
+				b.ui = VAL_U;
+				dst = &regs[DECODE_REG(word, 1)];
+			}
+			switch (DECODE_OFF(word)) {
+				case 0: dst->i = a.i < b.i ? a.i : b.i; break;
+				case MF_MAX: dst->i = a.i > b.i ? a.i : b.i; break;
+				case MF_FLOAT: dst->f = a.f < b.f ? a.f : b.f; break;
+				default: dst->f = a.f > b.f ? a.f : b.f; break;
+			}
+			break;
+		}
+		case ABS:
+			if (DECODE_OFF(word) & MF_FLOAT) REG2_F = fabsf(REG1_F);
+			else REG2_U = REG1 < 0 ? 0u - REG1_U : REG1_U;
+			break;
+		case BITS: {
+			uint32_t val = REG1_U;
+			switch (DECODE_OFF(word)) {
+				case BF_POPCNT: REG2_U = count_bits(val); break;
+				case BF_CLZ: REG2_U = count_leading_zeros(val); break;
+				case BF_CTZ: REG2_U = val ? count_trailing_zeros(val) : 32; break;
+				case BF_BSWAP: REG2_U = swap_bytes(val); break;
+				default:
+					vm->registers[15].ui -= 4;
+					return UL_FALSE;
+			}
+			break;
+		}
+		case ROTATE_LEFT:
+			REG3_U = rotate_left(REG1_U, REG2_U);
+			break;
+		case ROTATE_LEFT_VAL:
+			REG2_U = rotate_left(REG1_U, DECODE_OFF(word));
+			break;
+		case ROTATE_RIGHT:
+			REG3_U = rotate_left(REG1_U, 32 - (REG2_U & 31));
+			break;
+		case ROTATE_RIGHT_VAL:
+			REG2_U = rotate_left(REG1_U, 32 - (DECODE_OFF(word) & 31));
+			break;
+		case BRANCH: {
+			uint32_t addr = VAL_U;
+			if (branch_taken(DECODE_REG(word, 2), regs[DECODE_REG(word, 0)], regs[DECODE_REG(word, 1)])) PC = addr;
+			break;
+		}
+		case BRANCH_NEAR:
+			if (branch_taken(DECODE_REG(word, 2), regs[DECODE_REG(word, 0)], regs[DECODE_REG(word, 1)])) PC += (uint32_t) (DECODE_IMM(word) - 1) << 2;
+			break;
+		case FRAME:
+			if (DECODE_REG(word, 1) == FF_LEAVE) {
+				SP = REG1_U;
+				memcpy(&REG1_U, vm->memory + SP, 4);
+				SP += 4;
+			} else {
+				SP -= 4;
+				memcpy(vm->memory + SP, &REG1_U, 4);
+				REG1_U = SP;
+				SP -= DECODE_OFF(word) << 2;
+			}
+			break;
+		case PUSH_MASK: {
+			uint32_t mask = DECODE_MASK(word);
+			if (DECODE_REG(word, 0) == FF_LEAVE) {
+				for (; mask; mask &= mask - 1) {
+					memcpy(&regs[count_trailing_zeros(mask)].ui, vm->memory + SP, 4);
+					SP += 4;
+				}
+			} else {
+				for (; mask; mask &= ~(0x80000000u >> count_leading_zeros(mask))) {
+					SP -= 4;
+					memcpy(vm->memory + SP, &regs[31 - count_leading_zeros(mask)].ui, 4);
+				}
+			}
+			break;
+		}
+		case TAIL_CALL: {
+			uint32_t frame = REG1_U, numBytes = DECODE_OFF(word) << 2;
+			if (!check_block(vm, SP, numBytes) || !check_block(vm, frame, numBytes + 8)) return UL_FALSE;
+			uint32_t addr = VAL_U;
+			memmove(vm->memory + frame + 8, vm->memory + SP, numBytes);
+			memcpy(&REG1_U, vm->memory + frame, 4);
+			SP = frame + 4;
+			PC = addr;
+			break;
+		}
+		case BRANCH_IMM:
+		case BRANCH_IMM_NEAR: {
+			uint32_t condition = DECODE_REG(word, 1);
+			ulang_value val;
+			val.i = op == BRANCH_IMM ? DECODE_IMM(word) : DECODE_BRANCH_IMM(word);
+			if (condition >= BC_EQUAL_FLOAT) val.f = (float) val.i;
+			if (op == BRANCH_IMM) {
+				uint32_t addr = VAL_U;
+				if (branch_taken(condition, regs[DECODE_REG(word, 0)], val)) PC = addr;
+			} else if (branch_taken(condition, regs[DECODE_REG(word, 0)], val)) {
+				PC += (uint32_t) (DECODE_BRANCH_OFFSET(word) - 1) << 2;
+			}
+			break;
+		}
+		case CLAMP:
+			if (DECODE_OFF(word) & MF_FLOAT) REG3_F = REG3_F < REG1_F ? REG1_F : REG3_F > REG2_F ? REG2_F : REG3_F;
+			else REG3 = REG3 < REG1 ? REG1 : REG3 > REG2 ? REG2 : REG3;
+			break;
 		default:
 			vm->registers[15].ui -= 4; // reset PC to the unknown instruction.
 			return UL_FALSE;
@@ -2540,10 +6079,9 @@ EMSCRIPTEN_KEEPALIVE void ulang_vm_print(ulang_vm *vm) {
 	if (vm->program && vm->program->files) {
 		for (int i = 0; i < (int)vm->program->filesLength; i++)
 			ulang_file_get_lines(vm->program->files[i]);
-		uint32_t pc = (vm->registers[15].ui) >> 2;
-		if (pc < 0 || pc >= vm->program->addressToLineLength) return;
-		int lineNum = (int) vm->program->addressToLine[pc];
-		ulang_file *file = vm->program->addressToFile[pc];
+		ulang_file *file;
+		int lineNum = (int) ulang_program_get_line(vm->program, vm->registers[15].ui >> 2, &file);
+		if (!file) return;
 
 		for (int i = MAX(1, lineNum - 2); i < MIN((int) file->numLines, lineNum + 3); i++) {
 			ulang_line line = file->lines[i];
@@ -2590,10 +6128,127 @@ EMSCRIPTEN_KEEPALIVE void ulang_vm_push_float(ulang_vm *vm, float val) {
 }
 
 EMSCRIPTEN_KEEPALIVE void ulang_vm_free(ulang_vm *vm) {
-	ulang_free(vm->memory);
+	ulang_allocator_free(vm->allocator, vm->memory);
 	if (vm->error.is_set) ulang_error_free(&vm->error);
 }
 
+EMSCRIPTEN_KEEPALIVE void ulang_coverage_init(ulang_coverage *coverage, ulang_program *program) {
+	coverage->numWords = program->codeLength >> 2;
+	coverage->bits = ulang_calloc(sizeof(uint32_t) * ((coverage->numWords + 31) >> 5));
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_coverage_merge(ulang_coverage *coverage, ulang_coverage *other) {
+	size_t numBitWords = (MIN(coverage->numWords, other->numWords) + 31) >> 5;
+	for (size_t i = 0; i < numBitWords; i++) {
+		coverage->bits[i] |= other->bits[i];
+	}
+}
+
+ulang_bool ulang_coverage_write_lcov(ulang_coverage *coverage, ulang_program *program, const char *fileName) {
+	FILE *stream = fopen(fileName, "w");
+	if (stream == NULL) return UL_FALSE;
+
+	fprintf(stream, "TN:\n");
+	for (size_t i = 0; i < program->filesLength; i++) {
+		ulang_file *file = program->files[i];
+		ulang_file_get_lines(file);
+
+		// 0 = no code on the line, 1 = code that wasn't executed, 2 = executed code
+		uint8_t *lineHits = ulang_calloc(file->numLines + 1);
+		for (size_t j = 0; j < program->lineRangesLength; j++) {
+			ulang_line_range *range = &program->lineRanges[j];
+			uint32_t line = range->line;
+			if (range->file != i || line > file->numLines) continue;
+			size_t end = j + 1 < program->lineRangesLength ? range[1].address : program->codeLength >> 2;
+			for (size_t address = range->address; address < end; address++) {
+				ulang_bool hit = address < coverage->numWords && (coverage->bits[address >> 5] & (1u << (address & 31)));
+				lineHits[line] = MAX(lineHits[line], hit ? 2 : 1);
+			}
+		}
+
+		size_t linesFound = 0, linesHit = 0;
+		fprintf(stream, "SF:%.*s\n", (int) file->fileName.length, file->fileName.data);
+		for (size_t line = 1; line <= file->numLines; line++) {
+			if (!lineHits[line]) continue;
+			fprintf(stream, "DA:%zu,%i\n", line, lineHits[line] - 1);
+			linesFound++;
+			if (lineHits[line] == 2) linesHit++;
+		}
+		fprintf(stream, "LF:%zu\nLH:%zu\nend_of_record\n", linesFound, linesHit);
+		ulang_free(lineHits);
+	}
+
+	fclose(stream);
+	return UL_TRUE;
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_coverage_free(ulang_coverage *coverage) {
+	ulang_free(coverage->bits);
+	coverage->bits = NULL;
+	coverage->numWords = 0;
+}
+
+#define ULP_MAGIC 0x00504c55
+#define ULP_VERSION 1
+
+EMSCRIPTEN_KEEPALIVE void ulang_profile_init(ulang_profile *profile, ulang_program *program) {
+	profile->numWords = program->codeLength >> 2;
+	profile->counts = ulang_calloc(sizeof(uint32_t) * MAX(profile->numWords, 1));
+	profile->codeHash = hash_string((const char *) program->code, program->codeLength);
+}
+
+// Profile file (.ulp). A header of magic, version, code hash, number of code words and
+// number of entries, followed by an address and a count for each executed code word.
+ulang_bool ulang_profile_save(ulang_profile *profile, const char *fileName) {
+	FILE *stream = fopen(fileName, "wb");
+	if (!stream) return UL_FALSE;
+	uint32_t numEntries = 0;
+	for (size_t i = 0; i < profile->numWords; i++) numEntries += profile->counts[i] != 0;
+	uint32_t header[5] = {ULP_MAGIC, ULP_VERSION, profile->codeHash, (uint32_t) profile->numWords, numEntries};
+	ulang_bool result = fwrite(header, sizeof(header), 1, stream) == 1;
+	for (uint32_t i = 0; i < profile->numWords && result; i++) {
+		if (!profile->counts[i]) continue;
+		uint32_t entry[2] = {i, profile->counts[i]};
+		result = fwrite(entry, sizeof(entry), 1, stream) == 1;
+	}
+	return fclose(stream) == 0 && result ? UL_TRUE : UL_FALSE;
+}
+
+ulang_bool ulang_profile_load(ulang_profile *profile, const char *fileName, ulang_error *error) {
+	memset(profile, 0, sizeof(ulang_profile));
+	FILE *stream = fopen(fileName, "rb");
+	if (!stream) {
+		ulang_error_init(error, NULL, NULL, "Couldn't read file %s", fileName);
+		return UL_FALSE;
+	}
+	uint32_t header[5];
+	ulang_bool valid = fread(header, sizeof(header), 1, stream) == 1 && header[0] == ULP_MAGIC && header[1] == ULP_VERSION &&
+					   header[3] <= UL_VM_MEMORY_SIZE >> 2;
+	if (valid) {
+		profile->codeHash = header[2];
+		profile->numWords = header[3];
+		profile->counts = ulang_calloc(sizeof(uint32_t) * MAX(profile->numWords, 1));
+	}
+	for (uint32_t i = 0; valid && i < header[4]; i++) {
+		uint32_t entry[2];
+		valid = fread(entry, sizeof(entry), 1, stream) == 1 && entry[0] < profile->numWords;
+		if (valid) profile->counts[entry[0]] = entry[1];
+	}
+	fclose(stream);
+	if (!valid) {
+		ulang_profile_free(profile);
+		ulang_error_init(error, NULL, NULL, "Invalid profile %s", fileName);
+		return UL_FALSE;
+	}
+	return UL_TRUE;
+}
+
+EMSCRIPTEN_KEEPALIVE void ulang_profile_free(ulang_profile *profile) {
+	ulang_free(profile->counts);
+	profile->counts = NULL;
+	profile->numWords = 0;
+}
+
 typedef enum UlangType {
 	UL_TYPE_FILE,
 	UL_TYPE_ERROR,
@@ -2666,10 +6321,14 @@ EMSCRIPTEN_KEEPALIVE void ulang_print_offsets() {
 	printf("   constantsLength: %lu\n", offsetof(ulang_program, constantsLength));
 	printf("   files: %lu\n", offsetof(ulang_program, files));
 	printf("   filesLength: %lu\n", offsetof(ulang_program, filesLength));
-	printf("   addressToLine: %lu\n", offsetof(ulang_program, addressToLine));
-	printf("   addressToLineLength: %lu\n", offsetof(ulang_program, addressToLineLength));
-	printf("   addressToFile: %lu\n", offsetof(ulang_program, addressToFile));
-	printf("   addressToFileLength: %lu\n", offsetof(ulang_program, addressToFileLength));
+	printf("   lineRanges: %lu\n", offsetof(ulang_program, lineRanges));
+	printf("   lineRangesLength: %lu\n", offsetof(ulang_program, lineRangesLength));
+	printf("   labelTable: %lu\n", offsetof(ulang_program, labelTable));
+	printf("   labelTableLength: %lu\n", offsetof(ulang_program, labelTableLength));
+	printf("   allocator: %lu\n", offsetof(ulang_program, allocator));
+	printf("   image: %lu\n", offsetof(ulang_program, image));
+	printf("   imageLength: %lu\n", offsetof(ulang_program, imageLength));
+	printf("   symbolNames: %lu\n", offsetof(ulang_program, symbolNames));
 
 	printf("ulang_vm (size=%lu)\n", sizeof(ulang_vm));
 	printf("   registers: %lu\n", offsetof(ulang_vm, registers));
@@ -2678,6 +6337,9 @@ EMSCRIPTEN_KEEPALIVE void ulang_print_offsets() {
 	printf("   syscalls: %lu\n", offsetof(ulang_vm, syscalls));
 	printf("   error: %lu\n", offsetof(ulang_vm, error));
 	printf("   program: %lu\n", offsetof(ulang_vm, program));
+	printf("   coverage: %lu\n", offsetof(ulang_vm, coverage));
+	printf("   allocator: %lu\n", offsetof(ulang_vm, allocator));
+	printf("   profile: %lu\n", offsetof(ulang_vm, profile));
 }
 
 EMSCRIPTEN_KEEPALIVE uint8_t *ulang_argb_to_rgba(uint8_t *argb, uint8_t *rgba, size_t numPixels) {
@@ -73,6 +73,30 @@ typedef struct ulang_constant {
 	};
 } ulang_constant;
 
+// Functions taking an allocator use ulang_default_allocator() when passed NULL.
+typedef void *(*ulang_alloc_function)(size_t numBytes, void *userData);
+typedef void *(*ulang_realloc_function)(void *old, size_t numBytes, void *userData);
+typedef void (*ulang_free_function)(void *ptr, void *userData);
+
+typedef struct ulang_allocator {
+	ulang_alloc_function allocFunction;
+	ulang_realloc_function reallocFunction;
+	ulang_free_function freeFunction;
+	void *userData;
+	size_t allocs;
+	size_t reallocs;
+	size_t frees;
+	size_t bytesRequested;
+} ulang_allocator;
+
+// Code words from address up to the address of the next range were assembled from
+// the same line. Addresses count 4-byte words, file indexes the program's files.
+typedef struct ulang_line_range {
+	uint32_t address;
+	uint32_t file;
+	uint32_t line;
+} ulang_line_range;
+
 typedef struct ulang_program {
 	uint8_t *code;
 	size_t codeLength;
@@ -85,10 +109,14 @@ typedef struct ulang_program {
 	size_t constantsLength;
 	ulang_file **files;
 	size_t filesLength;
-	uint32_t *addressToLine;
-	uint32_t addressToLineLength;
-	ulang_file **addressToFile;
-	uint32_t addressToFileLength;
+	ulang_line_range *lineRanges;
+	size_t lineRangesLength;
+	uint32_t *labelTable;
+	size_t labelTableLength;
+	ulang_allocator *allocator;
+	void *image;
+	size_t imageLength;
+	char *symbolNames;
 } ulang_program;
 
 typedef union ulang_value {
@@ -104,6 +132,19 @@ struct ulang_vm;
 typedef ulang_bool (*ulang_syscall)(uint32_t intNum, struct ulang_vm *vm);
 typedef ulang_bool (*ulang_file_read_function)(const char *filename, ulang_file *file);
 
+typedef struct ulang_coverage {
+	uint32_t *bits;
+	size_t numWords;
+} ulang_coverage;
+
+// How often the instruction starting at each code word was executed by runs with
+// ulang_vm.profile set. codeHash identifies the code the counts belong to.
+typedef struct ulang_profile {
+	uint32_t *counts;
+	size_t numWords;
+	uint32_t codeHash;
+} ulang_profile;
+
 typedef struct ulang_vm {
 	ulang_value registers[16];
 	uint8_t *memory;
@@ -111,6 +152,11 @@ typedef struct ulang_vm {
 	ulang_syscall syscalls[256];
 	ulang_error error;
 	ulang_program *program;
+	ulang_coverage *coverage;
+	ulang_allocator *allocator;
+	ulang_profile *profile;
+	// Vector registers v0 to v3 of four lanes each
+	ulang_value vectors[4][4];
 } ulang_vm;
 
 // string, span
@@ -125,6 +171,16 @@ void *ulang_realloc(void *old, size_t num_bytes);
 
 void ulang_free(void *ptr);
 
+ulang_allocator *ulang_default_allocator();
+
+void *ulang_allocator_alloc(ulang_allocator *allocator, size_t numBytes);
+
+void *ulang_allocator_realloc(ulang_allocator *allocator, void *old, size_t numBytes);
+
+void ulang_allocator_free(ulang_allocator *allocator, void *ptr);
+
+void ulang_allocator_print(ulang_allocator *allocator);
+
 void ulang_print_memory();
 
 // i/o
@@ -140,12 +196,80 @@ void ulang_error_free(ulang_error *error);
 
 // compilation
 
-ulang_bool ulang_compile(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error);
+ulang_bool ulang_compile(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator);
+
+// Time a compile spent in each phase, in ticks of the now function. Assembling
+// excludes the tokenizing and file reads of included files, linking includes
+// patch resolution.
+typedef struct ulang_compile_profile {
+	uint64_t (*now)(void);
+	uint64_t fileRead;
+	uint64_t tokenize;
+	uint64_t assemble;
+	uint64_t link;
+} ulang_compile_profile;
+
+ulang_bool ulang_compile_profiled(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator, ulang_compile_profile *profile);
+
+// Optional passes of a compile. numRemovedInstructions is set by the compile.
+typedef struct ulang_compile_options {
+	// Rewrites instructions into cheaper ones after patches are resolved. Code must not
+	// compute addresses from pc, as instructions move.
+	ulang_bool optimize;
+	size_t numRemovedInstructions;
+	// Profile file written by ulang_profile_save for the program compiled without a
+	// layout. Hot blocks are placed after each other, cold ones at the end. A profile
+	// of other code is ignored, numMovedBlocks stays 0.
+	const char *layoutProfile;
+	size_t numMovedBlocks;
+	// Keeps jumps and branches in two words. By default jumps and branches reaching their
+	// target with an offset of 13 bits are shortened to one word once the code is linked,
+	// branches comparing to an immediate need an 8 bit one and 9 bits of offset. Streaming
+	// compiles to an image always keep them.
+	ulang_bool longJumps;
+} ulang_compile_options;
+
+ulang_bool ulang_compile_with_options(const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error, ulang_allocator *allocator, ulang_compile_options *options);
+
+typedef struct ulang_compile_cache_stats {
+	size_t tokenHits;
+	size_t tokenMisses;
+	size_t programHits;
+	size_t programMisses;
+	size_t unitHits;
+	size_t unitMisses;
+} ulang_compile_cache_stats;
+
+typedef struct ulang_compile_cache ulang_compile_cache;
+
+ulang_compile_cache *ulang_compile_cache_new(ulang_allocator *allocator);
+
+ulang_bool ulang_compile_cached(ulang_compile_cache *cache, const char *filename, ulang_file_read_function fileReadFunction, ulang_program *program, ulang_error *error);
+
+void ulang_compile_cache_get_stats(ulang_compile_cache *cache, ulang_compile_cache_stats *stats);
+
+void ulang_compile_cache_free(ulang_compile_cache *cache);
+
+ulang_label *ulang_program_get_label(ulang_program *program, const char *name, size_t length);
+
+// Returns the line the code word at address was assembled from and its file, or
+// 0 if the program has no debug info for it.
+uint32_t ulang_program_get_line(ulang_program *program, uint32_t address, ulang_file **file);
+
+// Frees the line table and the source files of the program. Label and constant
+// names are kept.
+void ulang_program_strip(ulang_program *program);
+
+ulang_bool ulang_program_save(ulang_program *program, const char *fileName, ulang_bool debugInfo, ulang_error *error);
+
+ulang_bool ulang_compile_to_image(const char *filename, const char *imageFileName, ulang_error *error, ulang_allocator *allocator);
+
+ulang_bool ulang_program_load(const char *fileName, ulang_program *program, ulang_error *error, ulang_allocator *allocator);
 
 void ulang_program_free(ulang_program *program);
 
 // interpreter
-void ulang_vm_init(ulang_vm *vm, ulang_program *program);
+void ulang_vm_init(ulang_vm *vm, ulang_program *program, ulang_allocator *allocator);
 
 ulang_bool ulang_vm_step(ulang_vm *vm);
 
@@ -171,6 +295,24 @@ void ulang_vm_print(ulang_vm *vm);
 
 void ulang_vm_free(ulang_vm *vm);
 
+// coverage
+void ulang_coverage_init(ulang_coverage *coverage, ulang_program *program);
+
+void ulang_coverage_merge(ulang_coverage *coverage, ulang_coverage *other);
+
+ulang_bool ulang_coverage_write_lcov(ulang_coverage *coverage, ulang_program *program, const char *fileName);
+
+void ulang_coverage_free(ulang_coverage *coverage);
+
+// execution profile
+void ulang_profile_init(ulang_profile *profile, ulang_program *program);
+
+ulang_bool ulang_profile_save(ulang_profile *profile, const char *fileName);
+
+ulang_bool ulang_profile_load(ulang_profile *profile, const char *fileName, ulang_error *error);
+
+void ulang_profile_free(ulang_profile *profile);
+
 
 #ifdef __cplusplus
 };
@@ -2,7 +2,7 @@ import "monaco-editor/min/vs/editor/editor.main.css"
 import * as monaco from "monaco-editor";
 import * as ulang from "@marioslab/ulang-vm"
 import { explorer } from "./explorer";
-import { UlangFile } from "@marioslab/ulang-vm/src/wrapper";
+import { UlangCompileCache, UlangFile } from "@marioslab/ulang-vm/src/wrapper";
 import { Breakpoint } from "@marioslab/ulang-vm";
 import { project } from "src/project";
 
@@ -27,6 +27,7 @@ export class Editor {
 	private currSourceFile: SourceFile = null;
 	private breakpointListeners: ((bps: Breakpoint[]) => void)[] = [];
 	private contentListener: (filename: string, content: string) => void = null;
+	private compileCache: UlangCompileCache = null;
 
 	constructor (private container: HTMLElement) {
 		defineUlangLanguage();
@@ -49,10 +50,11 @@ export class Editor {
 
 	private onDidChangeModelContent () {
 		if (this.contentListener) this.contentListener(this.currSourceFile.filename, this.editor.getValue());
+		if (!this.compileCache) this.compileCache = ulang.newCompileCache();
 		let result = ulang.compile(explorer.getSelectedFile(), (filename) => {
 			if (!project.fileExists(filename)) return null;
 			else return project.getFileContent(filename);
-		});
+		}, this.compileCache);
 		if (result.error.isSet()) {
 			result.error.print();
 			let file: UlangFile = result.error.file();
@@ -222,21 +224,26 @@ function defineUlangLanguage () {
 		defaultToken: 'invalid',
 		keywords: [
 			"halt", "brk", "add", "sub", "mul", "div", "divu", "rem", "remu", "addf", "subf", "mulf", "divf", "cosf", "sinf", "atan2", "sqrtf", "powf", "rand", "i2f", "f2i",
-			"not", "and", "or", "xor", "shl", "shr", "shru",
+			"not", "and", "or", "xor", "shl", "shr", "shru", "rol", "ror", "popcnt", "clz", "ctz", "bswap",
 			"cmp", "cmpu", "cmpf",
 			"jmp", "je", "jne", "jl", "jg", "jle", "jge",
+			"be", "bne", "bl", "bg", "ble", "bge", "blu", "bgu", "bleu", "bgeu", "bef", "bnef", "blf", "bgf", "blef", "bgef",
+			"enter", "leave", "pushm", "popm", "tcall",
 			"mov",
 			"ld", "sto", "ldb", "stob", "lds", "stos",
 			"push", "pusha", "stackalloc", "pop", "popa",
 			"call", "ret", "retn",
 			"syscall",
+			"memset", "memcpy", "memcmp",
+			"sele", "selne", "sell", "selg", "selle", "selge", "min", "max", "minf", "maxf", "abs", "absf", "clamp", "clampf",
+			"vld", "vldb", "vst", "vstb", "vadd", "vsub", "vmul", "vmin", "vmax", "vaddf", "vsubf", "vmulf", "vminf", "vmaxf", "vshuf", "vsplat", "vget",
 			"reserve", "byte", "short", "int", "float",
 			"const",
 			"include",
 			"nop"
 		],
 		operators: ["~", "+", "-", "|", "&", "^", "/", "*", "%"],
-		registers: ["r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "sp", "pc"],
+		registers: ["r1", "r2", "r3", "r4", "r5", "r6", "r7", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "sp", "pc", "v0", "v1", "v2", "v3"],
 		escapes: /\\(?:[abfnrtv\\"']|x[0-9A-Fa-f]{1,4}|u[0-9A-Fa-f]{4}|U[0-9A-Fa-f]{8})/,
 		tokenizer: {
 			root: [
@@ -1,6 +1,6 @@
 import * as ulang from "./wrapper";
 
-export { compile, printMemory } from "./wrapper";
+export { compile, newCompileCache, printMemory } from "./wrapper";
 
 export enum VirtualMachineState {
 	Stopped, Running, Paused
@@ -174,14 +174,14 @@ export class VirtualMachine {
 	private calculateBreakpoints () {
 		if (this.bpPtr != 0) return this.bpPtr;
 		// Needs to come before the next line, as WASM memory can grow and pointers may get relocated
-		let addressToLine = this.vm.program().addressToLine();
-		let addressToFile = this.vm.program().addressToFile();
+		let lineRanges = this.vm.program().lineRanges();
+		let fileNames = this.vm.program().files().map(file => file.fileName().toString());
 		let p = this.bpPtr = ulang.alloc(4 * this.breakpoints.length);
 		for (let i = 0; i < this.breakpoints.length; i++) {
 			let bp = this.breakpoints[i];
-			for (let j = 0; j < addressToLine.length; j++) {
-				if (addressToLine[j] == bp.lineNumber && addressToFile[j].fileName().toString() == bp.filename) {
-					ulang.setUint32(p, j * 4);
+			for (let j = 0; j < lineRanges.length; j++) {
+				if (lineRanges[j].line == bp.lineNumber && fileNames[lineRanges[j].file] == bp.filename) {
+					ulang.setUint32(p, lineRanges[j].address * 4);
 					p += 4;
 					this.numBps++;
 					break;
@@ -263,17 +263,14 @@ export class VirtualMachine {
 	getCurrentLine () {
 		if (this.state != VirtualMachineState.Paused) return -1;
 		let pc = this.vm.registers()[15].ui() >> 2;
-		let addressToLine: number[] = this.vm.program().addressToLine();
-		if (pc >= addressToLine.length) return -1;
-		return addressToLine[pc];
+		let line = this.vm.program().getLine(pc).line;
+		return line ? line : -1;
 	}
 
 	getCurrentFile () {
 		if (this.state != VirtualMachineState.Paused) return null;
 		let pc = this.vm.registers()[15].ui() >> 2;
-		let addressToFile = this.vm.program().addressToFile();
-		if (pc >= addressToFile.length) return null;
-		return addressToFile[pc];
+		return this.vm.program().getLine(pc).file;
 	}
 
 	getState () {
@@ -15,9 +15,15 @@ let ulang_file_from_memory: (namePtr: number, dataPtr: number, filePtr: number)
 let ulang_file_free: (filePtr: number) => void;
 let ulang_error_print: (errorPtr: number) => void;
 let ulang_error_free: (errorPtr: number) => void;
-let ulang_compile: (filenamePtr: number, fileReadFunctionPtr: number, programPtr: number, errorPtr: number) => number;
+let ulang_compile: (filenamePtr: number, fileReadFunctionPtr: number, programPtr: number, errorPtr: number, allocatorPtr: number) => number;
+let ulang_compile_cache_new: (allocatorPtr: number) => number;
+let ulang_compile_cached: (cachePtr: number, filenamePtr: number, fileReadFunctionPtr: number, programPtr: number, errorPtr: number) => number;
+let ulang_compile_cache_get_stats: (cachePtr: number, statsPtr: number) => void;
+let ulang_compile_cache_free: (cachePtr: number) => void;
 let ulang_program_free: (programPtr: number) => void;
-let ulang_vm_init: (vmPtr: number, programPtr: number) => void;
+let ulang_program_get_line: (programPtr: number, address: number, filePtrPtr: number) => number;
+let ulang_program_strip: (programPtr: number) => void;
+let ulang_vm_init: (vmPtr: number, programPtr: number, allocatorPtr: number) => void;
 let ulang_vm_step: (vmPtr: number) => number;
 let ulang_vm_step_n: (vmPtr: number, n: number) => number;
 let ulang_vm_step_n_bp: (vmPtr: number, n: number, bpPtr: number, numBp: number) => number;
@@ -53,9 +59,15 @@ export function createWrappers () {
 	ulang_file_free = module.cwrap("ulang_file_free", "void", ["ptr"])
 	ulang_error_print = module.cwrap("ulang_error_print", "void", ["ptr"]);
 	ulang_error_free = module.cwrap("ulang_error_free", "void", ["ptr"]);
-	ulang_compile = module.cwrap("ulang_compile", "number", ["ptr", "ptr", "ptr", "ptr"]);
+	ulang_compile = module.cwrap("ulang_compile", "number", ["ptr", "ptr", "ptr", "ptr", "ptr"]);
+	ulang_compile_cache_new = module.cwrap("ulang_compile_cache_new", "ptr", ["ptr"]);
+	ulang_compile_cached = module.cwrap("ulang_compile_cached", "number", ["ptr", "ptr", "ptr", "ptr", "ptr"]);
+	ulang_compile_cache_get_stats = module.cwrap("ulang_compile_cache_get_stats", "void", ["ptr", "ptr"]);
+	ulang_compile_cache_free = module.cwrap("ulang_compile_cache_free", "void", ["ptr"]);
 	ulang_program_free = module.cwrap("ulang_program_free", "void", ["ptr"]);
-	ulang_vm_init = module.cwrap("ulang_vm_init", "void", ["ptr", "ptr"]);
+	ulang_program_get_line = module.cwrap("ulang_program_get_line", "number", ["ptr", "number", "ptr"]);
+	ulang_program_strip = module.cwrap("ulang_program_strip", "void", ["ptr"]);
+	ulang_vm_init = module.cwrap("ulang_vm_init", "void", ["ptr", "ptr", "ptr"]);
 	ulang_vm_step = module.cwrap("ulang_vm_step", "number", ["ptr"]);
 	ulang_vm_step_n = module.cwrap("ulang_vm_step_n", "number", ["ptr", "number"]);
 	ulang_vm_step_n_bp = module.cwrap("ulang_vm_step_n_bp", "number", ["ptr", "number", "ptr", "number"]);
@@ -231,6 +243,12 @@ export function ptrToUlangConstant (labelPtr: number): UlangConstant {
 	}
 }
 
+export interface UlangLineRange {
+	address: number;
+	file: number;
+	line: number;
+}
+
 export interface UlangProgram {
 	ptr: number;
 	code (): DataView;
@@ -239,8 +257,9 @@ export interface UlangProgram {
 	labels (): UlangLabel[];
 	constants (): UlangConstant[];
 	files (): UlangFile[];
-	addressToLine (): number[];
-	addressToFile (): UlangFile[];
+	lineRanges (): UlangLineRange[];
+	getLine (address: number): { line: number, file: UlangFile | null };
+	strip (): void;
 	free (): void;
 }
 
@@ -275,30 +294,30 @@ export function ptrToUlangProgram (progPtr: number): UlangProgram {
 			let filesPtr = getUint32(progPtr + 36);
 			let filesLength = getUint32(progPtr + 40);
 			for (let i = 0; i < filesLength; i++) {
-				files.push(ptrToUlangFile(filesPtr));
+				files.push(ptrToUlangFile(getUint32(filesPtr)));
 				filesPtr += 4;
 			}
 			return files;
 		},
-		addressToLine: () => {
-			let addressToLine = [];
-			let addressToLinePtr = getUint32(progPtr + 44);
-			let addressToLineLength = getUint32(progPtr + 48);
-			for (let i = 0; i < addressToLineLength; i++) {
-				addressToLine.push(getUint32(addressToLinePtr));
-				addressToLinePtr += 4;
+		lineRanges: () => {
+			let lineRanges: UlangLineRange[] = [];
+			let lineRangesPtr = getUint32(progPtr + 44);
+			let lineRangesLength = getUint32(progPtr + 48);
+			for (let i = 0; i < lineRangesLength; i++) {
+				lineRanges.push({ address: getUint32(lineRangesPtr), file: getUint32(lineRangesPtr + 4), line: getUint32(lineRangesPtr + 8) });
+				lineRangesPtr += 12;
 			}
-			return addressToLine;
+			return lineRanges;
 		},
-		addressToFile: () => {
-			let addressToFile: UlangFile[] = [];
-			let addressToFilePtr = getUint32(progPtr + 52);
-			let addressToFileLength = getUint32(progPtr + 56);
-			for (let i = 0; i < addressToFileLength; i++) {
-				addressToFile.push(ptrToUlangFile(getUint32(addressToFilePtr)));
-				addressToFilePtr += 4;
-			}
-			return addressToFile;
+		getLine: (address: number) => {
+			let filePtrPtr = ulang_calloc(4);
+			let line = ulang_program_get_line(progPtr, address, filePtrPtr);
+			let filePtr = getUint32(filePtrPtr);
+			ulang_free(filePtrPtr);
+			return { line: line, file: filePtr ? ptrToUlangFile(filePtr) : null };
+		},
+		strip: () => {
+			ulang_program_strip(progPtr);
 		},
 		free: () => {
 			ulang_program_free(progPtr);
@@ -433,7 +452,35 @@ function fileReadFunction (filenamePtr: number, filePtr: number): number {
 
 let fileReaderFunctionPtr: number;
 
-export function compile (filename: string, fileReader: (filename: string) => string): UlangCompilationResult {
+export interface UlangCompileCache {
+	ptr: number;
+	stats (): { tokenHits: number, tokenMisses: number, programHits: number, programMisses: number, unitHits: number, unitMisses: number };
+	free (): void;
+}
+
+export function newCompileCache (): UlangCompileCache {
+	let cachePtr = ulang_compile_cache_new(0);
+	return {
+		ptr: cachePtr,
+		stats: () => {
+			let statsPtr = alloc(24);
+			ulang_compile_cache_get_stats(cachePtr, statsPtr);
+			let stats = {
+				tokenHits: getUint32(statsPtr),
+				tokenMisses: getUint32(statsPtr + 4),
+				programHits: getUint32(statsPtr + 8),
+				programMisses: getUint32(statsPtr + 12),
+				unitHits: getUint32(statsPtr + 16),
+				unitMisses: getUint32(statsPtr + 20)
+			};
+			free(statsPtr);
+			return stats;
+		},
+		free: () => ulang_compile_cache_free(cachePtr)
+	}
+}
+
+export function compile (filename: string, fileReader: (filename: string) => string, cache: UlangCompileCache = null): UlangCompilationResult {
 	if (!fileReaderFunctionPtr) {
 		fileReaderFunctionPtr = module.addFunction(fileReadFunction, "iii");
 	}
@@ -452,14 +499,15 @@ export function compile (filename: string, fileReader: (filename: string) => str
 		},
 	}
 	currentFileReader = fileReader;
-	ulang_compile(filenamePtr, fileReaderFunctionPtr, result.program.ptr, result.error.ptr);
+	if (cache) ulang_compile_cached(cache.ptr, filenamePtr, fileReaderFunctionPtr, result.program.ptr, result.error.ptr);
+	else ulang_compile(filenamePtr, fileReaderFunctionPtr, result.program.ptr, result.error.ptr, 0);
 	module._free(name);
 	return result;
 };
 
 export function newVm (program: UlangProgram) {
 	let vm = ptrToUlangVm(allocType(UlangType.UL_TYPE_VM));
-	ulang_vm_init(vm.ptr, program.ptr);
+	ulang_vm_init(vm.ptr, program.ptr, 0);
 	return vm;
 }
 